@@ -0,0 +1,151 @@
+#include <blurgtext.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+// Times building the same texts on 1 to N threads, each with its own layout context.
+// Every thread does the same number of builds, so with perfect scaling the time
+// stays flat and the builds per second grow with the thread count.
+// Usage: bench_contexts [font.ttf] [max threads] [builds per thread]
+
+#define MAX_THREADS 64
+
+static void tallocate(blurg_texture_t *texture, int width, int height)
+{
+    texture->userdata = NULL;
+}
+
+static void tupdate(blurg_texture_t *texture, void *buffer, int x, int y, int width, int height)
+{
+}
+
+// contexts require deferred uploads, flushed on the thread owning the blurg_t
+static void tupdateRegions(blurg_texture_t *texture, const void *pixels, int stride, const blurg_region_t *regions, int count)
+{
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *texts[] = {
+    "Well, well. If it isn't the courier. You're late, and the harbour master doesn't like to wait.",
+    "I took the long road past the old mill; the bridge is out again. Nobody told you?",
+    "Fine. Take this letter to the lighthouse keeper before nightfall, and don't open it.",
+    "Tell her the ships from Varna arrive on the fourteenth, not the twelfth. She'll understand.",
+};
+#define TEXT_COUNT (sizeof(texts) / sizeof(texts[0]))
+
+typedef struct {
+    blurg_context_t *context;
+    blurg_formatted_text_t *formatted;
+    int builds;
+} worker;
+
+#ifdef _WIN32
+static DWORD WINAPI worker_run(LPVOID param)
+#else
+static void *worker_run(void *param)
+#endif
+{
+    worker *w = param;
+    for(int i = 0; i < w->builds; i++) {
+        blurg_result_t result;
+        blurg_context_build_formatted(w->context, w->formatted, TEXT_COUNT, 0, 300, &result);
+        blurg_free_result(&result);
+    }
+    return 0;
+}
+
+static double run_threads(worker *workers, int threadCount)
+{
+    double start = now_seconds();
+#ifdef _WIN32
+    HANDLE threads[MAX_THREADS];
+    for(int i = 0; i < threadCount; i++) {
+        threads[i] = CreateThread(NULL, 0, worker_run, &workers[i], 0, NULL);
+    }
+    WaitForMultipleObjects(threadCount, threads, TRUE, INFINITE);
+    for(int i = 0; i < threadCount; i++) {
+        CloseHandle(threads[i]);
+    }
+#else
+    pthread_t threads[MAX_THREADS];
+    for(int i = 0; i < threadCount; i++) {
+        pthread_create(&threads[i], NULL, worker_run, &workers[i]);
+    }
+    for(int i = 0; i < threadCount; i++) {
+        pthread_join(threads[i], NULL);
+    }
+#endif
+    return now_seconds() - start;
+}
+
+int main(int argc, char **argv)
+{
+    const char *fontFile = argc > 1 ? argv[1] : "Roboto-Regular.ttf";
+    int maxThreads = argc > 2 ? atoi(argv[2]) : 8;
+    int builds = argc > 3 ? atoi(argv[3]) : 2000;
+    if(maxThreads < 1 || maxThreads > MAX_THREADS) {
+        fprintf(stderr, "thread count must be between 1 and %d\n", MAX_THREADS);
+        return 1;
+    }
+    blurg_t *blurg = blurg_create(tallocate, tupdate);
+    blurg_set_deferred_uploads(blurg, tupdateRegions, 1);
+    blurg_font_t *font = blurg_font_add_file(blurg, fontFile);
+    if(!font) {
+        fprintf(stderr, "could not load %s\n", fontFile);
+        return 1;
+    }
+    blurg_formatted_text_t formatted[TEXT_COUNT];
+    for(int i = 0; i < TEXT_COUNT; i++) {
+        formatted[i] = (blurg_formatted_text_t){
+            .text = texts[i],
+            .encoding = blurg_encoding_utf8,
+            .alignment = blurg_align_left,
+            .defaultFont = font,
+            .defaultSize = 16,
+            .defaultColor = 0xFFFFFFFF,
+            .defaultUnderline = BLURG_NO_UNDERLINE,
+            .defaultShadow = BLURG_NO_SHADOW,
+        };
+    }
+    worker workers[MAX_THREADS];
+    for(int i = 0; i < maxThreads; i++) {
+        workers[i].context = blurg_context_create(blurg);
+        if(!workers[i].context) {
+            fprintf(stderr, "could not create layout context\n");
+            return 1;
+        }
+        workers[i].formatted = formatted;
+        // warm up the context's font copies and shape cache
+        workers[i].builds = 10;
+        worker_run(&workers[i]);
+        workers[i].builds = builds;
+    }
+    blurg_flush_uploads(blurg);
+
+    double single = 0;
+    for(int threadCount = 1; threadCount <= maxThreads; threadCount++) {
+        double elapsed = run_threads(workers, threadCount);
+        double perSecond = threadCount * builds / elapsed;
+        if(threadCount == 1) {
+            single = perSecond;
+        }
+        printf("%2d threads: %8.3f ms, %10.0f builds/s, %.2fx\n", threadCount, elapsed * 1000, perSecond, perSecond / single);
+    }
+    for(int i = 0; i < maxThreads; i++) {
+        blurg_context_destroy(workers[i].context);
+    }
+    blurg_destroy(blurg);
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include <blurgtext.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Times building Latin, Greek and Cyrillic text with the simple text fast path
+// disabled and enabled. The shape cache is disabled so every build shapes its text.
+// Usage: bench_fastpath [font.ttf] [iterations]
+
+static void tallocate(blurg_texture_t *texture, int width, int height)
+{
+    texture->userdata = NULL;
+}
+
+static void tupdate(blurg_texture_t *texture, void *buffer, int x, int y, int width, int height)
+{
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *texts[] = {
+    "The office staff waffled for a while, then flew to the fjord. AVATAR, Type, LTA, Wave, ToY.",
+    "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore.",
+    "\xce\x94\xce\xad\xce\xbb\xcf\x84\xce\xb1 \xce\xb1\xce\xbb\xcf\x86\xce\xac\xce\xb2\xce\xb7\xcf\x84\xce\xbf \xce\xba\xce\xb1\xce\xb9 \xcf\x84\xcf\x8d\xcf\x80\xce\xbf\xcf\x82 12345.",
+    "\xd0\xa2\xd0\xb5\xd1\x81\xd1\x82 \xd0\xba\xd0\xb8\xd1\x80\xd0\xb8\xd0\xbb\xd0\xbb\xd0\xb8\xd1\x86\xd1\x8b, \xd0\x93\xd0\xa3\xd0\x94 \xd0\xb8 \xd0\xa2\xd0\xa3\xd0\x9b\xd0\x90.",
+};
+#define TEXT_COUNT (sizeof(texts) / sizeof(texts[0]))
+
+static double run(blurg_font_t *font, blurg_t *blurg, int fastPath, int iterations, uint64_t *fastChunks)
+{
+    blurg_formatted_text_t formatted[TEXT_COUNT];
+    for(int i = 0; i < TEXT_COUNT; i++) {
+        formatted[i] = (blurg_formatted_text_t){
+            .text = texts[i],
+            .encoding = blurg_encoding_utf8,
+            .alignment = blurg_align_left,
+            .defaultFont = font,
+            .defaultSize = 16,
+            .defaultColor = 0xFFFFFFFF,
+            .defaultUnderline = BLURG_NO_UNDERLINE,
+            .defaultShadow = BLURG_NO_SHADOW,
+        };
+    }
+    blurg_set_fast_path(blurg, fastPath);
+    blurg_stats_t before, after;
+    blurg_get_stats(blurg, &before);
+    double start = now_seconds();
+    for(int i = 0; i < iterations; i++) {
+        blurg_result_t result;
+        blurg_build_formatted(blurg, formatted, TEXT_COUNT, 0, 400, &result);
+        blurg_free_result(&result);
+    }
+    double elapsed = now_seconds() - start;
+    blurg_get_stats(blurg, &after);
+    *fastChunks = after.fastPathChunks - before.fastPathChunks;
+    return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    const char *fontFile = argc > 1 ? argv[1] : "Roboto-Regular.ttf";
+    int iterations = argc > 2 ? atoi(argv[2]) : 2000;
+    blurg_t *blurg = blurg_create(tallocate, tupdate);
+    blurg_font_t *font = blurg_font_add_file(blurg, fontFile);
+    if(!font) {
+        fprintf(stderr, "could not load %s\n", fontFile);
+        return 1;
+    }
+    blurg_set_shape_cache_size(blurg, 0);
+    uint64_t chunks;
+    // warm up the glyph atlas and the fast path's tables
+    run(font, blurg, 1, 10, &chunks);
+    run(font, blurg, 0, 10, &chunks);
+    double full = run(font, blurg, 0, iterations, &chunks);
+    printf("fast path off: %8.3f ms, %8.1f us/build\n", full * 1000, full * 1e6 / iterations);
+    double fast = run(font, blurg, 1, iterations, &chunks);
+    printf("fast path on:  %8.3f ms, %8.1f us/build, %llu fast chunks\n", fast * 1000, fast * 1e6 / iterations, (unsigned long long)chunks);
+    printf("speedup: %.2fx\n", full / fast);
+    blurg_destroy(blurg);
+    return 0;
+}
@@ -0,0 +1,78 @@
+#include <blurgtext.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Times atlas lookups of glyphs that are already rasterized. Every glyph of the
+// text hits the atlas, and shaping comes from the shape cache.
+// Configure with -DBT_DISABLE_GLYPH_TABLES=ON to measure the glyph map alone.
+// Usage: bench_glyphtable [font.ttf] [iterations]
+
+static void tallocate(blurg_texture_t *texture, int width, int height)
+{
+    texture->userdata = NULL;
+}
+
+static void tupdate(blurg_texture_t *texture, void *buffer, int x, int y, int width, int height)
+{
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *text =
+    "The quick brown fox jumps over the lazy dog. Pack my box with five dozen liquor jugs! "
+    "Sphinx of black quartz, judge my vow. 0123456789 (){}[]<>+-*/=%$#@&";
+
+static const float sizes[] = { 12, 16, 24 };
+#define SIZE_COUNT (sizeof(sizes) / sizeof(sizes[0]))
+
+int main(int argc, char **argv)
+{
+    const char *fontFile = argc > 1 ? argv[1] : "Roboto-Regular.ttf";
+    int iterations = argc > 2 ? atoi(argv[2]) : 20000;
+    blurg_t *blurg = blurg_create(tallocate, tupdate);
+    blurg_font_t *font = blurg_font_add_file(blurg, fontFile);
+    if(!font) {
+        fprintf(stderr, "could not load %s\n", fontFile);
+        return 1;
+    }
+    blurg_formatted_text_t formatted[SIZE_COUNT];
+    for(int i = 0; i < SIZE_COUNT; i++) {
+        formatted[i] = (blurg_formatted_text_t){
+            .text = text,
+            .encoding = blurg_encoding_utf8,
+            .alignment = blurg_align_left,
+            .defaultFont = font,
+            .defaultSize = sizes[i],
+            .defaultColor = 0xFFFFFFFF,
+            .defaultUnderline = BLURG_NO_UNDERLINE,
+            .defaultShadow = BLURG_NO_SHADOW,
+        };
+    }
+    // the buffer stops allocating once it is large enough
+    blurg_result_buffer_t buffer = { 0 };
+    // rasterize every glyph and fill the shape cache
+    blurg_build_formatted_buffer(blurg, formatted, SIZE_COUNT, 0, 0, &buffer);
+
+    blurg_stats_t before, after;
+    blurg_get_stats(blurg, &before);
+    double start = now_seconds();
+    for(int i = 0; i < iterations; i++) {
+        blurg_build_formatted_buffer(blurg, formatted, SIZE_COUNT, 0, 0, &buffer);
+    }
+    double elapsed = now_seconds() - start;
+    blurg_get_stats(blurg, &after);
+
+    uint64_t hits = after.atlasHits - before.atlasHits;
+    uint64_t misses = after.atlasMisses - before.atlasMisses;
+    printf("%llu atlas hits, %llu misses in %.3f ms\n", (unsigned long long)hits, (unsigned long long)misses, elapsed * 1000);
+    printf("%.1f ns/glyph, %.2f M glyphs/s\n", elapsed * 1e9 / hits, hits / elapsed / 1e6);
+    blurg_free_result_buffer(&buffer);
+    blurg_destroy(blurg);
+    return 0;
+}
@@ -0,0 +1,139 @@
+#include <blurgtext.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Builds texts with the simple text fast path disabled and enabled and checks the
+// rects, cursors and sizes are identical. Returns non-zero if any build differs.
+// Usage: compare_fastpath [font.ttf ...], defaults to the bundled Roboto faces
+
+static void tallocate(blurg_texture_t *texture, int width, int height)
+{
+    texture->userdata = NULL;
+}
+
+static void tupdate(blurg_texture_t *texture, void *buffer, int x, int y, int width, int height)
+{
+}
+
+static const char *defaultFonts[] = {
+    "Roboto-Regular.ttf",
+    "Roboto-Bold.ttf",
+    "Roboto-Italic.ttf",
+    "Roboto-BoldItalic.ttf",
+    "Roboto-ThinItalic.ttf",
+    "Roboto-Black.ttf",
+};
+
+static const char *texts[] = {
+    // ligatures and kerning pairs
+    "The office staff waffled for a while, then flew to the fjord. AVATAR, Type, LTA, Wave, ToY.",
+    "ff fi fl ffi ffl Te To Tr Ty Va Vo We Wo Yo P. F, L' r. y, \"A\" 'J'",
+    "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore.",
+    "0123456789 (){}[]<>+-*/=%$#@&!? \xc2\xab\xc3\x80\xc3\xa9\xc3\xaf\xc3\xb1\xc3\x98\xc3\x9f\xc2\xbb",
+    // Greek and Cyrillic
+    "\xce\x94\xce\xad\xce\xbb\xcf\x84\xce\xb1 \xce\xb1\xce\xbb\xcf\x86\xce\xac\xce\xb2\xce\xb7\xcf\x84\xce\xbf \xce\xba\xce\xb1\xce\xb9 \xcf\x84\xcf\x8d\xcf\x80\xce\xbf\xcf\x82 12345.",
+    "\xd0\xa2\xd0\xb5\xd1\x81\xd1\x82 \xd0\xba\xd0\xb8\xd1\x80\xd0\xb8\xd0\xbb\xd0\xbb\xd0\xb8\xd1\x86\xd1\x8b, \xd0\x93\xd0\xa3\xd0\x94 \xd0\xb8 \xd0\xa2\xd0\xa3\xd0\x9b\xd0\x90.",
+    // mixed scripts and a combining mark take the full path
+    "Latin \xce\x94\xce\xad\xce\xbb\xcf\x84\xce\xb1 \xd0\xa2\xd0\xb5\xd1\x81\xd1\x82 e\xcc\x81",
+};
+#define TEXT_COUNT (sizeof(texts) / sizeof(texts[0]))
+
+static const float sizes[] = { 9, 12, 16, 23.5f, 40 };
+#define SIZE_COUNT (sizeof(sizes) / sizeof(sizes[0]))
+
+static const float widths[] = { 0, 300, 120 };
+#define WIDTH_COUNT (sizeof(widths) / sizeof(widths[0]))
+
+static int rects_equal(const blurg_result_t *a, const blurg_result_t *b)
+{
+    if(a->rectCount != b->rectCount || a->width != b->width || a->height != b->height) {
+        return 0;
+    }
+    for(int i = 0; i < a->rectCount; i++) {
+        const blurg_rect_t *ra = &a->rects[i];
+        const blurg_rect_t *rb = &b->rects[i];
+        if(ra->texture != rb->texture || ra->x != rb->x || ra->y != rb->y ||
+           ra->width != rb->width || ra->height != rb->height ||
+           ra->u0 != rb->u0 || ra->v0 != rb->v0 || ra->u1 != rb->u1 || ra->v1 != rb->v1 ||
+           ra->color != rb->color) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int cursors_equal(const blurg_result_t *a, const blurg_result_t *b)
+{
+    if(a->cursorCount != b->cursorCount) {
+        return 0;
+    }
+    return !a->cursorCount || !memcmp(a->cursors, b->cursors, a->cursorCount * sizeof(blurg_cursor_t));
+}
+
+static void build(blurg_t *blurg, blurg_formatted_text_t *text, int fastPath, int measureCursor, float maxWidth, blurg_result_t *result)
+{
+    blurg_set_fast_path(blurg, fastPath);
+    blurg_build_formatted(blurg, text, 1, measureCursor, maxWidth, result);
+}
+
+int main(int argc, char **argv)
+{
+    const char **fonts = argc > 1 ? (const char**)&argv[1] : defaultFonts;
+    int fontCount = argc > 1 ? argc - 1 : (int)(sizeof(defaultFonts) / sizeof(defaultFonts[0]));
+    blurg_t *blurg = blurg_create(tallocate, tupdate);
+    // shaped results are cached without regard to the path that produced them
+    blurg_set_shape_cache_size(blurg, 0);
+    int builds = 0;
+    int failures = 0;
+    for(int f = 0; f < fontCount; f++) {
+        blurg_font_t *font = blurg_font_add_file(blurg, fonts[f]);
+        if(!font) {
+            fprintf(stderr, "could not load %s\n", fonts[f]);
+            return 2;
+        }
+        blurg_stats_t before, after;
+        blurg_get_stats(blurg, &before);
+        int fontFailures = 0;
+        for(int t = 0; t < TEXT_COUNT; t++) {
+            for(int s = 0; s < SIZE_COUNT; s++) {
+                for(int w = 0; w < WIDTH_COUNT; w++) {
+                    blurg_formatted_text_t text = {
+                        .text = texts[t],
+                        .encoding = blurg_encoding_utf8,
+                        .alignment = blurg_align_left,
+                        .defaultFont = font,
+                        .defaultSize = sizes[s],
+                        .defaultColor = 0xFFFFFFFF,
+                        .defaultUnderline = BLURG_NO_UNDERLINE,
+                        .defaultShadow = BLURG_NO_SHADOW,
+                    };
+                    // cursors always come from the shaper, so builds measuring them
+                    // are compared against builds without them
+                    blurg_result_t shaped, fast, fastCursors;
+                    build(blurg, &text, 0, 1, widths[w], &shaped);
+                    build(blurg, &text, 1, 0, widths[w], &fast);
+                    build(blurg, &text, 1, 1, widths[w], &fastCursors);
+                    builds++;
+                    if(!rects_equal(&shaped, &fast) || !rects_equal(&shaped, &fastCursors) ||
+                       !cursors_equal(&shaped, &fastCursors)) {
+                        if(!fontFailures) {
+                            fprintf(stderr, "%s: text %d size %g width %g differs\n", fonts[f], t, sizes[s], widths[w]);
+                        }
+                        fontFailures++;
+                    }
+                    blurg_free_result(&shaped);
+                    blurg_free_result(&fast);
+                    blurg_free_result(&fastCursors);
+                }
+            }
+        }
+        blurg_get_stats(blurg, &after);
+        printf("%-24s %4d builds, %5llu fast path chunks, %d differ\n", fonts[f], (int)(TEXT_COUNT * SIZE_COUNT * WIDTH_COUNT),
+            (unsigned long long)(after.fastPathChunks - before.fastPathChunks), fontFailures);
+        failures += fontFailures;
+    }
+    printf("%d of %d builds differ\n", failures, builds);
+    blurg_destroy(blurg);
+    return failures ? 1 : 0;
+}
@@ -9,6 +9,7 @@ namespace BlurgText
         public struct blurg_texture_t
         {
             public IntPtr userdata;
+            public int format;
         }
 
         public enum blurg_encoding_t
@@ -15,8 +15,11 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
 
 typedef struct _blurg blurg_t;
+typedef struct _blurg_layout blurg_layout_t;
+typedef struct _blurg_context blurg_context_t;
 
 #define BLURG_WEIGHT_THIN (100)
 #define BLURG_WEIGHT_EXTRALIGHT (200)
@@ -56,8 +59,45 @@ typedef struct _blurg_shadow {
 
 #define BLURG_NO_SHADOW ((blurg_shadow_t) { .color = 0, .pixels = 0 })
 
+typedef enum {
+    // 32-bit pixels, 0xAARRGGBB in memory order B,G,R,A
+    blurg_texture_format_rgba = 0,
+    // 8-bit coverage, sample as alpha and multiply by the rect color
+    blurg_texture_format_r8 = 1,
+    // 8-bit signed distance field, 128 is the glyph outline and larger values are inside.
+    // See blurg_set_sdf
+    blurg_texture_format_sdf = 2
+} blurg_texture_format_t;
+
+typedef enum {
+    // all glyphs are stored in RGBA pages
+    blurg_atlas_rgba = 0,
+    // grayscale glyphs are stored in R8 pages, color glyphs in RGBA pages
+    blurg_atlas_split = 1
+} blurg_atlas_mode_t;
+
+typedef enum {
+    // glyphs are rasterized at the requested size
+    blurg_size_exact = 0,
+    // rasterized at the nearest multiple of step (0.5 for half points, 1 for whole pixels)
+    blurg_size_step = 1,
+    // rasterized at the nearest power of step (e.g. 1.05 for buckets 5% apart)
+    blurg_size_geometric = 2
+} blurg_size_policy_t;
+
+/*
+ * A task of a parallel for, called with each index from 0 to count - 1
+*/
+typedef void (*blurg_task)(void *taskData, int index);
+/*
+ * Calls task(taskData, i) for every i in [0, count), on any threads, and returns once all calls have finished
+*/
+typedef void (*blurg_parallel_for)(void *userdata, blurg_task task, void *taskData, int count);
+
 typedef struct _blurg_texture {
     void* userdata;
+    // set before textureAllocate is called, and reachable from each rect
+    blurg_texture_format_t format;
 } blurg_texture_t;
 
 typedef struct _blurg_rect {
@@ -73,6 +113,30 @@ typedef struct _blurg_rect {
     blurg_color_t color;
 } blurg_rect_t;
 
+/*
+ * Compact rect for uploading directly as per-instance vertex data, 24 bytes.
+ * x, y, width and height are pixels clamped to -32768..32767, text placed further out is pinned to that edge.
+ * Texel coordinates are in pixels of the atlas page (0 to 1024), find its texture with blurg_atlas_page_texture.
+ * Underlines and backgrounds have u0 == u1 and v0 == v1, sample the centre of that texel, which is white.
+ * That stretch is why both texel corners are stored rather than derived from the size, leaving 6 bytes for
+ * color and page, padded to the 4 byte alignment of color
+*/
+typedef struct _blurg_packed_rect {
+    int16_t x;
+    int16_t y;
+    int16_t width;
+    int16_t height;
+    uint16_t u0;
+    uint16_t v0;
+    uint16_t u1;
+    uint16_t v1;
+    blurg_color_t color;
+    // an atlas has at most 48 pages
+    uint16_t page;
+    // always 0, explicit padding
+    uint16_t reserved;
+} blurg_packed_rect_t;
+
 typedef struct _blurg_cursor {
     int x;
     int y;
@@ -88,6 +152,28 @@ typedef struct _blurg_result_t {
     blurg_cursor_t *cursors;
 } blurg_result_t;
 
+// A text of a blurg_layout_t, rects and cursors are relative to the text drawn at (0, y)
+typedef struct _blurg_layout_text_t {
+    float y;
+    float height;
+    int rectCount;
+    const blurg_rect_t *rects;
+    int cursorCount;
+    const blurg_cursor_t *cursors;
+} blurg_layout_text_t;
+
+// Result owned by the caller and reused between builds, zero initialize before the first build
+typedef struct _blurg_result_buffer {
+    float width;
+    float height;
+    int rectCount;
+    int rectCapacity;
+    blurg_rect_t *rects;
+    int cursorCount;
+    int cursorCapacity;
+    blurg_cursor_t *cursors;
+} blurg_result_buffer_t;
+
 
 typedef struct _blurg_style_span {
     int startIndex;
@@ -127,11 +213,91 @@ typedef struct _blurg_formatted_text {
   blurg_shadow_t defaultShadow;
 } blurg_formatted_text_t;
 
+// Independent texts laid out together like one call to blurg_build_formatted
+typedef struct _blurg_batch_item {
+    blurg_formatted_text_t *texts;
+    int count;
+    float maxWidth;
+} blurg_batch_item_t;
+
+// Rects of one item are rects[rectStart] to rects[rectStart + rectCount - 1]
+typedef struct _blurg_batch_range {
+    float width;
+    float height;
+    int rectStart;
+    int rectCount;
+} blurg_batch_range_t;
+
+typedef struct _blurg_batch_result {
+    int rectCount;
+    blurg_rect_t *rects;
+    int itemCount;
+    blurg_batch_range_t *items;
+} blurg_batch_result_t;
+
+typedef struct _blurg_stats {
+    // shaping cache
+    uint64_t shapeCacheHits;
+    uint64_t shapeCacheMisses;
+    uint64_t shapeCacheEvictions;
+    int shapeCacheEntries;
+    size_t shapeCacheBytes;
+    // chunks laid out by the simple text fast path
+    uint64_t fastPathChunks;
+    // glyph atlas
+    int atlasPages;
+    uint64_t atlasEvictions;
+    uint32_t atlasGeneration;
+    // glyph lookups found in the atlas, and glyphs rasterized
+    uint64_t atlasHits;
+    uint64_t atlasMisses;
+    // glyphs drawn as empty rects because the atlas was full of glyphs used this frame
+    uint64_t atlasDropped;
+    // heap allocations made by the last build on its thread, a warmed up build into a
+    // blurg_result_buffer_t makes none. -1 unless compiled with BT_COUNT_ALLOCATIONS
+    int64_t buildAllocations;
+    // size of the arena holding temporary memory of builds
+    size_t arenaBytes;
+} blurg_stats_t;
+
 typedef void (*blurg_texture_allocate)(blurg_texture_t *texture, int width, int height);
 typedef void (*blurg_texture_update)(blurg_texture_t *texture, void *buffer, int x, int y, int width, int height);
 
+typedef struct _blurg_region {
+    int x;
+    int y;
+    int width;
+    int height;
+} blurg_region_t;
+
+/*
+ * Uploads several regions of a texture at once. pixels holds the whole texture in its format,
+ * with rows stride pixels apart, so region pixels start at pixels + (y * stride + x) * pixel size
+*/
+typedef void (*blurg_texture_update_regions)(blurg_texture_t *texture, const void *pixels, int stride, const blurg_region_t *regions, int regionCount);
+
 BLURGAPI blurg_t *blurg_create(blurg_texture_allocate textureAllocate, blurg_texture_update textureUpdate);
 
+/*
+ * Memory callbacks for blurg_create_ex. userdata is passed to each of them.
+ * reallocate and release are called with pointers returned by allocate or reallocate,
+ * release is not called with NULL. Memory must be aligned for any type, like malloc
+*/
+typedef struct _blurg_allocator {
+    void *(*allocate)(void *userdata, size_t size);
+    void *(*reallocate)(void *userdata, void *ptr, size_t size);
+    void (*release)(void *userdata, void *ptr);
+    void *userdata;
+} blurg_allocator_t;
+
+/*
+ * Like blurg_create, with the memory of blurg, its fonts, FreeType and the results
+ * of builds coming from allocator. The allocator is copied, and has to stay usable until
+ * every result and the blurg_t are freed. NULL uses malloc.
+ * Memory allocated inside HarfBuzz, raqm and fontconfig still comes from malloc
+*/
+BLURGAPI blurg_t *blurg_create_ex(blurg_texture_allocate textureAllocate, blurg_texture_update textureUpdate, const blurg_allocator_t *allocator);
+
 /*
  * Enables querying fonts from the system
  * Returns 0 on failure or if system font support is not compiled in
@@ -168,6 +334,30 @@ BLURGAPI void blurg_build_string_utf16(blurg_t *blurg, blurg_font_t *font, float
  * This function does not take ownership of any members of blurg_formatted_text_t
 */
 BLURGAPI void blurg_build_formatted(blurg_t *blurg, blurg_formatted_text_t *texts, int count, int measureCursor, float maxWidth, blurg_result_t *result);
+/*
+ * Same as blurg_build_formatted, writing into *buffer instead of a new allocation.
+ * The arrays of buffer only grow, so a buffer reused every frame stops allocating once it is large enough.
+ * Free it with blurg_free_result_buffer
+*/
+BLURGAPI void blurg_build_formatted_buffer(blurg_t *blurg, blurg_formatted_text_t *texts, int count, int measureCursor, float maxWidth, blurg_result_buffer_t *buffer);
+/*
+ * Same as blurg_build_formatted without cursors, writing rects into a caller provided array.
+ * Returns the number of rects, if this is larger than capacity nothing is written to rects
+ * and the build should be repeated with a larger array
+*/
+BLURGAPI int blurg_build_formatted_rects(blurg_t *blurg, blurg_formatted_text_t *texts, int count, float maxWidth, blurg_rect_t *rects, int capacity, float *width, float *height);
+/*
+ * Same as blurg_build_formatted_rects, writing blurg_packed_rect_t. Rects with no area (e.g. spaces) are skipped,
+ * as are rects whose texture is not an atlas page. Positions are clamped to the range of int16_t
+*/
+BLURGAPI int blurg_build_formatted_packed(blurg_t *blurg, blurg_formatted_text_t *texts, int count, float maxWidth, blurg_packed_rect_t *rects, int capacity, float *width, float *height);
+/*
+ * Builds many independent items in one call, writing the rects of all items into one array in *result.
+ * Each item is positioned from 0,0 as if built with blurg_build_formatted (without cursors).
+ * Lines, layers and the rect array are shared between items, and with blurg_set_task_scheduler
+ * the texts of all items are shaped in parallel. Free the result with blurg_free_batch_result
+*/
+BLURGAPI void blurg_build_batch(blurg_t *blurg, const blurg_batch_item_t *items, int itemCount, blurg_batch_result_t *result);
 
 /*
  * Measures the provided string, size is written to width+height
@@ -178,8 +368,187 @@ BLURGAPI void blurg_measure_string_utf16(blurg_t *blurg, blurg_font_t *font, flo
  * Measures the provided formatted texts, size is written to width+height
 */
 BLURGAPI void blurg_measure_formatted(blurg_t *blurg, blurg_formatted_text_t *texts, int count, float maxWidth, float* width, float *height);
+/*
+ * Creates a context for building text on another thread. Each context has its own copies of the
+ * fonts it uses and its own shaping cache, and adds glyphs to the atlas of blurg. Contexts can build
+ * in parallel with each other and with blurg. Requires deferred uploads (blurg_set_deferred_uploads),
+ * so textures are only allocated and updated in blurg_flush_uploads on the thread owning blurg.
+ * Fonts must be added to blurg from a file or memory. Don't add fonts or change settings of blurg while
+ * contexts are building. Returns NULL if uploads are not deferred
+*/
+BLURGAPI blurg_context_t *blurg_context_create(blurg_t *blurg);
+/*
+ * Same as blurg_build_formatted and blurg_measure_formatted, using fonts of the parent blurg_t.
+ * A context must only be used by one thread at a time. The context opens its own copy of each font,
+ * if that fails nothing is built (result and sizes are zeroed) and 0 is returned, otherwise 1
+*/
+BLURGAPI int blurg_context_build_formatted(blurg_context_t *context, blurg_formatted_text_t *texts, int count, int measureCursor, float maxWidth, blurg_result_t *result);
+BLURGAPI int blurg_context_measure_formatted(blurg_context_t *context, blurg_formatted_text_t *texts, int count, float maxWidth, float *width, float *height);
+/*
+ * Destroys a context, must be called before its blurg_t is destroyed
+*/
+BLURGAPI void blurg_context_destroy(blurg_context_t *context);
+/*
+ * Sets a scheduler used by blurg_build_formatted and blurg_measure_formatted to shape paragraphs in parallel.
+ * Glyphs are still rasterized and uploaded afterwards on the calling thread.
+ * Fonts must be added from a file or memory. NULL shapes on the calling thread (the default)
+*/
+BLURGAPI void blurg_set_task_scheduler(blurg_t *blurg, blurg_parallel_for parallelFor, void *userdata);
 
 BLURGAPI void blurg_free_result(blurg_result_t *result);
+BLURGAPI void blurg_free_batch_result(blurg_batch_result_t *result);
+BLURGAPI void blurg_free_result_buffer(blurg_result_buffer_t *buffer);
+
+/*
+ * Creates a retained layout of formatted texts. The texts and spans are copied and shaped once,
+ * the layout can then be wrapped and built at any width without reshaping.
+ * Cursors are measured in blurg_layout_build if measureCursor is true.
+ * Free with blurg_layout_destroy
+*/
+BLURGAPI blurg_layout_t *blurg_layout_create(blurg_t *blurg, blurg_formatted_text_t *texts, int count, int measureCursor);
+/*
+ * Changes the alignment of the text at index, takes effect on the next build
+*/
+BLURGAPI void blurg_layout_set_alignment(blurg_layout_t *layout, int index, blurg_align_t alignment);
+/*
+ * Inserts text at position (in code units) of the text at index. text is in the encoding of that text,
+ * a textLen of 0 reads a null-terminated string. Nothing is inserted if position splits a character.
+ * The inserted text takes the style of the character before it (after it when inserting at 0): spans after
+ * the position are moved, spans containing it or ending right before it grow.
+ * Only the lines between mandatory breaks that touch the edit are shaped again
+*/
+BLURGAPI void blurg_layout_insert(blurg_layout_t *layout, int index, int position, const void *text, int textLen);
+/*
+ * Deletes count code units at position of the text at index, nothing is deleted if either end splits a character.
+ * Spans are shrunk, spans left empty are removed.
+ * As with blurg_layout_insert, only the lines touching the deleted text are shaped again
+*/
+BLURGAPI void blurg_layout_delete(blurg_layout_t *layout, int index, int position, int count);
+/*
+ * Replaces the style spans of the text at index, the spans are copied
+*/
+BLURGAPI void blurg_layout_set_spans(blurg_layout_t *layout, int index, blurg_style_span_t *spans, int spanCount);
+/*
+ * Wraps the layout to maxWidth and writes rectangles into *result. Free the result with blurg_free_result
+ * Only texts changed since the last build, or all texts if maxWidth or the atlas generation changed, are wrapped again
+*/
+BLURGAPI void blurg_layout_build(blurg_layout_t *layout, float maxWidth, blurg_result_t *result);
+/*
+ * Wraps the layout to maxWidth and keeps the rectangles and cursors of each text in the layout,
+ * read them with blurg_layout_get_text. Unlike blurg_layout_build nothing is copied for texts that did not change.
+ * The texts with new rectangles or cursors are [*first, *first + *count), *count is 0 if none changed.
+ * Texts below a changed text only move, read their new y with blurg_layout_get_text.
+ * Size of the layout is written to width+height, each output may be NULL
+*/
+BLURGAPI void blurg_layout_update(blurg_layout_t *layout, float maxWidth, int *first, int *count, float *width, float *height);
+/*
+ * Gets the output of the text at index from the last blurg_layout_update.
+ * The pointers are owned by the layout and valid until the next update, edit or blurg_layout_destroy
+*/
+BLURGAPI void blurg_layout_get_text(blurg_layout_t *layout, int index, blurg_layout_text_t *text);
+/*
+ * Measures the layout wrapped to maxWidth, size is written to width+height
+*/
+BLURGAPI void blurg_layout_measure(blurg_layout_t *layout, float maxWidth, float *width, float *height);
+BLURGAPI void blurg_layout_destroy(blurg_layout_t *layout);
+
+/*
+ * Sets how glyphs are stored in atlas pages (default blurg_atlas_rgba).
+ * Must be called before anything is built, returns 0 if pages were already allocated
+*/
+BLURGAPI int blurg_set_atlas_mode(blurg_t *blurg, blurg_atlas_mode_t mode);
+/*
+ * Renders outline glyphs as signed distance fields, rasterized once at referenceSize and scaled
+ * to every requested size. They are stored in blurg_texture_format_sdf pages, with a distance of
+ * 8 pixels at referenceSize mapped to 0-255. Color and bitmap glyphs are rasterized as before.
+ * A referenceSize of 0 disables SDF glyphs (the default). Must be called before anything is built,
+ * returns 0 if pages were already allocated or FreeType was built without the SDF renderer
+*/
+BLURGAPI int blurg_set_sdf(blurg_t *blurg, float referenceSize);
+/*
+ * Defers atlas uploads. Rasterized glyphs are copied into a CPU staging copy of their page,
+ * and each page with changes is uploaded by one updateRegions call in blurg_flush_uploads.
+ * If flushOnBuild is 1, uploads are also flushed at the end of every build.
+ * textureUpdate is no longer called, and new pages are allocated in blurg_flush_uploads. Must be called before anything is built,
+ * returns 0 if pages were already allocated
+*/
+BLURGAPI int blurg_set_deferred_uploads(blurg_t *blurg, blurg_texture_update_regions updateRegions, int flushOnBuild);
+/*
+ * Uploads all pending atlas changes, call before drawing rects built since the last flush
+*/
+BLURGAPI void blurg_flush_uploads(blurg_t *blurg);
+/*
+ * Keeps a CPU copy of every atlas page so they can be restored with blurg_atlas_reupload.
+ * Deferred uploads always keep one. Must be called before anything is built,
+ * returns 0 if pages were already allocated
+*/
+BLURGAPI int blurg_set_atlas_mirror(blurg_t *blurg, int enabled);
+/*
+ * Uploads every atlas page again from the CPU copy, e.g. after a device reset.
+ * textureAllocate is called again on each existing blurg_texture_t, followed by one
+ * upload of the whole page. Glyph coordinates don't change, so built rects stay valid.
+ * Returns 0 if there is no CPU copy of the pages
+*/
+BLURGAPI int blurg_atlas_reupload(blurg_t *blurg);
+/*
+ * Saves the glyph atlas (pages, packing and glyphs) to filename. Glyphs are keyed by a hash
+ * of their font file contents, size and flags, so the file can be loaded in a later run.
+ * Requires a CPU copy of the pages (blurg_set_atlas_mirror or deferred uploads). Returns 0 on failure
+*/
+BLURGAPI int blurg_atlas_save(blurg_t *blurg, const char *filename);
+/*
+ * Loads an atlas saved with blurg_atlas_save and uploads each page once. Must be called before
+ * anything is built, after the atlas mode and upload settings. Saved glyphs are used without
+ * rasterizing when their font is loaded with the same contents, glyphs of changed fonts are ignored.
+ * Returns 0 if the file is missing or invalid, or if pages were already allocated
+*/
+BLURGAPI int blurg_atlas_load(blurg_t *blurg, const char *filename);
+/*
+ * Sets which sizes glyphs of scalable fonts are rasterized at (default blurg_size_exact).
+ * Quantized glyphs are scaled in the emitted rects, so animating sizes reuses a few
+ * rasterizations per glyph. Line heights, advances and wrapping use the exact size.
+ * Has no effect on glyphs rendered as signed distance fields (see blurg_set_sdf)
+*/
+BLURGAPI void blurg_set_size_policy(blurg_t *blurg, blurg_size_policy_t policy, float step);
+/*
+ * Starts a new frame. Glyphs used since the last call are never evicted from the atlas,
+ * so rects built during a frame stay valid until it is drawn.
+ * When the atlas is full, pages whose glyphs were not used in the current frame are
+ * evicted least recently used first. Until this function is first called every build
+ * is its own frame, and only the rects of the last build are guaranteed valid.
+ * Once a layout context is created only calls to this function start frames,
+ * glyphs that don't fit are then drawn as empty rects (see atlasDropped in blurg_stats_t).
+*/
+BLURGAPI void blurg_begin_frame(blurg_t *blurg);
+/*
+ * Returns a counter that is incremented every time glyphs are evicted from the atlas.
+ * Rects built before the counter changed may point to overwritten texture areas and must be rebuilt
+*/
+BLURGAPI uint32_t blurg_atlas_generation(blurg_t *blurg);
+/*
+ * Returns the texture of an atlas page referenced by blurg_packed_rect_t, NULL if there is no such page.
+ * The texture of a page never changes
+*/
+BLURGAPI blurg_texture_t *blurg_atlas_page_texture(blurg_t *blurg, int page);
+/*
+ * Sets the memory budget in bytes for cached shaping results (default 2MiB).
+ * Least recently used entries are evicted when over budget, 0 disables the cache.
+*/
+BLURGAPI void blurg_set_shape_cache_size(blurg_t *blurg, size_t bytes);
+/*
+ * Enables or disables the fast path for simple text (default disabled).
+ * Latin, Greek and Cyrillic text without combining marks is laid out from the
+ * font's cmap and advances, applying the default ligatures and pair kerning,
+ * instead of being shaped. Fonts with contextual lookups that could affect the
+ * text are shaped as usual. Only the default language system is used, matching
+ * the shaper with no language set. The rectangles produced should be the same
+ * either way, demo/compare_fastpath checks this for a set of fonts.
+*/
+BLURGAPI void blurg_set_fast_path(blurg_t *blurg, int enabled);
+/*
+ * Writes the current cache statistics into *stats
+*/
+BLURGAPI void blurg_get_stats(blurg_t *blurg, blurg_stats_t *stats);
 /*
  * Destroys a blurg instance and all associated fonts.
  * Does NOT free rectangle arrays returned from blurg_free_*
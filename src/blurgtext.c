@@ -10,6 +10,8 @@
 
 DEFINE_LIST(blurg_rect_t);
 IMPLEMENT_LIST(blurg_rect_t);
+IMPLEMENT_LIST(shape_face_run)
+IMPLEMENT_PTR_LIST(raqm_t)
 
 typedef struct {
     int isBreak;
@@ -20,11 +22,25 @@ typedef struct {
     int paraIndex;
     int rectStarts[LAYER_MAX];
     int rectCounts[LAYER_MAX];
+    // shaped chunks of a hard line
+    int chunkStart;
+    int chunkCount;
 } text_line;
 
 DEFINE_LIST(text_line);
 IMPLEMENT_LIST(text_line);
 
+// A range [start, end) of a paragraph with one style
+// span is an index into the text's spans, or -1 for the defaults
+typedef struct {
+    int start;
+    int end;
+    int span;
+} style_run;
+
+DEFINE_LIST(style_run);
+IMPLEMENT_LIST(style_run);
+
 typedef struct {
     int active;
     blurg_color_t color;
@@ -39,6 +55,43 @@ typedef struct {
     float xStart;
 } active_background;
 
+// a run of a hard line shaped at one size
+typedef struct {
+    int textStart;
+    int textCount;
+    float size;
+    int glyphStart;
+    int glyphCount;
+    int cursorStart;
+} line_chunk;
+
+// a line produced by wrapping a hard line
+typedef struct {
+    int start;
+    int end;
+    int visibleEnd;
+    // whether glyphs shaped across the start/end can be reused
+    int startClean;
+    int endClean;
+} wrapped_line;
+
+DEFINE_LIST(line_chunk);
+IMPLEMENT_LIST(line_chunk);
+DEFINE_LIST(wrapped_line);
+IMPLEMENT_LIST(wrapped_line);
+IMPLEMENT_LIST(raqm_glyph_t);
+DEFINE_LIST(int);
+IMPLEMENT_LIST(int);
+DEFINE_LIST(float);
+IMPLEMENT_LIST(float);
+
+// glyphs shaped for a paragraph, or for a fragment of a line
+typedef struct {
+    list_line_chunk chunks;
+    list_raqm_glyph_t glyphs;
+    list_int cursorPositions;
+} shaped_store;
+
 typedef struct {
     list_text_line *lines;
     int l_background;
@@ -46,30 +99,113 @@ typedef struct {
     int l_underline;
     int l_glyphs;
     list_blurg_rect_t layers[LAYER_MAX];
+    // 0 when measuring
     int layerCount;
+    // scratch for reshaped fragments and line wrapping
+    shaped_store fragment;
+    list_wrapped_line wrapped;
 } build_context;
 
+// FreeType memory hooks, user is the interned allocator of the blurg_t, released after the library
+static void *ft_allocate(FT_Memory memory, long size)
+{
+    const blurg_allocator_t *allocator = memory->user;
+    return allocator->allocate(allocator->userdata, (size_t)size);
+}
+
+static void *ft_reallocate(FT_Memory memory, long currentSize, long newSize, void *block)
+{
+    const blurg_allocator_t *allocator = memory->user;
+    return allocator->reallocate(allocator->userdata, block, (size_t)newSize);
+}
+
+static void ft_release(FT_Memory memory, void *block)
+{
+    const blurg_allocator_t *allocator = memory->user;
+    allocator->release(allocator->userdata, block);
+}
+
+static FT_Error ft_library_create(blurg_t *blurg)
+{
+    if(!blurg->allocator) {
+        return FT_Init_FreeType(&blurg->library);
+    }
+    blurg->ftMemory = malloc(sizeof(*blurg->ftMemory));
+    blurg->ftMemory->user = (void*)blurg->allocator;
+    blurg->ftMemory->alloc = ft_allocate;
+    blurg->ftMemory->realloc = ft_reallocate;
+    blurg->ftMemory->free = ft_release;
+    FT_Error error = FT_New_Library(blurg->ftMemory, &blurg->library);
+    if(error) {
+        free(blurg->ftMemory);
+        return error;
+    }
+    FT_Add_Default_Modules(blurg->library);
+    FT_Set_Default_Properties(blurg->library);
+    return 0;
+}
+
 BLURGAPI blurg_t *blurg_create(blurg_texture_allocate textureAllocate, blurg_texture_update textureUpdate)
 {
+    return blurg_create_ex(textureAllocate, textureUpdate, NULL);
+}
+
+BLURGAPI blurg_t *blurg_create_ex(blurg_texture_allocate textureAllocate, blurg_texture_update textureUpdate, const blurg_allocator_t *allocator)
+{
+    allocator = util_allocator_intern(allocator);
+    const blurg_allocator_t *previousAllocator = util_allocator_enter(allocator);
     blurg_t *blurg = malloc(sizeof(blurg_t));
     memset(blurg, 0, sizeof(blurg_t));
+    blurg->allocator = allocator;
     blurg->textureAllocate = textureAllocate;
     blurg->textureUpdate = textureUpdate;
-    FT_Error error = FT_Init_FreeType(&blurg->library);
+    FT_Error error = ft_library_create(blurg);
     if(error) {
         printf("FT_Init_FreeType failed\n");
         free(blurg);
+        ALLOCATOR_LEAVE();
+        util_allocator_release(allocator);
         return NULL;
     }
     glyphatlas_init(blurg);
+    shapecache_init(blurg);
+    list_p_raqm_t_init(&blurg->shapers, 4);
+    list_shape_face_run_init(&blurg->runScratch, 64);
+    list_raqm_glyph_t_init(&blurg->simpleGlyphs, 64);
+    arena_init(&blurg->arena);
+    // off until compared against the shaper, see blurg_set_fast_path
+    blurg->fastPathEnabled = 0;
     font_manager_init(blurg);
+    ALLOCATOR_LEAVE();
     return blurg;
 }
 
+static void build_scratch_free(blurg_t *blurg);
+
 BLURGAPI void blurg_destroy(blurg_t *blurg)
 {
+    const blurg_allocator_t *allocator = blurg->allocator;
+    ALLOCATOR_ENTER(blurg);
+    // workers use the fonts of blurg
+    context_workers_destroy(blurg);
     glyphatlas_destroy(blurg);
+    shapecache_destroy(blurg);
+    for(int i = 0; i < blurg->shapers.count; i++) {
+        raqm_destroy(blurg->shapers.data[i]);
+    }
+    list_p_raqm_t_free(&blurg->shapers);
+    list_shape_face_run_free(&blurg->runScratch);
+    list_raqm_glyph_t_free(&blurg->simpleGlyphs);
+    build_scratch_free(blurg);
+    arena_free(&blurg->arena);
+    if(blurg->fontClones) {
+        hashmap_free(blurg->fontClones);
+    }
+    if(blurg->lock) {
+        mutex_destroy(blurg->lock);
+    }
     FT_Done_Library(blurg->library);
+    free(blurg->ftMemory);
     font_manager_destroy(blurg);
     #ifdef SYSFONTS
     if(blurg->sysFontData) {
@@ -77,26 +213,49 @@ BLURGAPI void blurg_destroy(blurg_t *blurg)
     }
     #endif
     free(blurg);
+    ALLOCATOR_LEAVE();
+    util_allocator_release(allocator);
 }
 
-static void blurg_get_lines(const void *text, int inLen, int* textLen, blurg_encoding_t encoding, list_text_line *lines, char **breaks, int paraIndex)
+// Shaping contexts are pooled to avoid raqm_create/raqm_destroy per chunk
+static raqm_t *shaper_acquire(blurg_t *blurg)
 {
-    int total;
+    if(blurg->shapers.count) {
+        return blurg->shapers.data[--blurg->shapers.count];
+    }
+    return raqm_create();
+}
+
+static void shaper_release(blurg_t *blurg, raqm_t *rq)
+{
+    // keeps allocated memory for the next chunk
+    raqm_clear_contents(rq);
+    list_p_raqm_t_add(&blurg->shapers, rq);
+}
+
+static int text_length(const void *text, int textLen, blurg_encoding_t encoding)
+{
+    if(textLen > 0)
+        return textLen;
+    return encoding == blurg_encoding_utf16 ? utf16_strlen((utf16_t*)text) : strlen((const char*)text);
+}
+
+// Finds the hard lines of text in [start, end), appending them to lines. start must be 0 or follow
+// a mandatory break, end must be the end of the text or follow a mandatory break.
+// breaks must hold end entries, only [start, end) is written
+static void blurg_get_lines_range(const void *text, int start, int end, blurg_encoding_t encoding, list_text_line *lines, char *breaks, int paraIndex)
+{
+    // line breaking starts over after a mandatory break, so the range is broken on its own
     if(encoding == blurg_encoding_utf16) {
-        total = inLen > 0 ? inLen : utf16_strlen((utf16_t*)text);
-        *breaks = malloc(total);
-        set_linebreaks_utf16((utf16_t*)text, total, NULL, *breaks);
+        set_linebreaks_utf16((const utf16_t*)text + start, end - start, NULL, breaks + start);
     }
     else {
-        total = inLen > 0 ? inLen : strlen((char*)text);
-        *breaks = malloc(total);
-        set_linebreaks_utf8(text, total, NULL, *breaks);
+        set_linebreaks_utf8((const utf8_t*)text + start, end - start, NULL, breaks + start);
     }
-    *textLen = total;
-    int last = 0;
+    int last = start;
     #define CHAR(idx) (encoding == blurg_encoding_utf16 ? (uint8_t)(((uint16_t*)text)[(idx)]) : ((uint8_t*)text)[(idx)])
-    for(int i = 0; i < total; i++) {
-        if((*breaks)[i] == LINEBREAK_MUSTBREAK) {
+    for(int i = start; i < end; i++) {
+        if(breaks[i] == LINEBREAK_MUSTBREAK) {
             int isCRLF = (i - 1 > 0) && CHAR(i-1) == '\r' && CHAR(i) == '\n';
             if(last == i) {
                 list_text_line_add(lines, (text_line){ .isBreak = 1, .textStart = i, .textCount = 1, .paraIndex = paraIndex});
@@ -107,23 +266,150 @@ static void blurg_get_lines(const void *text, int inLen, int* textLen, blurg_enc
         }
     }
     #undef CHAR
-    if(total - last > 0) {
-        list_text_line_add(lines, (text_line){.isBreak = 0, .textStart = last, .textCount = total - last, .paraIndex = paraIndex });
+    if(end - last > 0) {
+        list_text_line_add(lines, (text_line){.isBreak = 0, .textStart = last, .textCount = end - last, .paraIndex = paraIndex });
     }
 }
 
+// breaks must hold total entries
+static void blurg_get_lines(const void *text, int total, blurg_encoding_t encoding, list_text_line *lines, char *breaks, int paraIndex)
+{
+    blurg_get_lines_range(text, 0, total, encoding, lines, breaks, paraIndex);
+}
+
 // style accessors
-#define IDX_FONT(i) ((!attributes || attributes[(i)] == -1) ? text->defaultFont : text->spans[attributes[(i)]].font)
-#define IDX_SIZE(i) ((!attributes || attributes[(i)] == -1) ? text->defaultSize : text->spans[attributes[(i)]].fontSize)
-#define IDX_COLOR(i) ((!attributes || attributes[(i)] == -1) ? text->defaultColor : text->spans[attributes[(i)]].color)
-#define IDX_BACKGROUND(i) ((!attributes || attributes[(i)] == -1) ? text->defaultBackground : text->spans[attributes[(i)]].background)
-#define IDX_UNDERLINE(i) ((!attributes || attributes[(i)] == -1) ? text->defaultUnderline : text->spans[attributes[(i)]].underline)
-#define IDX_SHADOW(i) ((!attributes || attributes[(i)] == -1) ? text->defaultShadow : text->spans[attributes[(i)]].shadow)
+#define SPAN_FONT(s) ((s) == -1 ? text->defaultFont : text->spans[(s)].font)
+#define SPAN_SIZE(s) ((s) == -1 ? text->defaultSize : text->spans[(s)].fontSize)
+#define SPAN_COLOR(s) ((s) == -1 ? text->defaultColor : text->spans[(s)].color)
+#define SPAN_BACKGROUND(s) ((s) == -1 ? text->defaultBackground : text->spans[(s)].background)
+#define SPAN_UNDERLINE(s) ((s) == -1 ? text->defaultUnderline : text->spans[(s)].underline)
+#define SPAN_SHADOW(s) ((s) == -1 ? text->defaultShadow : text->spans[(s)].shadow)
+#define IDX_SPAN(i) (styles->data[style_find(styles, (i))].span)
+
+// returns the index of the style run containing i
+static int style_find(const list_style_run *styles, int i)
+{
+    int lo = 0;
+    int hi = styles->count - 1;
+    while(lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if(styles->data[mid].start <= i) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+typedef struct {
+    int start;
+    int end;
+    int index;
+} span_bounds;
+
+static int span_bounds_compare(const void *a, const void *b)
+{
+    const span_bounds *sa = a;
+    const span_bounds *sb = b;
+    if(sa->start != sb->start)
+        return sa->start < sb->start ? -1 : 1;
+    return sa->index - sb->index;
+}
+
+// max-heap of active spans, the highest span index wins
+static void span_heap_push(int *heap, int *count, const span_bounds *bounds, int value)
+{
+    int i = (*count)++;
+    while(i > 0) {
+        int parent = (i - 1) / 2;
+        if(bounds[heap[parent]].index >= bounds[value].index)
+            break;
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = value;
+}
+
+static void span_heap_pop(int *heap, int *count, const span_bounds *bounds)
+{
+    int value = heap[--(*count)];
+    int i = 0;
+    for(;;) {
+        int child = i * 2 + 1;
+        if(child >= *count)
+            break;
+        if(child + 1 < *count && bounds[heap[child + 1]].index > bounds[heap[child]].index)
+            child++;
+        if(bounds[value].index >= bounds[heap[child]].index)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    if(*count)
+        heap[i] = value;
+}
+
+// Converts the style spans of a text into sorted runs covering [0, total).
+// Where spans overlap, the later span in the array wins
+static void build_style_runs(blurg_t *blurg, blurg_formatted_text_t *text, int total, list_style_run *styles)
+{
+    int n = 0;
+    span_bounds *bounds = NULL;
+    arena_mark mark = arena_save(&blurg->arena);
+    if(text->spans && text->spanCount) {
+        bounds = arena_alloc(&blurg->arena, text->spanCount * sizeof(span_bounds));
+        for(int j = 0; j < text->spanCount; j++) {
+            // range check, endIndex is inclusive
+            int start = text->spans[j].startIndex < 0 ? 0 : text->spans[j].startIndex;
+            int end = text->spans[j].endIndex >= total ? total - 1 : text->spans[j].endIndex;
+            if(start <= end) {
+                bounds[n++] = (span_bounds){ .start = start, .end = end + 1, .index = j };
+            }
+        }
+    }
+    styles->count = 0;
+    list_style_run_ensure_size(styles, 2 * n + 1);
+    if(!n) {
+        list_style_run_add(styles, (style_run){ .start = 0, .end = total, .span = -1 });
+        arena_restore(&blurg->arena, mark);
+        return;
+    }
+    qsort(bounds, n, sizeof(span_bounds), span_bounds_compare);
+    int *heap = arena_alloc(&blurg->arena, n * sizeof(int));
+    int heapCount = 0;
+    int next = 0;
+    int pos = 0;
+    while(pos < total) {
+        while(next < n && bounds[next].start <= pos) {
+            span_heap_push(heap, &heapCount, bounds, next++);
+        }
+        while(heapCount && bounds[heap[0]].end <= pos) {
+            span_heap_pop(heap, &heapCount, bounds);
+        }
+        int span = heapCount ? bounds[heap[0]].index : -1;
+        // style can only change where a span starts or the top span ends
+        int end = total;
+        if(next < n && bounds[next].start < end) {
+            end = bounds[next].start;
+        }
+        if(heapCount && bounds[heap[0]].end < end) {
+            end = bounds[heap[0]].end;
+        }
+        if(styles->count && styles->data[styles->count - 1].span == span) {
+            styles->data[styles->count - 1].end = end;
+        } else {
+            list_style_run_add(styles, (style_run){ .start = pos, .end = end, .span = span });
+        }
+        pos = end;
+    }
+    arena_restore(&blurg->arena, mark);
+}
 
 static void add_underline(blurg_t *b, active_underline ul, float xEnd, list_blurg_rect_t *rb, float y)
 {
     list_blurg_rect_t_add(rb, (blurg_rect_t){
-        .texture = rb->count > 0 ? rb->data[rb->count - 1].texture : b->packed.pages[0],
+        .texture = rb->count > 0 ? rb->data[rb->count - 1].texture : glyphatlas_white_texture(b),
         .u0 = 0.5 / BLURG_TEXTURE_SIZE, //sample centre of pixel, works better.
         .u1 = 0.5 / BLURG_TEXTURE_SIZE,
         .v0 = 0.5 / BLURG_TEXTURE_SIZE,
@@ -139,7 +425,7 @@ static void add_underline(blurg_t *b, active_underline ul, float xEnd, list_blur
 static void add_background(blurg_t *b, active_background ul, float xEnd, list_blurg_rect_t *rb, float y)
 {
     list_blurg_rect_t_add(rb, (blurg_rect_t){
-        .texture = rb->count > 0 ? rb->data[rb->count - 1].texture : b->packed.pages[0],
+        .texture = rb->count > 0 ? rb->data[rb->count - 1].texture : glyphatlas_white_texture(b),
         .u0 = 0.5 / BLURG_TEXTURE_SIZE, //sample centre of pixel, works better.
         .u1 = 0.5 / BLURG_TEXTURE_SIZE,
         .v0 = 0.5 / BLURG_TEXTURE_SIZE,
@@ -204,36 +490,73 @@ static uint32_t get_codepoint(const void *str, blurg_formatted_text_t *text, int
     }
 }
 
-static void raqm_to_rects(
+// Emits rects for the glyphs with clusters in [clusterStart, clusterEnd)
+static void emit_glyphs(
     blurg_t *blurg, 
-    raqm_t *rq, 
+    const raqm_glyph_t *glyphs,
+    size_t count,
+    int clusterStart,
+    int clusterEnd,
     build_context *ctx,
     float *x, 
     float *y, 
-    size_t maxGlyph, 
+    float size,
     blurg_formatted_text_t *text, 
-    int* attributes,
+    const list_style_run *styles,
     int hasShadow,
     int hasUnderline,
     int hasBackground)
 {
-    size_t count;
-    raqm_glyph_t *glyphs = raqm_get_glyphs (rq, &count);
 
     active_underline ul = { .active = 0 };
     active_underline shadow_ul = { .active = 0 };
     active_background bkg = { .active = 0 };
-
-    for(int i = 0; i < count && i < maxGlyph; i++) 
+    blurg_font_t *lastFont = NULL;
+    // style of the current run, looked up when the cluster leaves it
+    int run = -1;
+    blurg_color_t color = 0;
+    blurg_color_t background = 0;
+    blurg_underline_t runUnderline = BLURG_NO_UNDERLINE;
+    blurg_shadow_t shadow = BLURG_NO_SHADOW;
+
+    for(int i = 0; i < count; i++) 
     {
+        if((int)glyphs[i].cluster < clusterStart ||
+           (int)glyphs[i].cluster >= clusterEnd) {
+            continue;
+        }
         blurg_glyph vis;
         blurg_font_t *font = blurg_from_freetype(glyphs[i].ftface);
+        if(font != lastFont) {
+            // fallback fonts aren't sized when glyphs come from the shape cache
+            font_use_size(font, size);
+            lastFont = font;
+        }
+        if(!ctx->layerCount) {
+            // measuring only
+            *x += glyphs[i].x_advance / 64.0 * font->scale;
+            *y += glyphs[i].y_advance / 64.0 * font->scale;
+            continue;
+        }
+        int cluster = (int)glyphs[i].cluster;
+        if(run < 0 || cluster < styles->data[run].start || cluster >= styles->data[run].end) {
+            run = style_find(styles, cluster);
+            int span = styles->data[run].span;
+            color = SPAN_COLOR(span);
+            background = SPAN_BACKGROUND(span);
+            runUnderline = SPAN_UNDERLINE(span);
+            shadow = SPAN_SHADOW(span);
+        }
         glyphatlas_get(blurg, font, glyphs[i].index, &vis);
+        // SDF and quantized glyphs are rasterized at another size
+        float glyphScale = font->scale;
+        if(vis.rasterSize && vis.rasterSize != (int)font->setSize) {
+            glyphScale = (int)font->setSize / (float)vis.rasterSize;
+        }
         blurg_underline_t underline = BLURG_NO_UNDERLINE;
         uint32_t ucolor;
         float upos;
         if(hasBackground) {
-            blurg_color_t background = IDX_BACKGROUND(glyphs[i].cluster);
             int bEnabled = (background & 0xFF000000) != 0;
             if(!bkg.active && bEnabled) {
                 bkg.active = 1;
@@ -251,9 +574,9 @@ static void raqm_to_rects(
             }
         }
         if(hasUnderline) {
-            underline = IDX_UNDERLINE(glyphs[i].cluster);
+            underline = runUnderline;
             if(underline.enabled) {
-                ucolor = underline.useColor ? underline.color : IDX_COLOR(glyphs[i].cluster);
+                ucolor = underline.useColor ? underline.color : color;
                 float sz = (font->setSize / 64.0);
                 upos = (font->face->underline_position / (64.0 * 64.0)) * sz;
                 upos = -roundf(upos);
@@ -280,18 +603,17 @@ static void raqm_to_rects(
             }
         }
         if(hasShadow) {
-            blurg_shadow_t shadow = IDX_SHADOW(glyphs[i].cluster);
             if(shadow.pixels) {
                 list_blurg_rect_t_add(&ctx->layers[ctx->l_shadow], (blurg_rect_t) {
-                    .texture = blurg->packed.pages[vis.texture],
+                    .texture = glyphatlas_texture(blurg, vis.texture),
                     .u0 = vis.srcX / (float)BLURG_TEXTURE_SIZE,
                     .v0 = vis.srcY / (float)BLURG_TEXTURE_SIZE,
                     .u1 = (vis.srcX + vis.srcW) / (float)BLURG_TEXTURE_SIZE,
                     .v1 = (vis.srcY + vis.srcH) / (float)BLURG_TEXTURE_SIZE,
-                    .x = shadow.pixels + (int)(*x + (glyphs[i].x_offset / 64.0) + vis.offsetLeft),
-                    .y = shadow.pixels + (int)(*y + (glyphs[i].y_offset / 64.0) - vis.offsetTop),
-                    .width = vis.srcW,
-                    .height = vis.srcH,
+                    .x = shadow.pixels + (int)(*x + (glyphs[i].x_offset / 64.0) + (vis.offsetLeft * glyphScale)),
+                    .y = shadow.pixels + (int)(*y + (glyphs[i].y_offset / 64.0) - (vis.offsetTop * glyphScale)),
+                    .width = (int)(vis.srcW * glyphScale),
+                    .height = (int)(vis.srcH * glyphScale),
                     .color = shadow.color,
                 });
                 //shadow underline
@@ -325,16 +647,16 @@ static void raqm_to_rects(
             }
         }
         list_blurg_rect_t_add(&ctx->layers[ctx->l_glyphs], (blurg_rect_t) {
-            .texture = blurg->packed.pages[vis.texture],
+            .texture = glyphatlas_texture(blurg, vis.texture),
             .u0 = vis.srcX / (float)BLURG_TEXTURE_SIZE,
             .v0 = vis.srcY / (float)BLURG_TEXTURE_SIZE,
             .u1 = (vis.srcX + vis.srcW) / (float)BLURG_TEXTURE_SIZE,
             .v1 = (vis.srcY + vis.srcH) / (float)BLURG_TEXTURE_SIZE,
-            .x = (int)(*x + (glyphs[i].x_offset / 64.0) + (vis.offsetLeft * font->scale)),
-            .y = (int)(*y + (glyphs[i].y_offset / 64.0) - (vis.offsetTop * font->scale)),
-            .width = (int)(vis.srcW * font->scale),
-            .height = (int)(vis.srcH * font->scale),
-            .color = vis.color ? 0xFFFFFFFF : IDX_COLOR(glyphs[i].cluster), 
+            .x = (int)(*x + (glyphs[i].x_offset / 64.0) + (vis.offsetLeft * glyphScale)),
+            .y = (int)(*y + (glyphs[i].y_offset / 64.0) - (vis.offsetTop * glyphScale)),
+            .width = (int)(vis.srcW * glyphScale),
+            .height = (int)(vis.srcH * glyphScale),
+            .color = vis.color ? 0xFFFFFFFF : color, 
         });
         *x += glyphs[i].x_advance / 64.0 * font->scale;
         *y += glyphs[i].y_advance / 64.0 * font->scale;
@@ -352,65 +674,6 @@ static void raqm_to_rects(
     }
 }
 
-static void wrap_line(raqm_glyph_t *glyphs, char* breaks, int *charCount, size_t *glyphCount, float x, float maxWidth)
-{
-    if(maxWidth > 0) {
-        // wrap text if necessary
-        float cx = x;
-        size_t stop;
-        for(stop = 0; stop < *glyphCount; stop++) {
-            float advance = (glyphs[stop].x_advance / 64.0);
-            if(cx + advance > maxWidth) {
-                break;
-            }
-            cx += advance;
-        }
-        // Text is too big, we need to line break!
-        if(stop != *glyphCount) {
-            if(x <= 0 && stop == 0) { 
-                // too big to put a single character on a line?
-                // just output one glyph
-                stop = 1;
-                *glyphCount = 1;
-                *charCount = (int)glyphs[1].cluster;
-            } 
-            else {
-                // Calculate an appropriate line break
-                int cc = (int)glyphs[stop].cluster;
-                int lastAllowed = -1;
-                for(int i = cc - 1; i > 0; i--) {
-                    if(breaks[i] == LINEBREAK_ALLOWBREAK) {
-                        lastAllowed = i;
-                        break;
-                    }
-                }
-                // If we have an appropiate line break, use that
-                if(lastAllowed != -1) {
-                    int found = 0;
-                    for(int i = 0; i < stop; i++) {
-                        if(glyphs[i].cluster == lastAllowed) {
-                            stop = i;
-                            found = 1;
-                            break;
-                        }
-                    }
-                    if(found && (stop + 1) < *glyphCount) {
-                        //skip the space we converted into a break
-                        *charCount = (int)glyphs[stop + 1].cluster;
-                    } else {
-                        *charCount = (int)glyphs[stop].cluster;
-                    }
-                    *glyphCount = stop;
-                } else {
-                    //no appropriate line break, just insert an \n
-                    *glyphCount = stop;
-                    *charCount = (int)glyphs[stop].cluster;
-                }
-            }
-        }
-    }
-}
-
 static void set_text(raqm_t *rq, const void *str, int len, blurg_formatted_text_t *text)
 {
     if(text->encoding == blurg_encoding_utf16)
@@ -424,646 +687,996 @@ typedef struct {
     int len;
 } range;
 
-DEFINE_LIST(range)
-IMPLEMENT_LIST(range)
-
-// Fills a list of clusters to reshape if needed
-// Using clusters so ZWJ sequences can work (e.g. emojis)
-static bool needs_fallback(raqm_glyph_t *glyphs, size_t count, int len, list_range *ranges)
+// Fills ranges with the clusters to reshape, returns how many there are.
+// ranges must hold count entries. Using clusters so ZWJ sequences can work (e.g. emojis)
+static int needs_fallback(raqm_glyph_t *glyphs, size_t count, int len, range *ranges)
 {
     int last = -1;
-    int has = 0;
+    int rangeCount = 0;
     for(size_t i = 0; i < count; i++) {
         if(last != -1 && glyphs[i].cluster != last) {
-            list_range_add(ranges, (range){ .start = last, .len = glyphs[i].cluster - last });
+            ranges[rangeCount++] = (range){ .start = last, .len = glyphs[i].cluster - last };
             last = -1;
         }
-        if(!glyphs[i].index) {
-            if(!has) {
-                has = 1;
-                list_range_init(ranges, 8);
-            }
-            if(last == -1) {
-                last = glyphs[i].cluster;
-            }
+        if(!glyphs[i].index && last == -1) {
+            last = glyphs[i].cluster;
         }
     }
     if(last != -1) {
-        list_range_add(ranges, (range){ .start = last, .len = len - last });
+        ranges[rangeCount++] = (range){ .start = last, .len = len - last };
+    }
+    return rangeCount;
+}
+
+// Assigns fonts to the text one run at a time, rather than per code unit
+static void set_face_runs(raqm_t *rq, const shape_face_run *runs, int runCount, float size)
+{
+    int start = 0;
+    for(int i = 0; i < runCount; i++) {
+        font_use_size(runs[i].font, size);
+        raqm_set_freetype_face_range(rq, runs[i].font->face, start, runs[i].count);
+        start += runs[i].count;
+    }
+}
+
+// returns the font of the run containing index
+static blurg_font_t *run_font_at(const shape_face_run *runs, int runCount, int index)
+{
+    for(int i = 0; i < runCount - 1; i++) {
+        if(index < runs[i].count)
+            return runs[i].font;
+        index -= runs[i].count;
     }
-    return has;
+    return runs[runCount - 1].font;
 }
 
 static void do_fallback(blurg_t *blurg, raqm_t *rq, raqm_glyph_t **glyphs, size_t *count, const void *str, int len,
-    int* attributes, blurg_formatted_text_t *text, float size)
+    blurg_formatted_text_t *text, const shape_face_run *runs, int runCount, float size)
 {
-    list_range ranges;
-    if(needs_fallback(*glyphs, *count, len, &ranges)) {
+    arena_mark mark = arena_save(&blurg->arena);
+    range *ranges = arena_alloc(&blurg->arena, *count * sizeof(range));
+    int rangeCount = needs_fallback(*glyphs, *count, len, ranges);
+    if(rangeCount) {
         raqm_clear_contents(rq);
         set_text(rq, str, len, text);
         raqm_set_par_direction(rq, RAQM_DIRECTION_DEFAULT);
-        for(size_t i = 0; i < len; i++) {
-            blurg_font_t *fontAtIndex = IDX_FONT(i);
-            font_use_size(fontAtIndex, size);
-            raqm_set_freetype_face_range(rq, fontAtIndex->face, i, 1);
-        }
-        for(int i = 0; i < ranges.count; i++) {
-            blurg_font_t *fontAtIndex = IDX_FONT(ranges.data[i].start);
+        set_face_runs(rq, runs, runCount, size);
+        for(int i = 0; i < rangeCount; i++) {
+            blurg_font_t *fontAtIndex = run_font_at(runs, runCount, ranges[i].start);
             int clen;
-            blurg_font_t *fallback = blurg_font_fallback(blurg, fontAtIndex, get_codepoint(str, text, ranges.data[i].start, &clen));
+            blurg_font_t *fallback = blurg_font_fallback(blurg, fontAtIndex, get_codepoint(str, text, ranges[i].start, &clen));
             if (fallback) {
                 font_use_size(fallback, size);
-                raqm_set_freetype_face_range(rq, fallback->face, ranges.data[i].start, ranges.data[i].len);
+                raqm_set_freetype_face_range(rq, fallback->face, ranges[i].start, ranges[i].len);
             }
         }
-        list_range_free(&ranges);
         raqm_layout(rq);
         *glyphs = raqm_get_glyphs(rq, count);
     }
+    arena_restore(&blurg->arena, mark);
 }
 
-// returns the length of text shaped/turned into rects for current maxWidth
-static int blurg_shape_chunk(blurg_t *blurg, const void *str, char *breaks, int len, float size,
-    int* attributes, blurg_formatted_text_t *text, build_context *ctx, blurg_cursor_t *cursors, float *x, float *y, float maxWidth)
-{
-    raqm_t* rq = raqm_create();
-    set_text(rq, str, len, text);
-    raqm_set_par_direction(rq, RAQM_DIRECTION_DEFAULT);
-    int hasShadows = len + 1;
-    int hasUnderlines = len + 1;
-    int hasBackground = len + 1;
+typedef struct {
+    // raqm context, NULL when the glyphs came from the shape cache
+    raqm_t *rq;
+    shape_entry *cached;
+    const raqm_glyph_t *glyphs;
+    size_t count;
+} shaped_chunk;
 
-    int needFallback = 0;
-    
-    for(int i = 0; i < len; i++) {
-        blurg_font_t *fontAtIndex = IDX_FONT(i);
-        // optimisation. check if there are any shadow/underline attributes
-        // in the range during first loop. saves loops later 
-        if((hasShadows > len) && IDX_SHADOW(i).pixels != 0) {
-            hasShadows = i;
-        }
-        if((hasUnderlines > len) && IDX_UNDERLINE(i).enabled != 0) {
-            hasUnderlines = i;
-        }
-        if((hasBackground > len) && (IDX_BACKGROUND(i) & 0xFF000000)) {
-            hasBackground = i;
+// Shapes [start, start + len) of the text at a single size, with fallback applied.
+// Results are looked up in/added to the shape cache. If cursors are needed and
+// not in the cache, the chunk is shaped again and out->rq must be released by the caller
+static void shape_chunk_glyphs(blurg_t *blurg, const void *str, int start, int len, float size,
+    const list_style_run *styles, blurg_formatted_text_t *text, int needCursors, shaped_chunk *out)
+{
+    list_shape_face_run_ensure_size(&blurg->runScratch, len);
+    shape_face_run *runs = blurg->runScratch.data;
+    int runCount = 0;
+    // collapse the style runs into maximal runs of the same font
+    for(int r = style_find(styles, start); r < styles->count && styles->data[r].start < start + len; r++) {
+        int lo = styles->data[r].start > start ? styles->data[r].start : start;
+        int hi = styles->data[r].end < start + len ? styles->data[r].end : start + len;
+        blurg_font_t *font = SPAN_FONT(styles->data[r].span);
+        if(runCount && runs[runCount - 1].font == font) {
+            runs[runCount - 1].count += hi - lo;
+        } else {
+            runs[runCount++] = (shape_face_run){ .font = font, .count = hi - lo };
         }
-        font_use_size(fontAtIndex, size);
-        raqm_set_freetype_face_range(rq, fontAtIndex->face, i, 1);
     }
+    shape_entry key = {
+        .encoding = text->encoding,
+        .size = size,
+        .textBytes = text->encoding == blurg_encoding_utf16 ? len * 2 : len,
+        .text = (char*)str,
+        .runCount = runCount,
+        .runs = runs,
+    };
+    out->rq = NULL;
+    out->cached = shapecache_get(blurg, &key);
+    if(out->cached && (!needCursors || out->cached->cursors)) {
+        out->glyphs = out->cached->glyphs;
+        out->count = out->cached->glyphCount;
+        return;
+    }
+    // cursors always come from raqm
+    if(!needCursors && simpleshape_chunk(blurg, str, len, text->encoding, runs, runCount, size, &blurg->simpleGlyphs)) {
+        out->cached = shapecache_add(blurg, &key, blurg->simpleGlyphs.data, blurg->simpleGlyphs.count);
+        out->glyphs = blurg->simpleGlyphs.data;
+        out->count = blurg->simpleGlyphs.count;
+        return;
+    }
+
+    raqm_t* rq = shaper_acquire(blurg);
+    set_text(rq, str, len, text);
+    raqm_set_par_direction(rq, RAQM_DIRECTION_DEFAULT);
+    set_face_runs(rq, runs, runCount, size);
     raqm_layout(rq);
     size_t count = SIZE_MAX;
-    int charCount = len;
     raqm_glyph_t *glyphs = raqm_get_glyphs (rq, &count);
-    do_fallback(blurg, rq, &glyphs, &count, str, len, attributes, text, size);
-    wrap_line(glyphs, breaks, &charCount, &count, *x, maxWidth);
-    raqm_to_rects(blurg, rq, ctx, x, y, count, text, attributes, hasShadows < charCount, hasUnderlines < charCount, hasBackground < charCount);
-    if(cursors) {
-        for(int i = 0; i < charCount; i++) {
+    do_fallback(blurg, rq, &glyphs, &count, str, len, text, runs, runCount, size);
+    if(!out->cached) {
+        out->cached = shapecache_add(blurg, &key, glyphs, count);
+    }
+    if(needCursors && out->cached) {
+        int *positions = shapecache_alloc_cursors(blurg, out->cached, len);
+        for(int i = 0; i < len; i++) {
             size_t index = i;
-            int curX, curY;
-            raqm_index_to_position(rq, &index, &curX, &curY);
-            cursors[i].x = (int)(curX / 64.0);
-            cursors[i].y = (int)(curY / 64.0);
+            raqm_index_to_position(rq, &index, &positions[i * 2], &positions[i * 2 + 1]);
         }
     }
-    raqm_destroy(rq);
-    return charCount;
-}
-
-static void split_line(list_text_line *lines, int lineIndex, int splitPoint)
-{
-    int newStart = lines->data[lineIndex].textStart + splitPoint;
-    int newCount = lines->data[lineIndex].textCount - splitPoint;
-    lines->data[lineIndex].textCount = splitPoint;
-    text_line newLine = {
-        .isBreak = 0,
-        .textStart = newStart,
-        .textCount = newCount,
-        .paraIndex = lines->data[lineIndex].paraIndex,
-    };
-    list_text_line_insert(lines, lineIndex + 1, newLine);
+    out->rq = rq;
+    out->glyphs = glyphs;
+    out->count = count;
 }
 
-// accessors for attribute and text arrays
+// accessor for text array
 #define TEXT_OFFSET(x) (text->encoding == blurg_encoding_utf16 ? (const void*)(\
     &((const utf16_t*)(text->text))[(x)] \
 ) : (const void*) (\
     &((const char*)(text->text))[(x)] \
 ))
-#define ATTRIBUTE_OFFSET(x) (attributes ? &attributes[(x)] : NULL)
-#define CURSOR_OFFSET(x) (cursors ? &cursors[(x)] : NULL)
 
-static void blurg_wrap_shape_line(
-    blurg_t *blurg, 
-    blurg_formatted_text_t *text, 
-    build_context *ctx,
-    blurg_cursor_t *cursors, 
-    int* attributes, 
-    list_text_line *lines,
-    char *breaks,
-    int lineIndex,
-    float maxWidth)
+static void shaped_store_init(shaped_store *store)
 {
-    if(lines->data[lineIndex].isBreak) {
-        // This line is just an \n.
-        // Set line height and early exit
-        lines->data[lineIndex].width = 0;
-        blurg_font_t *fnt = IDX_FONT(lines->data[lineIndex].textStart);
-        font_use_size(fnt, IDX_SIZE(lines->data[lineIndex].textStart));
-        lines->data[lineIndex].lineHeight = fnt->lineHeight;
-        for(int i = 0; i < ctx->layerCount; i++) {
-            lines->data[lineIndex].rectStarts[i] = 0;
-            lines->data[lineIndex].rectCounts[i] = 0;
-        }
-        return;
-    }
+    list_line_chunk_init(&store->chunks, 8);
+    list_raqm_glyph_t_init(&store->glyphs, 64);
+    list_int_init(&store->cursorPositions, 8);
+}
 
-    int start = lines->data[lineIndex].textStart;
-    int count = lines->data[lineIndex].textCount;
+static void shaped_store_free(shaped_store *store)
+{
+    list_line_chunk_free(&store->chunks);
+    list_raqm_glyph_t_free(&store->glyphs);
+    list_int_free(&store->cursorPositions);
+}
 
-    for(int i = 0; i < ctx->layerCount; i++) {
-        lines->data[lineIndex].rectStarts[i] = ctx->layers[i].count;
-    }
+static void build_context_init(build_context *ctx, list_text_line *lines)
+{
+    ctx->lines = lines;
+    ctx->layerCount = 0;
+    shaped_store_init(&ctx->fragment);
+    list_wrapped_line_init(&ctx->wrapped, 8);
+}
 
-    int last = 0;
-    
-    blurg_font_t *font0 = IDX_FONT(start);
-    float currentSize = IDX_SIZE(start);
-    font_use_size(font0, currentSize);
+static void build_context_free(build_context *ctx)
+{
+    shaped_store_free(&ctx->fragment);
+    list_wrapped_line_free(&ctx->wrapped);
+}
 
-    float maxAscender = font0->ascender;
-    float maxLineHeight = font0->lineHeight;
+static int is_whitespace(uint32_t c)
+{
+    return c == ' ' || c == '\t' || c == 0x1680 ||
+        (c >= 0x2000 && c <= 0x2006) || (c >= 0x2008 && c <= 0x200A) ||
+        c == 0x205F || c == 0x3000;
+}
 
-    float x = 0;
-    float y = 0;
+// returns the start of any whitespace at the end of [start, end)
+static int trim_trailing_whitespace(blurg_formatted_text_t *text, int start, int end)
+{
+    while(end > start) {
+        int ch = end - 1;
+        if(text->encoding == blurg_encoding_utf16) {
+            const uint16_t *s = text->text;
+            if(ch > start && s[ch] >= 0xDC00 && s[ch] <= 0xDFFF) ch--;
+        } else {
+            const uint8_t *s = text->text;
+            while(ch > start && (s[ch] & 0xC0) == 0x80) ch--;
+        }
+        int clen;
+        if(!is_whitespace(get_codepoint(text->text, text, ch, &clen))) {
+            break;
+        }
+        end = ch;
+    }
+    return end;
+}
 
-    for(int i = 0; i < count; i++) {
-        blurg_font_t *fontAtIndex = IDX_FONT(start + i);
-        float sizeAtIndex = IDX_SIZE(start + i);
-        // size change, we need to shape text
-        if(currentSize != sizeAtIndex) {
-            if(i - last > 0) {
-                int shapeCount = i - last;
-                int actualCount = blurg_shape_chunk(
-                    blurg, 
-                    TEXT_OFFSET(start+last),
-                    &breaks[start + last],
-                    i - last, 
-                    currentSize, 
-                    ATTRIBUTE_OFFSET(start + last), 
-                    text, 
-                    ctx,
-                    CURSOR_OFFSET(start + last),
-                    &x, &y, maxWidth);
-                if(actualCount != shapeCount) {
-                    split_line(lines, lineIndex, last + actualCount);
-                    // early exit
-                    goto finish;
-                }
-                last = i;
+// Shapes [start, start + len) of the text at one size and appends it to store
+static void add_line_chunk(blurg_t *blurg, blurg_formatted_text_t *text, const list_style_run *styles, shaped_store *store,
+    int start, int len, float size, int needCursors)
+{
+    shaped_chunk shaped;
+    shape_chunk_glyphs(blurg, TEXT_OFFSET(start), start, len, size, styles, text, needCursors, &shaped);
+    line_chunk chunk = {
+        .textStart = start,
+        .textCount = len,
+        .size = size,
+        .glyphStart = store->glyphs.count,
+        .glyphCount = (int)shaped.count,
+        .cursorStart = -1,
+    };
+    list_raqm_glyph_t_ensure_size(&store->glyphs, store->glyphs.count + (int)shaped.count);
+    for(size_t i = 0; i < shaped.count; i++) {
+        raqm_glyph_t g = shaped.glyphs[i];
+        g.cluster += start;
+        store->glyphs.data[store->glyphs.count++] = g;
+    }
+    if(needCursors) {
+        chunk.cursorStart = store->cursorPositions.count;
+        list_int_ensure_size(&store->cursorPositions, store->cursorPositions.count + len * 2);
+        int *positions = &store->cursorPositions.data[store->cursorPositions.count];
+        if(shaped.cached) {
+            memcpy(positions, shaped.cached->cursors, len * 2 * sizeof(int));
+        } else {
+            for(int i = 0; i < len; i++) {
+                size_t index = i;
+                raqm_index_to_position(shaped.rq, &index, &positions[i * 2], &positions[i * 2 + 1]);
             }
         }
-        //keep track of line height + ascender for line
-        currentSize = sizeAtIndex;
-        font_use_size(fontAtIndex, sizeAtIndex);
-        if(fontAtIndex->lineHeight > maxLineHeight)
-            maxLineHeight = fontAtIndex->lineHeight;
-        if(fontAtIndex->ascender > maxAscender)
-            maxAscender = fontAtIndex->ascender;
+        store->cursorPositions.count += len * 2;
     }
+    if(shaped.rq) {
+        shaper_release(blurg, shaped.rq);
+    }
+    list_line_chunk_add(&store->chunks, chunk);
+}
 
-    if(count - last > 0) {
-        int shapeCount = count - last;
-        int actualCount = blurg_shape_chunk(
-            blurg, 
-            TEXT_OFFSET(start + last), 
-            &breaks[start + last], 
-            count - last, 
-            currentSize, 
-            ATTRIBUTE_OFFSET(start + last), 
-            text, 
-            ctx, 
-            CURSOR_OFFSET(start + last),
-            &x, &y, maxWidth);
-        if(actualCount != shapeCount) {
-            split_line(lines, lineIndex, last + actualCount);
+// Shapes a whole hard line (text between mandatory breaks) once, one chunk per font size
+static void shape_hard_line(blurg_t *blurg, blurg_formatted_text_t *text, const list_style_run *styles, shaped_store *store,
+    text_line *line, int needCursors)
+{
+    int start = line->textStart;
+    int end = start + line->textCount;
+    line->chunkStart = store->chunks.count;
+    if(!line->textCount) {
+        line->chunkCount = 0;
+        return;
+    }
+    int chunkStart = start;
+    int r = style_find(styles, start);
+    float currentSize = SPAN_SIZE(styles->data[r].span);
+    for(r++; r < styles->count && styles->data[r].start < end; r++) {
+        float sz = SPAN_SIZE(styles->data[r].span);
+        if(sz != currentSize) {
+            add_line_chunk(blurg, text, styles, store, chunkStart, styles->data[r].start - chunkStart, currentSize, needCursors);
+            chunkStart = styles->data[r].start;
+            currentSize = sz;
         }
     }
+    add_line_chunk(blurg, text, styles, store, chunkStart, end - chunkStart, currentSize, needCursors);
+    line->chunkCount = store->chunks.count - line->chunkStart;
+}
 
-
-    finish:
-    // apply ascender for line and
-    // set glyph counts
-    for(int i = 0; i < ctx->layerCount; i++) {
-        int st = lines->data[lineIndex].rectStarts[i];
-        int c = ctx->layers[i].count - st; 
-        lines->data[lineIndex].rectCounts[i] = c;
-        if(i == ctx->l_background) {
-            for(int j = 0; j < c; j++) {
-                ctx->layers[i].data[st + j].height = (int)maxLineHeight;
+// Sums glyph advances per cluster in logical order, adv is indexed by text position.
+// Indices that don't start a cluster are set to -1
+static void cluster_advances(const shaped_store *store, const text_line *line, float *adv)
+{
+    for(int i = line->textStart; i < line->textStart + line->textCount; i++) {
+        adv[i] = -1;
+    }
+    for(int c = line->chunkStart; c < line->chunkStart + line->chunkCount; c++) {
+        const line_chunk *chunk = &store->chunks.data[c];
+        blurg_font_t *lastFont = NULL;
+        for(int i = 0; i < chunk->glyphCount; i++) {
+            const raqm_glyph_t *g = &store->glyphs.data[chunk->glyphStart + i];
+            blurg_font_t *font = blurg_from_freetype(g->ftface);
+            if(font != lastFont) {
+                font_use_size(font, chunk->size);
+                lastFont = font;
             }
-        } else {
-            for(int j = 0; j < c; j++) {
-                ctx->layers[i].data[st + j].y += maxAscender;
+            if(adv[g->cluster] < 0) {
+                adv[g->cluster] = 0;
             }
+            adv[g->cluster] += g->x_advance / 64.0 * font->scale;
         }
     }
-    // set metrics
-    lines->data[lineIndex].width = x;
-    lines->data[lineIndex].lineHeight = maxLineHeight;
 }
 
-static int blurg_measure_chunk(blurg_t *blurg, const void *str, char *breaks, int len, float size,
-    int* attributes, blurg_formatted_text_t *text, float *x, float *y, float maxWidth)
+static void add_wrapped(build_context *ctx, int start, int end, int visibleEnd, int *clean, int endClean)
 {
-    raqm_t* rq = raqm_create();
-    if(text->encoding == blurg_encoding_utf16)
-        raqm_set_text_utf16(rq, (const utf16_t*)str, len);
-    else
-        raqm_set_text_utf8(rq, (const char*)str, len);
-    raqm_set_par_direction(rq, RAQM_DIRECTION_DEFAULT);
-    for(int i = 0; i < len; i++) {
-        blurg_font_t *fontAtIndex = IDX_FONT(i);
-        font_use_size(fontAtIndex, size);
-        raqm_set_freetype_face_range(rq, fontAtIndex->face, i, 1);
-    }
-    raqm_layout(rq);
-    size_t count = SIZE_MAX;
-    int charCount = len;
-    raqm_glyph_t *glyphs = raqm_get_glyphs (rq, &count);
-    wrap_line(glyphs, breaks, &charCount, &count, *x, maxWidth);
-    for(int i = 0; i < count; i++) {
-        *x += (glyphs[i].x_advance / 64.0);
-        *y += (glyphs[i].y_advance / 64.0);
-    }
-    raqm_destroy(rq);
-    return charCount;
+    list_wrapped_line_add(&ctx->wrapped, (wrapped_line){
+        .start = start,
+        .end = end,
+        .visibleEnd = visibleEnd,
+        .startClean = *clean,
+        .endClean = endClean,
+    });
+    *clean = endClean;
 }
 
-static void blurg_measure_line(
-    blurg_t *blurg, 
-    blurg_formatted_text_t *text, 
-    int* attributes, 
-    list_text_line *lines,
-    char *breaks,
-    int lineIndex,
-    float maxWidth
-)
-{
-    if(lines->data[lineIndex].isBreak) {
-        // This line is just an \n.
-        // Set line height and early exit
-        lines->data[lineIndex].width = 0;
-        blurg_font_t *fnt = IDX_FONT(lines->data[lineIndex].textStart);
-        font_use_size(fnt, IDX_SIZE(lines->data[lineIndex].textStart));
-        lines->data[lineIndex].lineHeight = fnt->lineHeight;
-        return;
+// Picks all line breaks for a shaped hard line in one pass over the cluster advances.
+// Breaks at the last opportunity before the text overflows, otherwise wherever it overflows
+static void wrap_hard_line(blurg_formatted_text_t *text, const char *breaks, const float *advances, build_context *ctx,
+    int start, int count, float maxWidth)
+{
+    ctx->wrapped.count = 0;
+    const float *adv = &advances[start];
+    int clean = 1;
+    int lineStart = 0;
+    int lastBreak = -1;
+    float x = 0;
+    float xAtBreak = 0;
+    for(int i = 0; maxWidth > 0 && i < count; i++) {
+        if(adv[i] < 0) {
+            // can't break inside a cluster
+            continue;
+        }
+        if(i > lineStart && breaks[start + i - 1] == LINEBREAK_ALLOWBREAK) {
+            lastBreak = i;
+            xAtBreak = x;
+        }
+        if(i > lineStart && x + adv[i] > maxWidth) {
+            if(lastBreak > lineStart) {
+                // break opportunity, whitespace before it is not displayed
+                int visible = trim_trailing_whitespace(text, start + lineStart, start + lastBreak);
+                add_wrapped(ctx, start + lineStart, start + lastBreak, visible, &clean, visible != start + lastBreak);
+                x -= xAtBreak;
+                lineStart = lastBreak;
+            }
+            if(i > lineStart && x + adv[i] > maxWidth) {
+                // no appropriate line break, break the text where it overflows
+                add_wrapped(ctx, start + lineStart, start + i, start + i, &clean, 0);
+                x = 0;
+                lineStart = i;
+            }
+            lastBreak = -1;
+        }
+        // a single cluster too big for a line still gets output
+        x += adv[i];
     }
+    add_wrapped(ctx, start + lineStart, start + count, start + count, &clean, 1);
+}
 
-    int start = lines->data[lineIndex].textStart;
-    int count = lines->data[lineIndex].textCount;
-
-    int last = 0;
-    
-    blurg_font_t *font0 = IDX_FONT(start);
-    float currentSize = IDX_SIZE(start);
-    font_use_size(font0, currentSize);
+// Emits one wrapped line, reusing the glyphs shaped for the hard line.
+// Chunks cut at a break where shaping across the break may differ are reshaped
+static void layout_wrapped_line(blurg_t *blurg, blurg_formatted_text_t *text, const list_style_run *styles,
+    const shaped_store *shaped, const text_line *hardLine, build_context *ctx,
+    blurg_cursor_t *cursors, const wrapped_line *wl, int *chunkIndex)
+{
+    text_line line = {
+        .isBreak = 0,
+        .textStart = wl->start,
+        .textCount = wl->end - wl->start,
+        .paraIndex = hardLine->paraIndex,
+    };
+    for(int i = 0; i < ctx->layerCount; i++) {
+        line.rectStarts[i] = ctx->layers[i].count;
+    }
 
+    //keep track of line height + ascender for line
+    int firstRun = style_find(styles, wl->start);
+    int span0 = styles->data[firstRun].span;
+    blurg_font_t *font0 = SPAN_FONT(span0);
+    font_use_size(font0, SPAN_SIZE(span0));
     float maxAscender = font0->ascender;
     float maxLineHeight = font0->lineHeight;
+    for(int r = firstRun + 1; r < styles->count && styles->data[r].start < wl->end; r++) {
+        int span = styles->data[r].span;
+        blurg_font_t *fontAtIndex = SPAN_FONT(span);
+        font_use_size(fontAtIndex, SPAN_SIZE(span));
+        if(fontAtIndex->lineHeight > maxLineHeight)
+            maxLineHeight = fontAtIndex->lineHeight;
+        if(fontAtIndex->ascender > maxAscender)
+            maxAscender = fontAtIndex->ascender;
+    }
 
     float x = 0;
     float y = 0;
 
-    for(int i = 0; i < count; i++) {
-        blurg_font_t *fontAtIndex = IDX_FONT(start + i);
-        float sizeAtIndex = IDX_SIZE(start + i);
-        // size change, we need to shape text
-        if(currentSize != sizeAtIndex) {
-            if(i - last > 0) {
-                int shapeCount = i - last;
-                int actualCount = blurg_measure_chunk(
-                    blurg, 
-                    TEXT_OFFSET(start+last),
-                    &breaks[start + last],
-                    i - last, 
-                    currentSize, 
-                    ATTRIBUTE_OFFSET(start + last), 
-                    text, 
-                    &x, &y, maxWidth);
-                if(actualCount != shapeCount) {
-                    split_line(lines, lineIndex, last + actualCount);
-                    // early exit
-                    goto finish;
-                }
-                last = i;
+    int chunkEnd = hardLine->chunkStart + hardLine->chunkCount;
+    while(*chunkIndex < chunkEnd &&
+        shaped->chunks.data[*chunkIndex].textStart + shaped->chunks.data[*chunkIndex].textCount <= wl->start) {
+        (*chunkIndex)++;
+    }
+    for(int c = *chunkIndex; c < chunkEnd; c++) {
+        line_chunk piece = shaped->chunks.data[c];
+        const shaped_store *store = shaped;
+        int pieceEnd = piece.textStart + piece.textCount;
+        if(piece.textStart >= wl->end) {
+            break;
+        }
+        int lo = wl->start > piece.textStart ? wl->start : piece.textStart;
+        int hi = wl->end < pieceEnd ? wl->end : pieceEnd;
+        int visibleHi = wl->visibleEnd < hi ? wl->visibleEnd : hi;
+        if((lo > piece.textStart && !wl->startClean) ||
+           (hi < pieceEnd && !wl->endClean)) {
+            // shape this part of the chunk alone into scratch space
+            ctx->fragment.chunks.count = 0;
+            ctx->fragment.glyphs.count = 0;
+            ctx->fragment.cursorPositions.count = 0;
+            add_line_chunk(blurg, text, styles, &ctx->fragment, lo, hi - lo, piece.size, cursors != NULL);
+            piece = ctx->fragment.chunks.data[0];
+            store = &ctx->fragment;
+        }
+        int hasShadow = 0;
+        int hasUnderline = 0;
+        int hasBackground = 0;
+        // check if there are any shadow/underline attributes in the range
+        for(int r = style_find(styles, lo); ctx->layerCount && lo < visibleHi &&
+            r < styles->count && styles->data[r].start < visibleHi; r++) {
+            int span = styles->data[r].span;
+            hasShadow |= SPAN_SHADOW(span).pixels != 0;
+            hasUnderline |= SPAN_UNDERLINE(span).enabled != 0;
+            hasBackground |= (SPAN_BACKGROUND(span) & 0xFF000000) != 0;
+        }
+        float pieceX = x;
+        emit_glyphs(blurg, &store->glyphs.data[piece.glyphStart], piece.glyphCount, lo, visibleHi,
+            ctx, &x, &y, piece.size, text, styles, hasShadow, hasUnderline, hasBackground);
+        if(cursors) {
+            const int *pos = &store->cursorPositions.data[piece.cursorStart];
+            int first = lo - piece.textStart;
+            for(int i = lo; i < hi; i++) {
+                int k = i - piece.textStart;
+                cursors[i].x = (int)(pieceX + (pos[k * 2] - pos[first * 2]) / 64.0);
+                cursors[i].y = (int)(pos[k * 2 + 1] / 64.0);
             }
         }
-        //keep track of line height + ascender for line
-        currentSize = sizeAtIndex;
-        font_use_size(fontAtIndex, sizeAtIndex);
-        if(fontAtIndex->lineHeight > maxLineHeight)
-            maxLineHeight = fontAtIndex->lineHeight;
-        if(fontAtIndex->ascender > maxAscender)
-            maxAscender = fontAtIndex->ascender;
     }
 
-    if(count - last > 0) {
-        int shapeCount = count - last;
-        int actualCount = blurg_measure_chunk(
-            blurg, 
-            TEXT_OFFSET(start + last), 
-            &breaks[start + last], 
-            count - last, 
-            currentSize, 
-            ATTRIBUTE_OFFSET(start + last), 
-            text, 
-            &x, &y, maxWidth);
-        if(actualCount != shapeCount) {
-            split_line(lines, lineIndex, last + actualCount);
+    // apply ascender for line and
+    // set glyph counts
+    for(int i = 0; i < ctx->layerCount; i++) {
+        int st = line.rectStarts[i];
+        int c = ctx->layers[i].count - st;
+        line.rectCounts[i] = c;
+        if(i == ctx->l_background) {
+            for(int j = 0; j < c; j++) {
+                ctx->layers[i].data[st + j].height = (int)maxLineHeight;
+            }
+        } else {
+            for(int j = 0; j < c; j++) {
+                ctx->layers[i].data[st + j].y += maxAscender;
+            }
         }
     }
-
-    finish:
     // set metrics
-    lines->data[lineIndex].width = x;
-    lines->data[lineIndex].lineHeight = maxLineHeight;    
+    line.width = x;
+    line.lineHeight = maxLineHeight;
+    list_text_line_add(ctx->lines, line);
 }
 
 #undef TEXT_OFFSET
-#undef ATTRIBUTE_OFFSET
-
-
 
+// A paragraph (one blurg_formatted_text_t), shaped but not wrapped
 typedef struct _paragraph_info {
-    int lineOffset;
     int total;
+    // index of the first cursor
     int start;
-    int *attributes;
+    list_style_run styles;
     char *breaks;
+    // lines between mandatory breaks
+    list_text_line hardLines;
+    shaped_store shaped;
+    // per text position, see cluster_advances
+    float *advances;
+    // allocated size of breaks and advances
+    int capacity;
 } paragraph_info;
 
-#define ALLOC_GUARDED(count,sz) (((count * sz) < 1024) ? stackalloc(count * sz) : malloc(count * sz))
-#define DEALLOC_GUARDED(x, count,sz) if (((count) * (sz)) >= 1024) free((x))
-
-BLURGAPI void blurg_build_formatted(blurg_t *blurg, blurg_formatted_text_t *texts, int count, int measureCursor, float maxWidth, blurg_result_t *result)
+static void paragraph_alloc(paragraph_info *para)
 {
-    list_text_line lines;
-    list_text_line_init(&lines, 8);
+    list_text_line_init(&para->hardLines, 8);
+    shaped_store_init(&para->shaped);
+    list_style_run_init(&para->styles, 1);
+    para->breaks = NULL;
+    para->advances = NULL;
+    para->capacity = 0;
+}
 
-    int sumParagraphs = 0;
+// Shapes text into para, reusing the memory of a previous paragraph
+static void paragraph_shape(blurg_t *blurg, blurg_formatted_text_t *text, paragraph_info *para, int paraIndex, int needCursors)
+{
+    para->total = text_length(text->text, text->textLen, text->encoding);
+    para->hardLines.count = 0;
+    para->shaped.chunks.count = 0;
+    para->shaped.glyphs.count = 0;
+    para->shaped.cursorPositions.count = 0;
+    para->styles.count = 0;
+    if(!para->total) {
+        return;
+    }
+    if(para->total > para->capacity) {
+        para->breaks = realloc(para->breaks, para->total);
+        para->advances = realloc(para->advances, para->total * sizeof(float));
+        para->capacity = para->total;
+    }
+    shapecache_sync(blurg);
+    blurg_get_lines(text->text, para->total, text->encoding, &para->hardLines, para->breaks, paraIndex);
+    build_style_runs(blurg, text, para->total, &para->styles);
+    for(int i = 0; i < para->hardLines.count; i++) {
+        text_line *line = &para->hardLines.data[i];
+        if(line->isBreak) {
+            line->chunkStart = line->chunkCount = 0;
+            continue;
+        }
+        shape_hard_line(blurg, text, &para->styles, &para->shaped, line, needCursors);
+        cluster_advances(&para->shaped, line, para->advances);
+    }
+}
+
+// returns the index of the hard line containing text position i
+static int hard_line_find(const list_text_line *lines, int i)
+{
+    int lo = 0;
+    int hi = lines->count - 1;
+    while(lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if(lines->data[mid].textStart <= i)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
 
-    paragraph_info* paragraphs = ALLOC_GUARDED(count, sizeof(paragraph_info));
+// returns the index of the first chunk starting at or after text position i
+static int chunk_find(const list_line_chunk *chunks, int i)
+{
+    int lo = 0;
+    int hi = chunks->count;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(chunks->data[mid].textStart < i)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
-    // Build info and process mandatory line breaks
-    // Perform allocation of layers
-    int hasBackground = 0;
-    int hasShadow = 0;
-    int hasUnderline = 0;
+// Replaces [index, index + removed) of an array holding count elements with room for inserted
+// elements. The array must have space for count - removed + inserted elements
+static void array_splice(void *data, int count, size_t size, int index, int removed, int inserted)
+{
+    char *base = data;
+    memmove(base + (index + inserted) * size, base + (index + removed) * size, (count - index - removed) * size);
+}
 
-    for(int i = 0; i < count; i++) {
-        paragraphs[i].start = sumParagraphs;
-        paragraphs[i].lineOffset = lines.count;
-        blurg_get_lines(texts[i].text, texts[i].textLen, &paragraphs[i].total, texts[i].encoding, &lines, &paragraphs[i].breaks, i);
-        sumParagraphs += paragraphs[i].total;
-        if(!paragraphs[i].total) {
-            paragraphs[i].attributes = NULL;
+// Updates a shaped paragraph after [position, position + removed) of its text was replaced by
+// inserted units. Only the hard lines overlapping the edit are broken and shaped again, the
+// lines after them are moved. text must already hold the edited text
+static void paragraph_edit(blurg_t *blurg, blurg_formatted_text_t *text, paragraph_info *para, int paraIndex, int needCursors,
+    int position, int removed, int inserted)
+{
+    int oldTotal = para->total;
+    int total = text_length(text->text, text->textLen, text->encoding);
+    if(!oldTotal || !total) {
+        paragraph_shape(blurg, text, para, paraIndex, needCursors);
+        return;
+    }
+    list_text_line *lines = &para->hardLines;
+    int delta = inserted - removed;
+    // the line before the edit is included, the edit may join it to the next line
+    int first = hard_line_find(lines, position > 0 ? position - 1 : 0);
+    int last = position + removed < oldTotal ? hard_line_find(lines, position + removed) : lines->count - 1;
+    int start = lines->data[first].textStart;
+    int oldEnd = last + 1 < lines->count ? lines->data[last + 1].textStart : oldTotal;
+    if(oldEnd + delta == start && last + 1 < lines->count) {
+        // whole lines were removed, break the next one again as it may now start the text
+        last++;
+        oldEnd = last + 1 < lines->count ? lines->data[last + 1].textStart : oldTotal;
+    }
+    int end = oldEnd + delta;
+
+    if(total > para->capacity) {
+        para->breaks = realloc(para->breaks, total);
+        para->advances = realloc(para->advances, total * sizeof(float));
+        para->capacity = total;
+    }
+    memmove(para->breaks + end, para->breaks + oldEnd, oldTotal - oldEnd);
+    memmove(para->advances + end, para->advances + oldEnd, (oldTotal - oldEnd) * sizeof(float));
+    para->total = total;
+
+    shapecache_sync(blurg);
+    // runs are per span, rebuilding them doesn't depend on the text length
+    build_style_runs(blurg, text, total, &para->styles);
+    list_text_line edited;
+    list_text_line_init(&edited, last - first + 2);
+    blurg_get_lines_range(text->text, start, end, text->encoding, &edited, para->breaks, paraIndex);
+    shaped_store region;
+    shaped_store_init(&region);
+    for(int i = 0; i < edited.count; i++) {
+        text_line *line = &edited.data[i];
+        if(line->isBreak) {
+            line->chunkStart = line->chunkCount = 0;
             continue;
         }
-        if(texts[i].defaultShadow.pixels) {
-            hasShadow = 1;
-        }
-        if(texts[i].defaultUnderline.enabled) {
-            hasUnderline = 1;
-        }
-        if(texts[i].defaultBackground & 0xFF000000) {
-            hasBackground = 1;
+        shape_hard_line(blurg, text, &para->styles, &region, line, needCursors);
+    }
+
+    // splice the shaped region over the chunks, glyphs and cursors of the old lines
+    shaped_store *store = &para->shaped;
+    int chunkLo = chunk_find(&store->chunks, start);
+    int chunkHi = chunk_find(&store->chunks, oldEnd);
+    int glyphLo = chunkLo < store->chunks.count ? store->chunks.data[chunkLo].glyphStart : store->glyphs.count;
+    int glyphHi = chunkHi < store->chunks.count ? store->chunks.data[chunkHi].glyphStart : store->glyphs.count;
+    int cursorLo = needCursors && chunkLo < store->chunks.count ? store->chunks.data[chunkLo].cursorStart : store->cursorPositions.count;
+    int cursorHi = needCursors && chunkHi < store->chunks.count ? store->chunks.data[chunkHi].cursorStart : store->cursorPositions.count;
+    int chunkDelta = region.chunks.count - (chunkHi - chunkLo);
+    int glyphDelta = region.glyphs.count - (glyphHi - glyphLo);
+    int cursorDelta = region.cursorPositions.count - (cursorHi - cursorLo);
+
+    list_line_chunk_ensure_size(&store->chunks, store->chunks.count + chunkDelta);
+    array_splice(store->chunks.data, store->chunks.count, sizeof(line_chunk), chunkLo, chunkHi - chunkLo, region.chunks.count);
+    store->chunks.count += chunkDelta;
+    for(int i = 0; i < region.chunks.count; i++) {
+        line_chunk chunk = region.chunks.data[i];
+        chunk.glyphStart += glyphLo;
+        if(chunk.cursorStart >= 0)
+            chunk.cursorStart += cursorLo;
+        store->chunks.data[chunkLo + i] = chunk;
+    }
+    for(int i = chunkLo + region.chunks.count; i < store->chunks.count; i++) {
+        line_chunk *chunk = &store->chunks.data[i];
+        chunk->textStart += delta;
+        chunk->glyphStart += glyphDelta;
+        if(chunk->cursorStart >= 0)
+            chunk->cursorStart += cursorDelta;
+    }
+
+    list_raqm_glyph_t_ensure_size(&store->glyphs, store->glyphs.count + glyphDelta);
+    array_splice(store->glyphs.data, store->glyphs.count, sizeof(raqm_glyph_t), glyphLo, glyphHi - glyphLo, region.glyphs.count);
+    store->glyphs.count += glyphDelta;
+    if(region.glyphs.count) {
+        memcpy(&store->glyphs.data[glyphLo], region.glyphs.data, region.glyphs.count * sizeof(raqm_glyph_t));
+    }
+    for(int i = glyphLo + region.glyphs.count; i < store->glyphs.count; i++) {
+        store->glyphs.data[i].cluster += delta;
+    }
+
+    list_int_ensure_size(&store->cursorPositions, store->cursorPositions.count + cursorDelta);
+    array_splice(store->cursorPositions.data, store->cursorPositions.count, sizeof(int), cursorLo, cursorHi - cursorLo, region.cursorPositions.count);
+    store->cursorPositions.count += cursorDelta;
+    if(region.cursorPositions.count) {
+        memcpy(&store->cursorPositions.data[cursorLo], region.cursorPositions.data, region.cursorPositions.count * sizeof(int));
+    }
+
+    // and the edited lines over the old ones
+    int lineDelta = edited.count - (last + 1 - first);
+    list_text_line_ensure_size(lines, lines->count + lineDelta);
+    array_splice(lines->data, lines->count, sizeof(text_line), first, last + 1 - first, edited.count);
+    lines->count += lineDelta;
+    for(int i = 0; i < edited.count; i++) {
+        text_line line = edited.data[i];
+        if(!line.isBreak) {
+            line.chunkStart += chunkLo;
+            cluster_advances(store, &line, para->advances);
         }
-        if(texts[i].spans && texts[i].spanCount) {
-            int* attributes = malloc(paragraphs[i].total * sizeof(int));
-            for(int j = 0; j < paragraphs[i].total; j++) 
-            {
-                attributes[j] = -1;
-            }
-            for(int j = 0; j < texts[i].spanCount; j++) 
-            {
-                if(texts[i].spans[j].underline.enabled) {
-                    hasUnderline = 1;
-                }
-                if(texts[i].spans[j].background & 0xFF000000) {
-                    hasBackground = 1;
-                }
-                if(texts[i].spans[j].shadow.pixels) {
-                    hasShadow = 1;
-                }
-                for(int k = texts[i].spans[j].startIndex; k <= texts[i].spans[j].endIndex; k++) 
-                {
-                    if(k >= 0 && k < paragraphs[i].total) {
-                        attributes[k] = j; //range check
-                    }
-                }
+        lines->data[first + i] = line;
+    }
+    for(int i = first + edited.count; i < lines->count; i++) {
+        text_line *line = &lines->data[i];
+        line->textStart += delta;
+        if(!line->isBreak)
+            line->chunkStart += chunkDelta;
+    }
+    list_text_line_free(&edited);
+    shaped_store_free(&region);
+}
+
+static void paragraph_init(blurg_t *blurg, blurg_formatted_text_t *text, paragraph_info *para, int paraIndex, int needCursors)
+{
+    paragraph_alloc(para);
+    paragraph_shape(blurg, text, para, paraIndex, needCursors);
+}
+
+static void paragraph_free(paragraph_info *para)
+{
+    list_text_line_free(&para->hardLines);
+    shaped_store_free(&para->shaped);
+    list_style_run_free(&para->styles);
+    free(para->breaks);
+    free(para->advances);
+}
+
+// Wraps and emits the lines of a paragraph into ctx->lines
+static void paragraph_layout(
+    blurg_t *blurg,
+    blurg_formatted_text_t *text,
+    const paragraph_info *para,
+    build_context *ctx,
+    blurg_cursor_t *cursors,
+    float maxWidth)
+{
+    const list_style_run *styles = &para->styles;
+    for(int i = 0; i < para->hardLines.count; i++) {
+        const text_line *hardLine = &para->hardLines.data[i];
+        if(hardLine->isBreak) {
+            // This line is just an \n.
+            // Set line height and early exit
+            text_line line = *hardLine;
+            line.width = 0;
+            int span = IDX_SPAN(line.textStart);
+            blurg_font_t *fnt = SPAN_FONT(span);
+            font_use_size(fnt, SPAN_SIZE(span));
+            line.lineHeight = fnt->lineHeight;
+            for(int j = 0; j < ctx->layerCount; j++) {
+                line.rectStarts[j] = 0;
+                line.rectCounts[j] = 0;
             }
-            paragraphs[i].attributes = attributes;
-        } else {
-            paragraphs[i].attributes = NULL;
+            list_text_line_add(ctx->lines, line);
+            continue;
+        }
+        wrap_hard_line(text, para->breaks, para->advances, ctx, hardLine->textStart, hardLine->textCount, maxWidth);
+        int chunkIndex = hardLine->chunkStart;
+        for(int j = 0; j < ctx->wrapped.count; j++) {
+            layout_wrapped_line(blurg, text, &para->styles, &para->shaped, hardLine, ctx, cursors, &ctx->wrapped.data[j], &chunkIndex);
         }
     }
+}
+#undef IDX_SPAN
 
-    build_context ctx;
-    ctx.lines = &lines;
-    ctx.layerCount = 0;
-    if(hasBackground) {
-        ctx.l_background = 0;
-        ctx.layerCount++;
-        list_blurg_rect_t_init(&ctx.layers[0], sumParagraphs);
-    } else {
-        ctx.l_background = -1;
+// checks which layers a text may emit rects to
+static void text_layer_flags(blurg_formatted_text_t *text, int *hasBackground, int *hasShadow, int *hasUnderline)
+{
+    if(text->defaultShadow.pixels) {
+        *hasShadow = 1;
     }
-    if(hasShadow) {
-        ctx.l_shadow = ctx.layerCount;
-        ctx.layerCount++;
-        list_blurg_rect_t_init(&ctx.layers[ctx.l_shadow], sumParagraphs);
+    if(text->defaultUnderline.enabled) {
+        *hasUnderline = 1;
     }
-    if(hasUnderline) {
-        ctx.l_underline = ctx.layerCount++;
-        list_blurg_rect_t_init(&ctx.layers[ctx.l_underline], ctx.l_underline == 0 ? sumParagraphs : 8);
+    if(text->defaultBackground & 0xFF000000) {
+        *hasBackground = 1;
+    }
+    for(int j = 0; text->spans && j < text->spanCount; j++)
+    {
+        if(text->spans[j].underline.enabled) {
+            *hasUnderline = 1;
+        }
+        if(text->spans[j].background & 0xFF000000) {
+            *hasBackground = 1;
+        }
+        if(text->spans[j].shadow.pixels) {
+            *hasShadow = 1;
+        }
     }
-    ctx.l_glyphs = ctx.layerCount++;
-    list_blurg_rect_t_init(&ctx.layers[ctx.l_glyphs], sumParagraphs);
+}
 
-    blurg_cursor_t *cursors = measureCursor 
-        ? (blurg_cursor_t*)calloc(sumParagraphs, sizeof(blurg_cursor_t)) 
-        : NULL; 
+// Picks the index of each layer, layers are in draw order
+static void build_context_assign_layers(build_context *ctx, int hasBackground, int hasShadow, int hasUnderline)
+{
+    ctx->layerCount = 0;
+    ctx->l_background = hasBackground ? ctx->layerCount++ : -1;
+    ctx->l_shadow = hasShadow ? ctx->layerCount++ : -1;
+    ctx->l_underline = hasUnderline ? ctx->layerCount++ : -1;
+    ctx->l_glyphs = ctx->layerCount++;
+}
 
+static int layer_capacity(build_context *ctx, int layer, int sumParagraphs)
+{
+    return layer == ctx->l_underline ? 8 : sumParagraphs;
+}
+
+static void build_context_layers(build_context *ctx, int hasBackground, int hasShadow, int hasUnderline, int sumParagraphs)
+{
+    build_context_assign_layers(ctx, hasBackground, hasShadow, hasUnderline);
+    for(int i = 0; i < ctx->layerCount; i++) {
+        list_blurg_rect_t_init(&ctx->layers[i], layer_capacity(ctx, i, sumParagraphs));
+    }
+}
+
+// Aligns and positions the lines in ctx and their rects, returns the size of the text
+static void position_lines(build_context *ctx, blurg_formatted_text_t *texts, const int *cursorStarts,
+    blurg_cursor_t *cursors, float maxWidth, float *width, float *height)
+{
+    list_text_line *lines = ctx->lines;
     float alignWidth = maxWidth;
-    for(int i = 0; i < lines.count; i++) {
-        int para = lines.data[i].paraIndex;
-        blurg_cursor_t *cur = cursors
-            ? &cursors[paragraphs[para].start]
-            : NULL;
-        blurg_wrap_shape_line(blurg, &texts[para], &ctx, cur, paragraphs[para].attributes, &lines, paragraphs[para].breaks, i, maxWidth);
-        if(lines.data[i].width > alignWidth) {
-            alignWidth = lines.data[i].width;
+    for(int i = 0; i < lines->count; i++) {
+        if(lines->data[i].width > alignWidth) {
+            alignWidth = lines->data[i].width;
         }
     }
 
     // position lines
     float y = 0;
     float w = 0;
-    for(int i = 0; i < lines.count; i++) {
-        int pIdx = lines.data[i].paraIndex;
+    for(int i = 0; i < lines->count; i++) {
+        int pIdx = lines->data[i].paraIndex;
         float offsetW = 0;
         if(texts[pIdx].alignment == blurg_align_right) {
-            offsetW = (alignWidth - lines.data[i].width);
+            offsetW = (alignWidth - lines->data[i].width);
         }
         if(texts[pIdx].alignment == blurg_align_center) {
-            offsetW = (alignWidth / 2.0) - (lines.data[i].width / 2.0);
+            offsetW = (alignWidth / 2.0) - (lines->data[i].width / 2.0);
         }
-        if(!lines.data[i].isBreak) {
+        if(!lines->data[i].isBreak) {
             // copy rects
-            for(int j = 0; j < ctx.layerCount; j++) {
-                int start = lines.data[i].rectStarts[j];
-                int count = lines.data[i].rectCounts[j];
+            for(int j = 0; j < ctx->layerCount; j++) {
+                int start = lines->data[i].rectStarts[j];
+                int count = lines->data[i].rectCounts[j];
                 for(int k = 0; k < count; k++) {
                     //process alignment
-                    ctx.layers[j].data[start + k].x += offsetW;
+                    ctx->layers[j].data[start + k].x += offsetW;
                     //position line
-                    ctx.layers[j].data[start + k].y += y;
+                    ctx->layers[j].data[start + k].y += y;
                 }
             }
-            if((lines.data[i].width + offsetW) > w)
-                w = (lines.data[i].width + offsetW);
+            if((lines->data[i].width + offsetW) > w)
+                w = (lines->data[i].width + offsetW);
         }
-        if(measureCursor) 
+        if(cursors)
         {
-            int s = lines.data[i].textStart 
-                + paragraphs[lines.data[i].paraIndex].start;
-            for(int c = 0; c < lines.data[i].textCount; c++) 
+            int s = lines->data[i].textStart + cursorStarts[pIdx];
+            for(int c = 0; c < lines->data[i].textCount; c++)
             {
                 cursors[s + c].x += offsetW;
                 cursors[s + c].y += y;
-                cursors[s + c].height = lines.data[i].lineHeight;  
+                cursors[s + c].height = lines->data[i].lineHeight;
             }
         }
-        y += lines.data[i].lineHeight;
+        y += lines->data[i].lineHeight;
     }
-    //cleanup and return
-    for(int i = 0; i < count; i++) {
-        free(paragraphs[i].breaks);
-        if(paragraphs[i].attributes)
-            free(paragraphs[i].attributes);  
+    *width = w;
+    *height = y;
+}
+
+// Copies the layers of ctx in draw order to dst
+static void copy_layers(build_context *ctx, blurg_rect_t *dst)
+{
+    for(int i = 0; i < ctx->layerCount; i++) {
+        if(ctx->layers[i].count) {
+            memcpy(dst, ctx->layers[i].data, ctx->layers[i].count * sizeof(blurg_rect_t));
+            dst += ctx->layers[i].count;
+        }
     }
-    DEALLOC_GUARDED(paragraphs, count, sizeof(paragraph_info));
-    list_text_line_free(&lines);
-    
-    int extraCount = 0;
-    for(int i = 1; i < ctx.layerCount; i++) {
-        extraCount += ctx.layers[i].count;
-    }
-    // one resize only
-    list_blurg_rect_t_ensure_size(&ctx.layers[0], ctx.layers[0].count + extraCount);
-    // flatten layers
-    for(int i = 1; i < ctx.layerCount; i++) {
-        list_blurg_rect_t_add_range(&ctx.layers[0], &ctx.layers[i]);
-        list_blurg_rect_t_free(&ctx.layers[i]);
+}
+
+static int layer_rect_count(build_context *ctx)
+{
+    int count = 0;
+    for(int i = 0; i < ctx->layerCount; i++) {
+        count += ctx->layers[i].count;
+    }
+    return count;
+}
+
+// atlas page textures, indexed by blurg_packed_rect_t.page
+typedef struct {
+    blurg_texture_t *textures[MAX_TEXTURES * 3];
+    int count;
+    // last page found, consecutive rects are mostly on the same page
+    int last;
+} packed_pages;
+
+// returns the page of texture, -1 if it isn't an atlas page
+static int packed_page(packed_pages *pages, const blurg_texture_t *texture)
+{
+    if(pages->last < pages->count && pages->textures[pages->last] == texture) {
+        return pages->last;
+    }
+    for(int i = 0; i < pages->count; i++) {
+        if(pages->textures[i] == texture) {
+            pages->last = i;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// rects without area or page are not packed
+static int layer_packed_count(build_context *ctx, packed_pages *pages)
+{
+    int count = 0;
+    for(int i = 0; i < ctx->layerCount; i++) {
+        for(int j = 0; j < ctx->layers[i].count; j++) {
+            const blurg_rect_t *r = &ctx->layers[i].data[j];
+            count += r->width > 0 && r->height > 0 && packed_page(pages, r->texture) >= 0;
+        }
+    }
+    return count;
+}
+
+static int16_t clamp_int16(int value)
+{
+    return value < INT16_MIN ? INT16_MIN : (value > INT16_MAX ? INT16_MAX : (int16_t)value);
+}
+
+// Copies the layers as blurg_packed_rect_t, skipping the rects layer_packed_count skips
+static void copy_layers_packed(build_context *ctx, packed_pages *pages, blurg_packed_rect_t *dst)
+{
+    for(int i = 0; i < ctx->layerCount; i++) {
+        for(int j = 0; j < ctx->layers[i].count; j++) {
+            const blurg_rect_t *r = &ctx->layers[i].data[j];
+            if(r->width <= 0 || r->height <= 0) {
+                continue;
+            }
+            int page = packed_page(pages, r->texture);
+            if(page < 0) {
+                continue;
+            }
+            // UVs are multiples of 1 / BLURG_TEXTURE_SIZE, so truncating is exact
+            *dst++ = (blurg_packed_rect_t){
+                .x = clamp_int16(r->x),
+                .y = clamp_int16(r->y),
+                .width = clamp_int16(r->width),
+                .height = clamp_int16(r->height),
+                .u0 = (uint16_t)(r->u0 * BLURG_TEXTURE_SIZE),
+                .v0 = (uint16_t)(r->v0 * BLURG_TEXTURE_SIZE),
+                .u1 = (uint16_t)(r->u1 * BLURG_TEXTURE_SIZE),
+                .v1 = (uint16_t)(r->v1 * BLURG_TEXTURE_SIZE),
+                .color = r->color,
+                .page = (uint16_t)page,
+            };
+        }
     }
+}
+
+// Aligns and positions the lines in ctx, then copies the layers into result
+static void build_result(build_context *ctx, blurg_formatted_text_t *texts, const int *cursorStarts,
+    blurg_cursor_t *cursors, int cursorCount, float maxWidth, blurg_result_t *result)
+{
+    float w, y;
+    position_lines(ctx, texts, cursorStarts, cursors, maxWidth, &w, &y);
 
     result->width = w;
     result->height = y;
     result->cursors = cursors;
-    result->cursorCount = cursors ? sumParagraphs : 0;
+    result->cursorCount = cursors ? cursorCount : 0;
 
-    if(ctx.layers[0].count > 0) {
-        list_blurg_rect_t_shrink(&ctx.layers[0]);
-        result->rects = ctx.layers[0].data;
-        result->rectCount = ctx.layers[0].count;
+    result->rectCount = layer_rect_count(ctx);
+    if(result->rectCount > 0) {
+        result->rects = util_export_malloc(result->rectCount * sizeof(blurg_rect_t));
+        copy_layers(ctx, result->rects);
     } else {
-        list_blurg_rect_t_free(&ctx.layers[0]);
         result->rects = NULL;
-        result->rectCount = 0;
     }
 }
 
-BLURGAPI void blurg_measure_formatted(blurg_t *blurg, blurg_formatted_text_t *texts, int count, float maxWidth, float* width, float *height)
+// Computes the measured size of the lines in ctx
+static void measure_result(const list_text_line *lines, blurg_formatted_text_t *texts, float maxWidth, float *width, float *height)
 {
-    if(!width && !height)
-        return;
-
-    int total;
-    list_text_line lines;
-    list_text_line_init(&lines, 2 * count);
-    char *breaks;
-
-    // measure all paragraphs
     float h = 0;
-    float w = 0;    
-    
+    float w = 0;
     int hasAlign = 0;
     float alignWidth = maxWidth;
-
-    for(int i = 0; i < count; i++) {
-        int startIdx = lines.count;
-        blurg_get_lines(texts[i].text, texts[i].textLen, &total, texts[i].encoding, &lines, &breaks, i);
-        if(!total) {
-            free(breaks);
-            continue;
-        }
-        if(texts[i].alignment == blurg_align_center ||
-           texts[i].alignment == blurg_align_right) {
+    for(int i = 0; i < lines->count; i++) {
+        int pIdx = lines->data[i].paraIndex;
+        if(texts[pIdx].alignment == blurg_align_center ||
+           texts[pIdx].alignment == blurg_align_right) {
             hasAlign = 1;
         }
-        // Attribute lookup table
-        int* attributes = NULL;
-        if(texts[i].spans && texts[i].spanCount) {
-            attributes = malloc(total * sizeof(int));
-            for(int j = 0; j < total; j++) 
-            {
-                attributes[j] = -1;
-            }
-            for(int j = 0; j < texts[i].spanCount; j++) {
-                for(int k = texts[i].spans[j].startIndex; k <= texts[i].spans[j].endIndex; k++) {
-                    attributes[k] = j;
-                }
-            }
+        if(lines->data[i].width > alignWidth) {
+            alignWidth = lines->data[i].width;
         }
-        for(int j = startIdx; j < lines.count; j++) {
-            blurg_measure_line(blurg, &texts[i], attributes, &lines, breaks, j, maxWidth);
-            if(lines.data[j].width > alignWidth) {
-                alignWidth = lines.data[j].width;
-            }
-            if(lines.data[j].width > w) {
-                w = lines.data[j].width;
-            }
-            h += lines.data[j].lineHeight;
+        if(lines->data[i].width > w) {
+            w = lines->data[i].width;
         }
-        if(attributes)
-            free(attributes);
-        free(breaks);
+        h += lines->data[i].lineHeight;
     }
-    
+
     // adjust for alignment
     if(hasAlign && width) {
-        for(int i = 0; i < lines.count; i++) {
-            int pIdx = lines.data[i].paraIndex;
-            if(lines.data[i].isBreak ||
+        for(int i = 0; i < lines->count; i++) {
+            int pIdx = lines->data[i].paraIndex;
+            if(lines->data[i].isBreak ||
                texts[pIdx].alignment == blurg_align_left) {
                continue;
             }
             float offsetW = 0;
             if(texts[pIdx].alignment == blurg_align_right) {
-                offsetW = (alignWidth - lines.data[i].width);
+                offsetW = (alignWidth - lines->data[i].width);
             }
             if(texts[pIdx].alignment == blurg_align_center) {
-                offsetW = (alignWidth / 2.0) - (lines.data[i].width / 2.0);
+                offsetW = (alignWidth / 2.0) - (lines->data[i].width / 2.0);
             }
-            if(offsetW + lines.data[i].width > w) {
-                w = offsetW + lines.data[i].width;
+            if(offsetW + lines->data[i].width > w) {
+                w = offsetW + lines->data[i].width;
             }
         }
     }
 
-    list_text_line_free(&lines);
     if(width) {
         *width = w;
     }
@@ -1072,6 +1685,958 @@ BLURGAPI void blurg_measure_formatted(blurg_t *blurg, blurg_formatted_text_t *te
     }
 }
 
+// Lists used by builds, kept for the next build so a warmed up build doesn't allocate
+typedef struct build_scratch {
+    list_text_line lines;
+    build_context ctx;
+    // reused by each text shaped on the calling thread
+    paragraph_info para;
+    // reused by parallel shaping, one per text
+    paragraph_info *paragraphs;
+    int paragraphCount;
+} build_scratch;
+
+static build_scratch *build_scratch_get(blurg_t *blurg)
+{
+    if(!blurg->scratch) {
+        build_scratch *scratch = malloc(sizeof(build_scratch));
+        list_text_line_init(&scratch->lines, 8);
+        build_context_init(&scratch->ctx, &scratch->lines);
+        for(int i = 0; i < LAYER_MAX; i++) {
+            list_blurg_rect_t_init(&scratch->ctx.layers[i], 64);
+        }
+        paragraph_alloc(&scratch->para);
+        scratch->paragraphs = NULL;
+        scratch->paragraphCount = 0;
+        blurg->scratch = scratch;
+    }
+    blurg->scratch->lines.count = 0;
+    return blurg->scratch;
+}
+
+static void build_scratch_free(blurg_t *blurg)
+{
+    build_scratch *scratch = blurg->scratch;
+    if(!scratch) {
+        return;
+    }
+    list_text_line_free(&scratch->lines);
+    build_context_free(&scratch->ctx);
+    for(int i = 0; i < LAYER_MAX; i++) {
+        list_blurg_rect_t_free(&scratch->ctx.layers[i]);
+    }
+    paragraph_free(&scratch->para);
+    for(int i = 0; i < scratch->paragraphCount; i++) {
+        paragraph_free(&scratch->paragraphs[i]);
+    }
+    free(scratch->paragraphs);
+    free(scratch);
+}
+
+// Empties the scratch layers and picks the ones used by a build
+static void build_scratch_layers(build_context *ctx, int hasBackground, int hasShadow, int hasUnderline, int sumParagraphs)
+{
+    build_context_assign_layers(ctx, hasBackground, hasShadow, hasUnderline);
+    for(int i = 0; i < ctx->layerCount; i++) {
+        ctx->layers[i].count = 0;
+        list_blurg_rect_t_ensure_size(&ctx->layers[i], layer_capacity(ctx, i, sumParagraphs));
+    }
+}
+
+// Ends a build, once nothing is allocated from the arena
+static void build_end(blurg_t *blurg, uint64_t allocations)
+{
+    arena_reset(&blurg->arena);
+    blurg->buildAllocations = util_allocations() - allocations;
+}
+
+// Paragraphs shaped in parallel by blurg_set_task_scheduler tasks.
+// Each task shapes with a worker context and its copies of the fonts, then the
+// paragraphs are wrapped and emitted in order on the calling thread with the same worker
+typedef struct {
+    blurg_t *blurg;
+    blurg_formatted_text_t *texts;
+    int needCursors;
+    // texts using the fonts of their worker
+    blurg_formatted_text_t *local;
+    blurg_style_span_t *spans;
+    int *spanStarts;
+    blurg_t **workers;
+    paragraph_info *paragraphs;
+    arena_mark mark;
+} parallel_shape;
+
+static void shape_paragraph_task(void *taskData, int index)
+{
+    parallel_shape *job = taskData;
+    // runs on a scheduler thread
+    ALLOCATOR_ENTER(job->blurg);
+    blurg_t *worker = context_worker_acquire(job->blurg);
+    if(context_translate_text(worker, &job->texts[index], &job->local[index], &job->spans[job->spanStarts[index]])) {
+        paragraph_shape(worker, &job->local[index], &job->paragraphs[index], index, job->needCursors);
+        arena_reset(&worker->arena);
+        job->workers[index] = worker;
+    } else {
+        // shaped on the calling thread, see parallel_shape_begin
+        job->workers[index] = NULL;
+    }
+    context_worker_release(job->blurg, worker);
+    ALLOCATOR_LEAVE();
+}
+
+// Shapes all paragraphs with the task scheduler, returns 0 if they should be shaped serially
+static int parallel_shape_begin(blurg_t *blurg, blurg_formatted_text_t *texts, int count, int needCursors, parallel_shape *job)
+{
+    if(!blurg->parallelFor || blurg->parent || count < 2) {
+        return 0;
+    }
+    build_scratch *scratch = build_scratch_get(blurg);
+    if(count > scratch->paragraphCount) {
+        scratch->paragraphs = realloc(scratch->paragraphs, count * sizeof(paragraph_info));
+        for(int i = scratch->paragraphCount; i < count; i++) {
+            paragraph_alloc(&scratch->paragraphs[i]);
+        }
+        scratch->paragraphCount = count;
+    }
+    job->blurg = blurg;
+    job->texts = texts;
+    job->needCursors = needCursors;
+    job->mark = arena_save(&blurg->arena);
+    job->local = arena_alloc(&blurg->arena, count * sizeof(blurg_formatted_text_t));
+    job->spanStarts = arena_alloc(&blurg->arena, count * sizeof(int));
+    int spanCount = 0;
+    for(int i = 0; i < count; i++) {
+        job->spanStarts[i] = spanCount;
+        spanCount += texts[i].spans ? texts[i].spanCount : 0;
+    }
+    job->spans = arena_alloc(&blurg->arena, (spanCount ? spanCount : 1) * sizeof(blurg_style_span_t));
+    job->workers = arena_alloc(&blurg->arena, count * sizeof(blurg_t*));
+    job->paragraphs = scratch->paragraphs;
+    blurg->parallelFor(blurg->schedulerData, shape_paragraph_task, job, count);
+    // paragraphs with fonts a worker couldn't open use the fonts of blurg
+    for(int i = 0; i < count; i++) {
+        if(!job->workers[i]) {
+            job->local[i] = texts[i];
+            paragraph_shape(blurg, &job->local[i], &job->paragraphs[i], i, needCursors);
+            job->workers[i] = blurg;
+        }
+    }
+    return 1;
+}
+
+static void parallel_shape_end(parallel_shape *job)
+{
+    arena_restore(&job->blurg->arena, job->mark);
+}
+
+// Finds where the cursors of each text start and sets up the scratch lines and layers of blurg,
+// returns the total length of the texts
+static int build_setup(blurg_t *blurg, blurg_formatted_text_t *texts, int count, int *cursorStarts, build_context **ctx)
+{
+    int sumParagraphs = 0;
+    // Perform allocation of layers
+    int hasBackground = 0;
+    int hasShadow = 0;
+    int hasUnderline = 0;
+
+    for(int i = 0; i < count; i++) {
+        cursorStarts[i] = sumParagraphs;
+        sumParagraphs += text_length(texts[i].text, texts[i].textLen, texts[i].encoding);
+        text_layer_flags(&texts[i], &hasBackground, &hasShadow, &hasUnderline);
+    }
+
+    build_scratch *scratch = build_scratch_get(blurg);
+    build_scratch_layers(&scratch->ctx, hasBackground, hasShadow, hasUnderline, sumParagraphs);
+    *ctx = &scratch->ctx;
+    return sumParagraphs;
+}
+
+// Shapes and wraps all texts into the lines and layers of ctx
+static void build_lines(blurg_t *blurg, blurg_formatted_text_t *texts, int count, int measureCursor,
+    const int *cursorStarts, blurg_cursor_t *cursors, float maxWidth, build_context *ctx)
+{
+    parallel_shape job;
+    if(parallel_shape_begin(blurg, texts, count, measureCursor, &job)) {
+        // glyphs are looked up in order on this thread, so texture callbacks stay here
+        for(int i = 0; i < count; i++) {
+            paragraph_layout(job.workers[i], &job.local[i], &job.paragraphs[i], ctx, cursors ? &cursors[cursorStarts[i]] : NULL, maxWidth);
+        }
+        parallel_shape_end(&job);
+    } else {
+        // shape and lay out one paragraph at a time
+        paragraph_info *para = &blurg->scratch->para;
+        for(int i = 0; i < count; i++) {
+            paragraph_shape(blurg, &texts[i], para, i, measureCursor);
+            paragraph_layout(blurg, &texts[i], para, ctx, cursors ? &cursors[cursorStarts[i]] : NULL, maxWidth);
+        }
+    }
+}
+
+BLURGAPI void blurg_build_formatted(blurg_t *blurg, blurg_formatted_text_t *texts, int count, int measureCursor, float maxWidth, blurg_result_t *result)
+{
+    ALLOCATOR_ENTER(blurg);
+    uint64_t allocations = util_allocations();
+    arena_mark mark = arena_save(&blurg->arena);
+    int *cursorStarts = arena_alloc(&blurg->arena, count * sizeof(int));
+    build_context *ctx;
+    int sumParagraphs = build_setup(blurg, texts, count, cursorStarts, &ctx);
+
+    blurg_cursor_t *cursors = measureCursor
+        ? (blurg_cursor_t*)util_export_calloc(sumParagraphs, sizeof(blurg_cursor_t))
+        : NULL;
+    build_lines(blurg, texts, count, measureCursor, cursorStarts, cursors, maxWidth, ctx);
+
+    build_result(ctx, texts, cursorStarts, cursors, sumParagraphs, maxWidth, result);
+    arena_restore(&blurg->arena, mark);
+    glyphatlas_end_build(blurg);
+    build_end(blurg, allocations);
+    ALLOCATOR_LEAVE();
+}
+
+// Grows to at least needed, doubling so repeated growth is amortized
+static int grow_capacity(int capacity, int needed)
+{
+    if(capacity >= needed) {
+        return capacity;
+    }
+    capacity = capacity ? capacity * 2 : 64;
+    return capacity > needed ? capacity : needed;
+}
+
+BLURGAPI void blurg_build_formatted_buffer(blurg_t *blurg, blurg_formatted_text_t *texts, int count, int measureCursor, float maxWidth, blurg_result_buffer_t *buffer)
+{
+    ALLOCATOR_ENTER(blurg);
+    uint64_t allocations = util_allocations();
+    arena_mark mark = arena_save(&blurg->arena);
+    int *cursorStarts = arena_alloc(&blurg->arena, count * sizeof(int));
+    build_context *ctx;
+    int sumParagraphs = build_setup(blurg, texts, count, cursorStarts, &ctx);
+
+    blurg_cursor_t *cursors = NULL;
+    if(measureCursor && sumParagraphs) {
+        if(sumParagraphs > buffer->cursorCapacity) {
+            buffer->cursorCapacity = grow_capacity(buffer->cursorCapacity, sumParagraphs);
+            buffer->cursors = util_export_realloc(buffer->cursors, buffer->cursorCapacity * sizeof(blurg_cursor_t));
+        }
+        cursors = buffer->cursors;
+        memset(cursors, 0, sumParagraphs * sizeof(blurg_cursor_t));
+    }
+    build_lines(blurg, texts, count, measureCursor, cursorStarts, cursors, maxWidth, ctx);
+    position_lines(ctx, texts, cursorStarts, cursors, maxWidth, &buffer->width, &buffer->height);
+    buffer->cursorCount = cursors ? sumParagraphs : 0;
+
+    int rectCount = layer_rect_count(ctx);
+    if(rectCount > buffer->rectCapacity) {
+        buffer->rectCapacity = grow_capacity(buffer->rectCapacity, rectCount);
+        buffer->rects = util_export_realloc(buffer->rects, buffer->rectCapacity * sizeof(blurg_rect_t));
+    }
+    copy_layers(ctx, buffer->rects);
+    buffer->rectCount = rectCount;
+
+    arena_restore(&blurg->arena, mark);
+    glyphatlas_end_build(blurg);
+    build_end(blurg, allocations);
+    ALLOCATOR_LEAVE();
+}
+
+BLURGAPI int blurg_build_formatted_rects(blurg_t *blurg, blurg_formatted_text_t *texts, int count, float maxWidth, blurg_rect_t *rects, int capacity, float *width, float *height)
+{
+    ALLOCATOR_ENTER(blurg);
+    uint64_t allocations = util_allocations();
+    arena_mark mark = arena_save(&blurg->arena);
+    int *cursorStarts = arena_alloc(&blurg->arena, count * sizeof(int));
+    build_context *ctx;
+    build_setup(blurg, texts, count, cursorStarts, &ctx);
+    build_lines(blurg, texts, count, 0, cursorStarts, NULL, maxWidth, ctx);
+    float w, h;
+    position_lines(ctx, texts, cursorStarts, NULL, maxWidth, &w, &h);
+    if(width) {
+        *width = w;
+    }
+    if(height) {
+        *height = h;
+    }
+
+    // nothing is written if the rects don't fit
+    int rectCount = layer_rect_count(ctx);
+    if(rectCount <= capacity) {
+        copy_layers(ctx, rects);
+    }
+
+    arena_restore(&blurg->arena, mark);
+    glyphatlas_end_build(blurg);
+    build_end(blurg, allocations);
+    ALLOCATOR_LEAVE();
+    return rectCount;
+}
+
+BLURGAPI int blurg_build_formatted_packed(blurg_t *blurg, blurg_formatted_text_t *texts, int count, float maxWidth, blurg_packed_rect_t *rects, int capacity, float *width, float *height)
+{
+    ALLOCATOR_ENTER(blurg);
+    uint64_t allocations = util_allocations();
+    arena_mark mark = arena_save(&blurg->arena);
+    int *cursorStarts = arena_alloc(&blurg->arena, count * sizeof(int));
+    build_context *ctx;
+    build_setup(blurg, texts, count, cursorStarts, &ctx);
+    build_lines(blurg, texts, count, 0, cursorStarts, NULL, maxWidth, ctx);
+    float w, h;
+    position_lines(ctx, texts, cursorStarts, NULL, maxWidth, &w, &h);
+    if(width) {
+        *width = w;
+    }
+    if(height) {
+        *height = h;
+    }
+
+    // nothing is written if the rects don't fit
+    packed_pages pages;
+    pages.count = glyphatlas_page_textures(blurg, pages.textures);
+    pages.last = 0;
+    int rectCount = layer_packed_count(ctx, &pages);
+    if(rectCount <= capacity) {
+        copy_layers_packed(ctx, &pages, rects);
+    }
+
+    arena_restore(&blurg->arena, mark);
+    glyphatlas_end_build(blurg);
+    build_end(blurg, allocations);
+    ALLOCATOR_LEAVE();
+    return rectCount;
+}
+
+BLURGAPI void blurg_measure_formatted(blurg_t *blurg, blurg_formatted_text_t *texts, int count, float maxWidth, float* width, float *height)
+{
+    if(!width && !height)
+        return;
+
+    ALLOCATOR_ENTER(blurg);
+    uint64_t allocations = util_allocations();
+    // measuring only, no layers are emitted
+    build_scratch *scratch = build_scratch_get(blurg);
+    build_context *ctx = &scratch->ctx;
+    ctx->layerCount = 0;
+
+    parallel_shape job;
+    if(parallel_shape_begin(blurg, texts, count, 0, &job)) {
+        for(int i = 0; i < count; i++) {
+            paragraph_layout(job.workers[i], &job.local[i], &job.paragraphs[i], ctx, NULL, maxWidth);
+        }
+        parallel_shape_end(&job);
+    } else {
+        for(int i = 0; i < count; i++) {
+            paragraph_shape(blurg, &texts[i], &scratch->para, i, 0);
+            paragraph_layout(blurg, &texts[i], &scratch->para, ctx, NULL, maxWidth);
+        }
+    }
+
+    measure_result(&scratch->lines, texts, maxWidth, width, height);
+    build_end(blurg, allocations);
+    ALLOCATOR_LEAVE();
+}
+
+BLURGAPI void blurg_build_batch(blurg_t *blurg, const blurg_batch_item_t *items, int itemCount, blurg_batch_result_t *result)
+{
+    ALLOCATOR_ENTER(blurg);
+    uint64_t allocations = util_allocations();
+    arena_mark mark = arena_save(&blurg->arena);
+    // texts of all items in one array, lines refer to them by index
+    int textCount = 0;
+    for(int i = 0; i < itemCount; i++) {
+        textCount += items[i].count;
+    }
+    blurg_formatted_text_t *texts = arena_alloc(&blurg->arena, textCount * sizeof(blurg_formatted_text_t));
+    int sumParagraphs = 0;
+    int hasBackground = 0;
+    int hasShadow = 0;
+    int hasUnderline = 0;
+    int t = 0;
+    for(int i = 0; i < itemCount; i++) {
+        for(int j = 0; j < items[i].count; j++) {
+            texts[t] = items[i].texts[j];
+            sumParagraphs += text_length(texts[t].text, texts[t].textLen, texts[t].encoding);
+            text_layer_flags(&texts[t], &hasBackground, &hasShadow, &hasUnderline);
+            t++;
+        }
+    }
+
+    // lines and layers are reused by every item
+    build_scratch *scratch = build_scratch_get(blurg);
+    build_context *ctx = &scratch->ctx;
+    build_scratch_layers(ctx, hasBackground, hasShadow, hasUnderline, sumParagraphs);
+
+    // handed to the caller, so grown by hand rather than as a list
+    int rectCapacity = sumParagraphs ? sumParagraphs : 1;
+    int rectCount = 0;
+    blurg_rect_t *rects = util_export_malloc(rectCapacity * sizeof(blurg_rect_t));
+    result->items = util_export_malloc((itemCount ? itemCount : 1) * sizeof(blurg_batch_range_t));
+    result->itemCount = itemCount;
+
+    parallel_shape job;
+    int parallel = parallel_shape_begin(blurg, texts, textCount, 0, &job);
+    t = 0;
+    for(int i = 0; i < itemCount; i++) {
+        scratch->lines.count = 0;
+        for(int k = 0; k < ctx->layerCount; k++) {
+            ctx->layers[k].count = 0;
+        }
+        for(int j = 0; j < items[i].count; j++, t++) {
+            if(parallel) {
+                paragraph_layout(job.workers[t], &job.local[t], &job.paragraphs[t], ctx, NULL, items[i].maxWidth);
+            } else {
+                paragraph_shape(blurg, &texts[t], &scratch->para, t, 0);
+                paragraph_layout(blurg, &texts[t], &scratch->para, ctx, NULL, items[i].maxWidth);
+            }
+        }
+        blurg_batch_range_t *range = &result->items[i];
+        position_lines(ctx, texts, NULL, NULL, items[i].maxWidth, &range->width, &range->height);
+        // append the layers in draw order, growing the array geometrically
+        int itemRects = layer_rect_count(ctx);
+        if(rectCount + itemRects > rectCapacity) {
+            rectCapacity = grow_capacity(rectCapacity, rectCount + itemRects);
+            rects = util_export_realloc(rects, rectCapacity * sizeof(blurg_rect_t));
+        }
+        range->rectStart = rectCount;
+        range->rectCount = itemRects;
+        copy_layers(ctx, &rects[rectCount]);
+        rectCount += itemRects;
+    }
+    if(parallel) {
+        parallel_shape_end(&job);
+    }
+    arena_restore(&blurg->arena, mark);
+
+    if(rectCount > 0) {
+        result->rects = rectCount < rectCapacity ? util_export_realloc(rects, rectCount * sizeof(blurg_rect_t)) : rects;
+        result->rectCount = rectCount;
+    } else {
+        util_export_free(rects);
+        result->rects = NULL;
+        result->rectCount = 0;
+    }
+    glyphatlas_end_build(blurg);
+    build_end(blurg, allocations);
+    ALLOCATOR_LEAVE();
+}
+
+// Emitted lines of a paragraph at one width,
+// reused by blurg_layout_build until the paragraph or width changes
+typedef struct {
+    int valid;
+    float maxWidth;
+    // atlas generation the rects were emitted in
+    uint32_t generation;
+    list_text_line lines;
+    list_blurg_rect_t layers[LAYER_MAX];
+    int layerCount;
+    blurg_cursor_t *cursors;
+    // widest line and height of the emitted lines
+    float lineWidth;
+    float height;
+    // aligned copy of the layers and cursors for blurg_layout_update,
+    // relative to the top of the paragraph
+    int placed;
+    float alignWidth;
+    float width;
+    float y;
+    blurg_rect_t *rects;
+    int rectCount;
+    blurg_cursor_t *placedCursors;
+} paragraph_output;
+
+struct _blurg_layout {
+    blurg_t *blurg;
+    int count;
+    int measureCursor;
+    int sumParagraphs;
+    int hasBackground;
+    int hasShadow;
+    int hasUnderline;
+    // copies of the texts passed to blurg_layout_create
+    blurg_formatted_text_t *texts;
+    paragraph_info *paragraphs;
+    paragraph_output *outputs;
+    int *cursorStarts;
+};
+
+// copies text and spans so the layout does not reference caller memory
+static void copy_formatted_text(blurg_formatted_text_t *dst, const blurg_formatted_text_t *src)
+{
+    *dst = *src;
+    int unit = src->encoding == blurg_encoding_utf16 ? sizeof(uint16_t) : 1;
+    int len = text_length(src->text, src->textLen, src->encoding);
+    // null terminated, a textLen of 0 is read as an empty string
+    char *text = calloc(len + 1, unit);
+    memcpy(text, src->text, len * unit);
+    dst->text = text;
+    dst->textLen = len;
+    if(src->spans && src->spanCount) {
+        dst->spans = malloc(src->spanCount * sizeof(blurg_style_span_t));
+        memcpy(dst->spans, src->spans, src->spanCount * sizeof(blurg_style_span_t));
+    } else {
+        dst->spans = NULL;
+        dst->spanCount = 0;
+    }
+}
+
+static void paragraph_output_free(paragraph_output *out)
+{
+    if(!out->valid) {
+        return;
+    }
+    list_text_line_free(&out->lines);
+    for(int i = 0; i < out->layerCount; i++) {
+        list_blurg_rect_t_free(&out->layers[i]);
+    }
+    free(out->cursors);
+    free(out->rects);
+    free(out->placedCursors);
+    out->valid = 0;
+    out->placed = 0;
+}
+
+// Wraps and emits a paragraph of the layout into its own output
+static void paragraph_emit(blurg_layout_t *layout, int index, float maxWidth)
+{
+    paragraph_info *para = &layout->paragraphs[index];
+    paragraph_output *out = &layout->outputs[index];
+    // read before emitting, an eviction while emitting leaves the output stale
+    out->generation = layout->blurg->packed.generation;
+    list_text_line_init(&out->lines, para->hardLines.count);
+    build_context ctx;
+    build_context_init(&ctx, &out->lines);
+    build_context_layers(&ctx, layout->hasBackground, layout->hasShadow, layout->hasUnderline, para->total);
+    out->cursors = layout->measureCursor && para->total
+        ? (blurg_cursor_t*)calloc(para->total, sizeof(blurg_cursor_t))
+        : NULL;
+    paragraph_layout(layout->blurg, &layout->texts[index], para, &ctx, out->cursors, maxWidth);
+    build_context_free(&ctx);
+    for(int i = 0; i < ctx.layerCount; i++) {
+        out->layers[i] = ctx.layers[i];
+    }
+    out->layerCount = ctx.layerCount;
+    out->maxWidth = maxWidth;
+    out->lineWidth = 0;
+    out->height = 0;
+    for(int i = 0; i < out->lines.count; i++) {
+        if(out->lines.data[i].width > out->lineWidth) {
+            out->lineWidth = out->lines.data[i].width;
+        }
+        out->height += out->lines.data[i].lineHeight;
+    }
+    out->rectCount = 0;
+    for(int i = 0; i < out->layerCount; i++) {
+        out->rectCount += out->layers[i].count;
+    }
+    out->rects = NULL;
+    out->placedCursors = NULL;
+    out->placed = 0;
+    out->valid = 1;
+}
+
+// Aligns the emitted lines of a paragraph to alignWidth, same as position_lines
+// with the paragraph starting at y = 0
+static void paragraph_place(blurg_layout_t *layout, int index, float alignWidth)
+{
+    paragraph_output *out = &layout->outputs[index];
+    blurg_align_t alignment = layout->texts[index].alignment;
+    int total = layout->paragraphs[index].total;
+    if(!out->rects && out->rectCount) {
+        out->rects = malloc(out->rectCount * sizeof(blurg_rect_t));
+    }
+    if(!out->placedCursors && out->cursors) {
+        out->placedCursors = malloc(total * sizeof(blurg_cursor_t));
+    }
+    if(out->cursors) {
+        memcpy(out->placedCursors, out->cursors, total * sizeof(blurg_cursor_t));
+    }
+    // rects are copied in draw order, offsets of each layer in out->rects
+    int layerStarts[LAYER_MAX];
+    int start = 0;
+    for(int i = 0; i < out->layerCount; i++) {
+        layerStarts[i] = start;
+        if(out->layers[i].count) {
+            memcpy(&out->rects[start], out->layers[i].data, out->layers[i].count * sizeof(blurg_rect_t));
+        }
+        start += out->layers[i].count;
+    }
+    float y = 0;
+    float w = 0;
+    for(int i = 0; i < out->lines.count; i++) {
+        text_line *line = &out->lines.data[i];
+        float offsetW = 0;
+        if(alignment == blurg_align_right) {
+            offsetW = (alignWidth - line->width);
+        }
+        if(alignment == blurg_align_center) {
+            offsetW = (alignWidth / 2.0) - (line->width / 2.0);
+        }
+        if(!line->isBreak) {
+            for(int j = 0; j < out->layerCount; j++) {
+                blurg_rect_t *rects = &out->rects[layerStarts[j] + line->rectStarts[j]];
+                for(int k = 0; k < line->rectCounts[j]; k++) {
+                    rects[k].x += offsetW;
+                    rects[k].y += y;
+                }
+            }
+            if((line->width + offsetW) > w)
+                w = (line->width + offsetW);
+        }
+        if(out->placedCursors) {
+            for(int c = 0; c < line->textCount; c++) {
+                blurg_cursor_t *cursor = &out->placedCursors[line->textStart + c];
+                cursor->x += offsetW;
+                cursor->y += y;
+                cursor->height = line->lineHeight;
+            }
+        }
+        y += line->lineHeight;
+    }
+    out->width = w;
+    out->alignWidth = alignWidth;
+    out->placed = 1;
+}
+
+// Recomputes cursor offsets and layers after a change to the texts
+static void layout_update_paragraphs(blurg_layout_t *layout)
+{
+    int hasBackground = 0;
+    int hasShadow = 0;
+    int hasUnderline = 0;
+    layout->sumParagraphs = 0;
+    for(int i = 0; i < layout->count; i++) {
+        layout->cursorStarts[i] = layout->sumParagraphs;
+        layout->sumParagraphs += layout->paragraphs[i].total;
+        text_layer_flags(&layout->texts[i], &hasBackground, &hasShadow, &hasUnderline);
+    }
+    if(hasBackground != layout->hasBackground ||
+       hasShadow != layout->hasShadow ||
+       hasUnderline != layout->hasUnderline) {
+        // layer indices changed, all emitted rects are invalid
+        for(int i = 0; i < layout->count; i++) {
+            paragraph_output_free(&layout->outputs[i]);
+        }
+    }
+    layout->hasBackground = hasBackground;
+    layout->hasShadow = hasShadow;
+    layout->hasUnderline = hasUnderline;
+}
+
+// Reshapes a paragraph after its spans changed.
+// Unchanged hard lines are hits in the shape cache
+static void layout_reshape(blurg_layout_t *layout, int index)
+{
+    paragraph_free(&layout->paragraphs[index]);
+    paragraph_init(layout->blurg, &layout->texts[index], &layout->paragraphs[index], index, layout->measureCursor);
+    paragraph_output_free(&layout->outputs[index]);
+    layout_update_paragraphs(layout);
+}
+
+// Updates a paragraph after an edit of its text, see paragraph_edit
+static void layout_edit(blurg_layout_t *layout, int index, int position, int removed, int inserted)
+{
+    paragraph_edit(layout->blurg, &layout->texts[index], &layout->paragraphs[index], index, layout->measureCursor,
+        position, removed, inserted);
+    paragraph_output_free(&layout->outputs[index]);
+    layout_update_paragraphs(layout);
+}
+
+BLURGAPI blurg_layout_t *blurg_layout_create(blurg_t *blurg, blurg_formatted_text_t *texts, int count, int measureCursor)
+{
+    ALLOCATOR_ENTER(blurg);
+    blurg_layout_t *layout = malloc(sizeof(blurg_layout_t));
+    memset(layout, 0, sizeof(blurg_layout_t));
+    layout->blurg = blurg;
+    layout->count = count;
+    layout->measureCursor = measureCursor;
+    layout->texts = malloc(count * sizeof(blurg_formatted_text_t));
+    layout->paragraphs = malloc(count * sizeof(paragraph_info));
+    layout->outputs = calloc(count, sizeof(paragraph_output));
+    layout->cursorStarts = malloc(count * sizeof(int));
+    for(int i = 0; i < count; i++) {
+        copy_formatted_text(&layout->texts[i], &texts[i]);
+        paragraph_init(blurg, &layout->texts[i], &layout->paragraphs[i], i, measureCursor);
+    }
+    layout_update_paragraphs(layout);
+    ALLOCATOR_LEAVE();
+    return layout;
+}
+
+BLURGAPI void blurg_layout_set_alignment(blurg_layout_t *layout, int index, blurg_align_t alignment)
+{
+    if(index >= 0 && index < layout->count) {
+        layout->texts[index].alignment = alignment;
+        layout->outputs[index].placed = 0;
+    }
+}
+
+// whether position (in code units) doesn't split a UTF-8 sequence or a UTF-16 surrogate pair
+static int is_char_boundary(const blurg_formatted_text_t *t, int position)
+{
+    if(position <= 0 || position >= t->textLen) {
+        return 1;
+    }
+    if(t->encoding == blurg_encoding_utf16) {
+        const uint16_t *s = t->text;
+        return !(s[position] >= 0xDC00 && s[position] <= 0xDFFF && s[position - 1] >= 0xD800 && s[position - 1] <= 0xDBFF);
+    }
+    const uint8_t *s = t->text;
+    return (s[position] & 0xC0) != 0x80;
+}
+
+BLURGAPI void blurg_layout_insert(blurg_layout_t *layout, int index, int position, const void *text, int textLen)
+{
+    if(index < 0 || index >= layout->count) {
+        return;
+    }
+    blurg_formatted_text_t *t = &layout->texts[index];
+    int len = text_length(text, textLen, t->encoding);
+    if(position < 0 || position > t->textLen || !len || !is_char_boundary(t, position)) {
+        return;
+    }
+    ALLOCATOR_ENTER(layout->blurg);
+    int unit = t->encoding == blurg_encoding_utf16 ? sizeof(uint16_t) : 1;
+    char *buf = realloc((void*)t->text, (t->textLen + len + 1) * unit);
+    memmove(buf + (position + len) * unit, buf + position * unit, (t->textLen - position + 1) * unit);
+    memcpy(buf + position * unit, text, len * unit);
+    t->text = buf;
+    t->textLen += len;
+    // inserted text takes the style of the character before it, or after it at the start:
+    // spans after the insertion move, spans containing or ending just before it grow
+    for(int i = 0; i < t->spanCount; i++) {
+        if(t->spans[i].startIndex >= position && (position > 0 || t->spans[i].startIndex > 0))
+            t->spans[i].startIndex += len;
+        if(t->spans[i].endIndex >= position - 1)
+            t->spans[i].endIndex += len;
+    }
+    layout_edit(layout, index, position, 0, len);
+    ALLOCATOR_LEAVE();
+}
+
+BLURGAPI void blurg_layout_delete(blurg_layout_t *layout, int index, int position, int count)
+{
+    if(index < 0 || index >= layout->count) {
+        return;
+    }
+    blurg_formatted_text_t *t = &layout->texts[index];
+    if(position < 0 || count <= 0 || position >= t->textLen) {
+        return;
+    }
+    if(position + count > t->textLen) {
+        count = t->textLen - position;
+    }
+    if(!is_char_boundary(t, position) || !is_char_boundary(t, position + count)) {
+        return;
+    }
+    int unit = t->encoding == blurg_encoding_utf16 ? sizeof(uint16_t) : 1;
+    char *buf = (char*)t->text;
+    memmove(buf + position * unit, buf + (position + count) * unit, (t->textLen - position - count + 1) * unit);
+    t->textLen -= count;
+    // shrink spans, removing any that only covered deleted text
+    int spanCount = 0;
+    for(int i = 0; i < t->spanCount; i++) {
+        blurg_style_span_t span = t->spans[i];
+        if(span.startIndex >= position + count)
+            span.startIndex -= count;
+        else if(span.startIndex > position)
+            span.startIndex = position;
+        if(span.endIndex >= position + count)
+            span.endIndex -= count;
+        else if(span.endIndex >= position)
+            span.endIndex = position - 1;
+        if(span.startIndex <= span.endIndex) {
+            t->spans[spanCount++] = span;
+        }
+    }
+    t->spanCount = spanCount;
+    ALLOCATOR_ENTER(layout->blurg);
+    layout_edit(layout, index, position, count, 0);
+    ALLOCATOR_LEAVE();
+}
+
+BLURGAPI void blurg_layout_set_spans(blurg_layout_t *layout, int index, blurg_style_span_t *spans, int spanCount)
+{
+    if(index < 0 || index >= layout->count) {
+        return;
+    }
+    ALLOCATOR_ENTER(layout->blurg);
+    blurg_formatted_text_t *t = &layout->texts[index];
+    free(t->spans);
+    if(spans && spanCount) {
+        t->spans = malloc(spanCount * sizeof(blurg_style_span_t));
+        memcpy(t->spans, spans, spanCount * sizeof(blurg_style_span_t));
+        t->spanCount = spanCount;
+    } else {
+        t->spans = NULL;
+        t->spanCount = 0;
+    }
+    layout_reshape(layout, index);
+    ALLOCATOR_LEAVE();
+}
+
+BLURGAPI void blurg_layout_build(blurg_layout_t *layout, float maxWidth, blurg_result_t *result)
+{
+    ALLOCATOR_ENTER(layout->blurg);
+    list_text_line lines;
+    list_text_line_init(&lines, layout->count * 2);
+    build_context ctx;
+    build_context_init(&ctx, &lines);
+    build_context_layers(&ctx, layout->hasBackground, layout->hasShadow, layout->hasUnderline, layout->sumParagraphs);
+
+    blurg_cursor_t *cursors = layout->measureCursor
+        ? (blurg_cursor_t*)util_export_calloc(layout->sumParagraphs, sizeof(blurg_cursor_t))
+        : NULL;
+    // only paragraphs that changed are wrapped again, the rest are copied.
+    // Evicting glyphs invalidates outputs emitted earlier, so emit until the atlas is stable.
+    // Glyphs emitted in this frame are not evicted, so this ends
+    uint32_t generation;
+    do {
+        generation = layout->blurg->packed.generation;
+        for(int i = 0; i < layout->count; i++) {
+            paragraph_output *out = &layout->outputs[i];
+            if(!out->valid || out->maxWidth != maxWidth || out->generation != generation) {
+                paragraph_output_free(out);
+                paragraph_emit(layout, i, maxWidth);
+            }
+        }
+    } while(generation != layout->blurg->packed.generation);
+    for(int i = 0; i < layout->count; i++) {
+        paragraph_output *out = &layout->outputs[i];
+        list_text_line_ensure_size(&lines, lines.count + out->lines.count);
+        for(int j = 0; j < out->lines.count; j++) {
+            text_line line = out->lines.data[j];
+            for(int k = 0; k < ctx.layerCount; k++) {
+                line.rectStarts[k] += ctx.layers[k].count;
+            }
+            lines.data[lines.count++] = line;
+        }
+        for(int k = 0; k < ctx.layerCount; k++) {
+            list_blurg_rect_t_add_range(&ctx.layers[k], &out->layers[k]);
+        }
+        if(cursors && out->cursors) {
+            memcpy(&cursors[layout->cursorStarts[i]], out->cursors, layout->paragraphs[i].total * sizeof(blurg_cursor_t));
+        }
+    }
+    build_context_free(&ctx);
+
+    build_result(&ctx, layout->texts, layout->cursorStarts, cursors, layout->sumParagraphs, maxWidth, result);
+    for(int i = 0; i < ctx.layerCount; i++) {
+        list_blurg_rect_t_free(&ctx.layers[i]);
+    }
+    list_text_line_free(&lines);
+    glyphatlas_end_build(layout->blurg);
+    ALLOCATOR_LEAVE();
+}
+
+BLURGAPI void blurg_layout_update(blurg_layout_t *layout, float maxWidth, int *first, int *count, float *width, float *height)
+{
+    ALLOCATOR_ENTER(layout->blurg);
+    int changedFirst = layout->count;
+    int changedLast = -1;
+    uint32_t generation;
+    do {
+        generation = layout->blurg->packed.generation;
+        for(int i = 0; i < layout->count; i++) {
+            paragraph_output *out = &layout->outputs[i];
+            if(!out->valid || out->maxWidth != maxWidth || out->generation != generation) {
+                paragraph_output_free(out);
+                paragraph_emit(layout, i, maxWidth);
+            }
+        }
+    } while(generation != layout->blurg->packed.generation);
+    // right and center alignment are relative to the widest line of the layout
+    float alignWidth = maxWidth;
+    for(int i = 0; i < layout->count; i++) {
+        if(layout->outputs[i].lineWidth > alignWidth) {
+            alignWidth = layout->outputs[i].lineWidth;
+        }
+    }
+    float y = 0;
+    float w = 0;
+    for(int i = 0; i < layout->count; i++) {
+        paragraph_output *out = &layout->outputs[i];
+        if(!out->placed ||
+           (out->alignWidth != alignWidth && layout->texts[i].alignment != blurg_align_left)) {
+            paragraph_place(layout, i, alignWidth);
+            if(i < changedFirst)
+                changedFirst = i;
+            changedLast = i;
+        }
+        out->y = y;
+        y += out->height;
+        if(out->width > w)
+            w = out->width;
+    }
+    glyphatlas_end_build(layout->blurg);
+    if(first)
+        *first = changedLast >= 0 ? changedFirst : 0;
+    if(count)
+        *count = changedLast >= 0 ? changedLast - changedFirst + 1 : 0;
+    if(width)
+        *width = w;
+    if(height)
+        *height = y;
+    ALLOCATOR_LEAVE();
+}
+
+BLURGAPI void blurg_layout_get_text(blurg_layout_t *layout, int index, blurg_layout_text_t *text)
+{
+    memset(text, 0, sizeof(blurg_layout_text_t));
+    if(index < 0 || index >= layout->count) {
+        return;
+    }
+    paragraph_output *out = &layout->outputs[index];
+    if(!out->placed) {
+        return;
+    }
+    text->y = out->y;
+    text->height = out->height;
+    text->rects = out->rects;
+    text->rectCount = out->rectCount;
+    text->cursors = out->placedCursors;
+    text->cursorCount = out->placedCursors ? layout->paragraphs[index].total : 0;
+}
+
+BLURGAPI void blurg_layout_measure(blurg_layout_t *layout, float maxWidth, float *width, float *height)
+{
+    if(!width && !height)
+        return;
+    ALLOCATOR_ENTER(layout->blurg);
+    list_text_line lines;
+    list_text_line_init(&lines, layout->count * 2);
+    build_context ctx;
+    build_context_init(&ctx, &lines);
+    for(int i = 0; i < layout->count; i++) {
+        paragraph_output *out = &layout->outputs[i];
+        if(out->valid && out->maxWidth == maxWidth) {
+            // already wrapped at this width
+            list_text_line_add_range(&lines, &out->lines);
+        } else {
+            paragraph_layout(layout->blurg, &layout->texts[i], &layout->paragraphs[i], &ctx, NULL, maxWidth);
+        }
+    }
+    build_context_free(&ctx);
+    measure_result(&lines, layout->texts, maxWidth, width, height);
+    list_text_line_free(&lines);
+    ALLOCATOR_LEAVE();
+}
+
+BLURGAPI void blurg_layout_destroy(blurg_layout_t *layout)
+{
+    ALLOCATOR_ENTER(layout->blurg);
+    for(int i = 0; i < layout->count; i++) {
+        paragraph_free(&layout->paragraphs[i]);
+        paragraph_output_free(&layout->outputs[i]);
+        free((void*)layout->texts[i].text);
+        free(layout->texts[i].spans);
+    }
+    free(layout->texts);
+    free(layout->paragraphs);
+    free(layout->outputs);
+    free(layout->cursorStarts);
+    free(layout);
+    ALLOCATOR_LEAVE();
+}
+
 BLURGAPI void blurg_measure_string(blurg_t *blurg, blurg_font_t *font, float size, const char *text, int textLen, float *width, float *height)
 {
     blurg_formatted_text_t formatted = {
@@ -1144,16 +2709,53 @@ BLURGAPI void blurg_build_string_utf16(blurg_t *blurg, blurg_font_t *font, float
 
 BLURGAPI void blurg_free_rects(blurg_rect_t *rects)
 {
-    free(rects);
+    util_export_free(rects);
+}
+
+BLURGAPI void blurg_get_stats(blurg_t *blurg, blurg_stats_t *stats)
+{
+    memset(stats, 0, sizeof(blurg_stats_t));
+    stats->shapeCacheHits = blurg->shapeCache.hits;
+    stats->shapeCacheMisses = blurg->shapeCache.misses;
+    stats->shapeCacheEvictions = blurg->shapeCache.evictions;
+    stats->shapeCacheEntries = (int)hashmap_count(blurg->shapeCache.map);
+    stats->shapeCacheBytes = blurg->shapeCache.bytes;
+    stats->fastPathChunks = blurg->fastPathChunks;
+    stats->atlasPages = blurg->packed.pageCount;
+    stats->atlasEvictions = blurg->packed.evictions;
+    stats->atlasGeneration = blurg->packed.generation;
+    stats->atlasHits = blurg->packed.hits;
+    stats->atlasMisses = blurg->packed.misses;
+    stats->atlasDropped = blurg->packed.dropped;
+#if BT_COUNT_ALLOCATIONS
+    stats->buildAllocations = (int64_t)blurg->buildAllocations;
+#else
+    stats->buildAllocations = -1;
+#endif
+    stats->arenaBytes = blurg->arena.capacity;
 }
 
 BLURGAPI void blurg_free_result(blurg_result_t *result)
 {
     if(result->cursors) {
-        free(result->cursors);
+        util_export_free(result->cursors);
     }
     if(result->rects) {
-        free(result->rects);
+        util_export_free(result->rects);
     }
     memset(result, 0, sizeof(blurg_result_t));
 }
+
+BLURGAPI void blurg_free_result_buffer(blurg_result_buffer_t *buffer)
+{
+    util_export_free(buffer->rects);
+    util_export_free(buffer->cursors);
+    memset(buffer, 0, sizeof(blurg_result_buffer_t));
+}
+
+BLURGAPI void blurg_free_batch_result(blurg_batch_result_t *result)
+{
+    util_export_free(result->rects);
+    util_export_free(result->items);
+    memset(result, 0, sizeof(blurg_batch_result_t));
+}
@@ -8,22 +8,79 @@ extern "C" {
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include FT_MODULE_H
+#include <raqm.h>
 #include "hashmap.h"
 #include "list.h"
+#include "util.h"
 
 #define MAX_TEXTURES 16
+// glyphVal used in hashes of signed distance field glyphs, no real size has it
+#define FONT_SDF_GLYPHVAL (0xFFFFFFFF)
+// distance in pixels at the reference size covered by SDF glyphs
+#define SDF_SPREAD 8
+#define ATLAS_DIRTY_MAX 8
 #define BLURG_TEXTURE_SIZE 1024
+#define BLURG_SHAPE_CACHE_DEFAULT (2 * 1024 * 1024)
 
 #if (BT_ENABLE_FONTCONFIG || BT_ENABLE_DIRECTWRITE)
 #define SYSFONTS
 #endif
 
+// Routes allocations on this thread to the allocator of b until ALLOCATOR_LEAVE in the same scope
+#define ALLOCATOR_ENTER(b) const blurg_allocator_t *previousAllocator = util_allocator_enter((b)->allocator)
+#define ALLOCATOR_LEAVE() util_allocator_leave(previousAllocator)
+
+// Top edge of the packed area of a page, from x to x + width
+typedef struct _skyline_node {
+    int x;
+    int y;
+    int width;
+} skyline_node;
+
+DEFINE_LIST(skyline_node)
+
+typedef struct _atlas_page {
+    blurg_texture_t *texture;
+    list_skyline_node skyline;
+    // most recent frame a glyph on this page was used in
+    uint32_t lastUse;
+    // copy of the page when uploads are deferred or the atlas is mirrored
+    uint8_t *pixels;
+    blurg_region_t dirty[ATLAS_DIRTY_MAX];
+    int dirtyCount;
+    // with deferred uploads textureAllocate is called in blurg_flush_uploads
+    int allocated;
+} atlas_page;
+
 struct texturePacking {
-    int curTex;
-    int currentX;
-    int currentY;
-    int lineMax;
-    blurg_texture_t* pages[MAX_TEXTURES];
+    blurg_atlas_mode_t mode;
+    // set when uploads are deferred, see blurg_set_deferred_uploads
+    blurg_texture_update_regions updateRegions;
+    int flushOnBuild;
+    // keep a CPU copy of every page, see blurg_set_atlas_mirror
+    int mirror;
+    // reference size of signed distance field glyphs, 0 when disabled. See blurg_set_sdf
+    float sdfSize;
+    // up to MAX_TEXTURES pages of each format
+    int pageCount;
+    atlas_page pages[MAX_TEXTURES * 3];
+    // current frame, see blurg_begin_frame
+    uint32_t frame;
+    // set by blurg_begin_frame and layout contexts, until then every build is a frame
+    int explicitFrames;
+    // incremented when glyphs are evicted
+    uint32_t generation;
+    uint64_t evictions;
+    uint64_t hits;
+    uint64_t misses;
+    // glyphs drawn empty because no page could be evicted
+    uint64_t dropped;
+    // glyph table slots from other epochs are empty,
+    // incremented when cached glyphs may have changed
+    uint32_t tableEpoch;
+    // sizes glyphs are rasterized at, see blurg_set_size_policy
+    blurg_size_policy_t sizePolicy;
+    float sizeStep;
 };
 
 typedef struct _allocated_font {
@@ -32,6 +89,40 @@ typedef struct _allocated_font {
     int external;
 } allocated_font;
 
+#define FONT_SIZE_CACHE 8
+// code points below this may be laid out by the simple text fast path
+#define SIMPLE_MAX_CODEPOINT 0x500
+
+// scripts of the code points the fast path lays out
+typedef enum {
+    ot_script_common,
+    ot_script_latin,
+    ot_script_greek,
+    ot_script_cyrillic,
+    OT_SCRIPT_COUNT
+} ot_script;
+
+// GSUB, GPOS and kern tables of a font for the fast path, see otlayout.c
+typedef struct _ot_layout ot_layout;
+
+// An FT_Size object for one size of a font, with the metrics
+// computed when it was created
+typedef struct _font_size {
+    FT_Size size;
+    uint32_t setSize;
+    uint32_t glyphVal;
+    uint32_t hash;
+    float ascender;
+    float lineHeight;
+    float scale;
+    uint32_t lastUse;
+    // 26.6 advances by code point for the fast path, allocated on first use
+    int32_t *simpleAdvances;
+    // atlas glyphs by glyph index, in pages of GLYPH_TABLE_PAGE allocated on first use
+    struct _glyph_table_slot **glyphTable;
+    int glyphTablePages;
+} font_size;
+
 struct _blurg_font {
     FT_Face face;
     int weight;
@@ -43,24 +134,120 @@ struct _blurg_font {
     // separate hash required for glyph caching
     uint32_t setSize;
     uint32_t hash;
+    // glyph cache hash for signed distance field glyphs, which don't depend on size
+    uint32_t sdfHash;
     float ascender;
     float lineHeight;
     float scale;
+    // sizes used by this font, switched with FT_Activate_Size
+    font_size sizes[FONT_SIZE_CACHE];
+    int sizeCount;
+    uint32_t sizeClock;
+    font_size *activeSize;
+    // 1 if the font needs no shaping beyond cmap + advances, -1 if not, 0 unchecked
+    int simple;
+    // glyph indices by code point for the fast path
+    uint16_t *simpleGlyphs;
+    // OpenType layout for the fast path, loaded on first use
+    ot_layout *otLayout;
+    // hash of the font file, computed on first use
+    uint64_t contentHash;
+    int hasContentHash;
     allocated_font backing;
 
     blurg_font_t *fallback;
+    blurg_t *blurg;
+    // font of the parent blurg_t this was cloned from, in layout contexts
+    blurg_font_t *source;
 };
 
 typedef struct _font_manager font_manager_t;
 
+// A run of code units shaped with the same font
+typedef struct _shape_face_run {
+    blurg_font_t *font;
+    int count;
+} shape_face_run;
+
+// Shaped chunk, glyphs are stored after fallback has been applied
+typedef struct _shape_entry {
+    uint64_t hash;
+    struct _shape_entry *prev;
+    struct _shape_entry *next;
+    size_t bytes;
+    // key
+    blurg_encoding_t encoding;
+    float size;
+    int textBytes;
+    int runCount;
+    char *text;
+    shape_face_run *runs;
+    // value
+    int glyphCount;
+    raqm_glyph_t *glyphs;
+    // x,y pairs from raqm_index_to_position, NULL until cursors requested
+    int *cursors;
+} shape_entry;
+
+DEFINE_LIST(shape_face_run)
+DEFINE_LIST(raqm_glyph_t)
+DEFINE_PTR_LIST(raqm_t)
+DEFINE_PTR_LIST(blurg_t)
+
+struct shape_cache {
+    struct hashmap *map;
+    shape_entry *head;
+    shape_entry *tail;
+    size_t bytes;
+    size_t budget;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    // font epoch of the parent the entries were shaped with
+    uint32_t epoch;
+};
+
 struct _blurg {
     blurg_texture_allocate textureAllocate;
     blurg_texture_update textureUpdate;
     struct texturePacking packed;
     struct hashmap *glyphMap;
+    // glyphs from blurg_atlas_load not used yet, keyed by persistent key
+    struct hashmap *loadedGlyphs;
+    struct shape_cache shapeCache;
+    // reusable raqm contexts, reset with raqm_clear_contents
+    list_p_raqm_t shapers;
+    // scratch space for building shape cache keys
+    list_shape_face_run runScratch;
+    // simple text fast path, see simpleshape.c
+    int fastPathEnabled;
+    uint64_t fastPathChunks;
+    list_raqm_glyph_t simpleGlyphs;
     font_manager_t *fontManager;
     FT_Library library;
     void *sysFontData;
+    // guards the atlas and font fallbacks once layout contexts exist
+    util_mutex *lock;
+    // set in the blurg_t of a layout context, which shares the parent's atlas and fonts
+    blurg_t *parent;
+    // parent fonts cloned into this context's FreeType library
+    struct hashmap *fontClones;
+    // shapes paragraphs in parallel, see blurg_set_task_scheduler
+    blurg_parallel_for parallelFor;
+    void *schedulerData;
+    // idle contexts for shaping paragraphs in scheduled tasks
+    list_p_blurg_t workers;
+    // bumped when fonts or fallbacks change, see shapecache_sync
+    uint32_t fontEpoch;
+    // temporary memory of builds, released in reverse order of allocation
+    util_arena arena;
+    // lists kept between builds, see build_scratch in blurgtext.c
+    struct build_scratch *scratch;
+    // heap allocations of the last build, on the thread that built
+    uint64_t buildAllocations;
+    // from blurg_create_ex, NULL for malloc
+    const blurg_allocator_t *allocator;
+    FT_Memory ftMemory;
 };
 
 typedef struct blurg_glyph {
@@ -72,21 +259,92 @@ typedef struct blurg_glyph {
     int offsetLeft;
     int offsetTop;
     int color;
+    // 26.6 size the glyph was rasterized at, 0 for fixed size bitmap fonts
+    int rasterSize;
 } blurg_glyph;
 
+#define GLYPH_TABLE_SHIFT 8
+#define GLYPH_TABLE_PAGE (1 << GLYPH_TABLE_SHIFT)
+
+typedef struct _glyph_table_slot {
+    uint32_t epoch;
+    blurg_glyph glyph;
+} glyph_table_slot;
+
 void glyphatlas_init(blurg_t *blurg);
+// Empties or frees the glyph table of a font size
+void glyphatlas_reset_table(font_size *entry);
+void glyphatlas_free_table(font_size *entry);
 void glyphatlas_get(blurg_t *blurg, blurg_font_t *font, uint32_t index, blurg_glyph *glyph);
+// Texture with a white pixel at (0,0) for untextured rects
+blurg_texture_t *glyphatlas_white_texture(blurg_t *blurg);
+// Flushes deferred uploads if they are flushed after every build
+void glyphatlas_end_build(blurg_t *blurg);
 void glyphatlas_destroy(blurg_t *blurg);
 
+void shapecache_init(blurg_t *blurg);
+void shapecache_clear(blurg_t *blurg);
+// Marks the shape caches of blurg and its layout contexts stale
+void shapecache_invalidate(blurg_t *blurg);
+// Clears the cache if fonts changed since it was filled, call before shaping
+void shapecache_sync(blurg_t *blurg);
+void shapecache_destroy(blurg_t *blurg);
+// Looks up a chunk, key->hash is computed. Returns NULL on miss
+shape_entry *shapecache_get(blurg_t *blurg, shape_entry *key);
+// Copies key + glyphs into the cache. Returns NULL if the entry could not be cached
+shape_entry *shapecache_add(blurg_t *blurg, const shape_entry *key, const raqm_glyph_t *glyphs, size_t glyphCount);
+// Allocates cursor storage (x,y pairs) for count indices in entry, to be filled by the caller
+int *shapecache_alloc_cursors(blurg_t *blurg, shape_entry *entry, int count);
+
+// Lays out text that needs no complex shaping from the font's cmap and advances.
+// Returns 0 if the text or any of the fonts need the full shaping path
+int simpleshape_chunk(blurg_t *blurg, const void *str, int len, blurg_encoding_t encoding,
+    const shape_face_run *runs, int runCount, float size, list_raqm_glyph_t *glyphs);
+void simpleshape_reset_advances(font_size *entry);
+void simpleshape_free_font(blurg_font_t *font);
+// Script of a code point laid out by the fast path, -1 for any other code point
+int simpleshape_script(uint32_t c);
+// Advance in 26.6 of a glyph at the active size of font, rounded like HarfBuzz
+int simpleshape_glyph_advance(blurg_font_t *font, FT_UInt index);
+
+// Checks once per script of a font if the fast path can apply its OpenType layout
+int otlayout_usable(blurg_font_t *font, ot_script script);
+// Applies GSUB, then GPOS or kern to glyphs of a single run of font, count shrinks with ligatures.
+// The active size of font is used for positions
+void otlayout_apply(blurg_font_t *font, ot_script script, raqm_glyph_t *glyphs, int *count);
+int otlayout_is_mark(blurg_font_t *font, FT_UInt glyph);
+void otlayout_free(blurg_font_t *font);
+
 blurg_font_t *blurg_from_freetype(FT_Face face);
 blurg_font_t *blurg_font_create_internal(blurg_t *blurg, allocated_font *data);
 void blurg_font_rehash(blurg_font_t *fnt);
+// Hash of the font file contents, stable across runs
+uint64_t blurg_font_content_hash(blurg_font_t *fnt);
 blurg_font_t *blurg_font_fallback(blurg_t *blurg, blurg_font_t *font, uint32_t character);
 blurg_font_t *blurg_sysfonts_query(blurg_t *blurg, const char *familyName, int weight, int italic, uint32_t character);
 void font_use_size(blurg_font_t *fnt, float size);
+// Opens a copy of font in the library of a layout context
+blurg_font_t *font_clone(blurg_t *blurg, blurg_font_t *font);
+// Clone of a parent font in a layout context, created on first use. NULL if it can't be opened
+blurg_font_t *context_font(blurg_t *blurg, blurg_font_t *font);
+// Context for shaping on a scheduled task, returned with context_worker_release
+blurg_t *context_worker_acquire(blurg_t *blurg);
+void context_worker_release(blurg_t *blurg, blurg_t *worker);
+void context_workers_destroy(blurg_t *blurg);
+// Copies src into dst with fonts replaced by the clones of context blurg, spans has room for src->spanCount.
+// Returns 0 if a font could not be cloned
+int context_translate_text(blurg_t *blurg, const blurg_formatted_text_t *src, blurg_formatted_text_t *dst, blurg_style_span_t *spans);
+// Texture of an atlas page, shared with the parent in layout contexts
+blurg_texture_t *glyphatlas_texture(blurg_t *blurg, int texture);
+// Copies the texture of each page into textures (MAX_TEXTURES * 3 entries), returns the page count
+int glyphatlas_page_textures(blurg_t *blurg, blurg_texture_t **textures);
+// Glyph cache hash of fnt at a 26.6 glyph size
+uint32_t font_size_hash(blurg_font_t *fnt, uint32_t glyphVal);
 
 void font_manager_init(blurg_t *blurg);
 void font_manager_destroy(blurg_t *blurg);
+// Forgets resolved fallbacks, called when fonts or fallback chains change
+void font_manager_clear_fallbacks(blurg_t *blurg);
 void blurg_sysfonts_destroy(blurg_t *blurg);
 
 #ifdef __cplusplus
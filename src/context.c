@@ -0,0 +1,207 @@
+#include "blurgtext_internal.h"
+#include <string.h>
+
+// Layout contexts build text on other threads.
+// Each has its own blurg_t with a FreeType library, copies of the fonts it uses,
+// shapers and shape cache. Glyphs are rasterized into the parent's atlas and
+// fallback fonts come from the parent, both under the parent's lock.
+// Their shape caches are cleared when the parent's fonts change, see shapecache_sync.
+
+typedef struct {
+    blurg_font_t *source;
+    blurg_font_t *clone;
+} font_clone_entry;
+
+DEFINE_LIST(blurg_style_span_t)
+IMPLEMENT_LIST(blurg_style_span_t)
+IMPLEMENT_PTR_LIST(blurg_t)
+
+struct _blurg_context {
+    blurg_t *blurg;
+    // texts with fonts replaced by their clones
+    blurg_formatted_text_t *texts;
+    int textCapacity;
+    list_blurg_style_span_t spans;
+};
+
+static uint64_t font_clone_hash(const void *item, uint64_t seed0, uint64_t seed1)
+{
+    const font_clone_entry *entry = item;
+    return hashmap_sip(&entry->source, sizeof(blurg_font_t*), seed0, seed1);
+}
+
+static int font_clone_compare(const void *a, const void *b, void *udata)
+{
+    const font_clone_entry *ea = a;
+    const font_clone_entry *eb = b;
+    return ea->source == eb->source ? 0 : (ea->source < eb->source ? -1 : 1);
+}
+
+blurg_font_t *context_font(blurg_t *blurg, blurg_font_t *font)
+{
+    if(!font || !blurg->parent) {
+        return font;
+    }
+    const font_clone_entry *entry = hashmap_get(blurg->fontClones, &(font_clone_entry){ .source = font });
+    if(entry) {
+        return entry->clone;
+    }
+    blurg_font_t *clone = font_clone(blurg, font);
+    if(!clone) {
+        // the parent's face is used by other threads, never share it
+        return NULL;
+    }
+    hashmap_set(blurg->fontClones, &(font_clone_entry){ .source = font, .clone = clone });
+    return clone;
+}
+
+// Creates a blurg_t sharing the atlas and fonts of parent
+static blurg_t *context_blurg_create(blurg_t *parent)
+{
+    blurg_t *local = blurg_create_ex(parent->textureAllocate, parent->textureUpdate, parent->allocator);
+    if(!local) {
+        return NULL;
+    }
+    local->parent = parent;
+    local->fastPathEnabled = parent->fastPathEnabled;
+    local->fontClones = hashmap_new_with_allocator(util_malloc, util_realloc, util_free, sizeof(font_clone_entry), 0, 0, 0, font_clone_hash, font_clone_compare, NULL, NULL);
+    return local;
+}
+
+BLURGAPI blurg_context_t *blurg_context_create(blurg_t *blurg)
+{
+    // uploads have to happen on the thread owning blurg
+    if(!blurg->packed.updateRegions || blurg->parent) {
+        return NULL;
+    }
+    ALLOCATOR_ENTER(blurg);
+    if(!blurg->lock) {
+        blurg->lock = mutex_create();
+    }
+    // a build on one thread can't end the frame of builds on others
+    blurg->packed.explicitFrames = 1;
+    blurg_t *local = context_blurg_create(blurg);
+    if(!local) {
+        ALLOCATOR_LEAVE();
+        return NULL;
+    }
+    blurg_context_t *context = malloc(sizeof(blurg_context_t));
+    memset(context, 0, sizeof(blurg_context_t));
+    context->blurg = local;
+    list_blurg_style_span_t_init(&context->spans, 16);
+    ALLOCATOR_LEAVE();
+    return context;
+}
+
+int context_translate_text(blurg_t *blurg, const blurg_formatted_text_t *src, blurg_formatted_text_t *dst, blurg_style_span_t *spans)
+{
+    *dst = *src;
+    dst->defaultFont = context_font(blurg, src->defaultFont);
+    int cloned = !src->defaultFont || dst->defaultFont;
+    if(src->spans && src->spanCount) {
+        for(int j = 0; j < src->spanCount; j++) {
+            spans[j] = src->spans[j];
+            spans[j].font = context_font(blurg, spans[j].font);
+            cloned &= !src->spans[j].font || spans[j].font;
+        }
+        dst->spans = spans;
+    }
+    return cloned;
+}
+
+// Copies texts with every font swapped for the context's clone, NULL if a font can't be cloned
+static blurg_formatted_text_t *context_texts(blurg_context_t *context, const blurg_formatted_text_t *texts, int count)
+{
+    if(count > context->textCapacity) {
+        context->texts = realloc(context->texts, count * sizeof(blurg_formatted_text_t));
+        context->textCapacity = count;
+    }
+    int spanCount = 0;
+    for(int i = 0; i < count; i++) {
+        spanCount += texts[i].spans ? texts[i].spanCount : 0;
+    }
+    list_blurg_style_span_t_ensure_size(&context->spans, spanCount);
+    context->spans.count = 0;
+    for(int i = 0; i < count; i++) {
+        if(!context_translate_text(context->blurg, &texts[i], &context->texts[i], &context->spans.data[context->spans.count])) {
+            return NULL;
+        }
+        context->spans.count += texts[i].spans ? texts[i].spanCount : 0;
+    }
+    return context->texts;
+}
+
+BLURGAPI int blurg_context_build_formatted(blurg_context_t *context, blurg_formatted_text_t *texts, int count, int measureCursor, float maxWidth, blurg_result_t *result)
+{
+    ALLOCATOR_ENTER(context->blurg);
+    blurg_formatted_text_t *local = context_texts(context, texts, count);
+    if(local) {
+        blurg_build_formatted(context->blurg, local, count, measureCursor, maxWidth, result);
+    } else {
+        memset(result, 0, sizeof(blurg_result_t));
+    }
+    ALLOCATOR_LEAVE();
+    return local != NULL;
+}
+
+BLURGAPI int blurg_context_measure_formatted(blurg_context_t *context, blurg_formatted_text_t *texts, int count, float maxWidth, float *width, float *height)
+{
+    ALLOCATOR_ENTER(context->blurg);
+    blurg_formatted_text_t *local = context_texts(context, texts, count);
+    if(local) {
+        blurg_measure_formatted(context->blurg, local, count, maxWidth, width, height);
+    } else {
+        *width = *height = 0;
+    }
+    ALLOCATOR_LEAVE();
+    return local != NULL;
+}
+
+BLURGAPI void blurg_context_destroy(blurg_context_t *context)
+{
+    // the parent holds a reference to the allocator, so it outlives blurg_destroy
+    ALLOCATOR_ENTER(context->blurg);
+    // clones are freed with the context's FreeType library
+    blurg_destroy(context->blurg);
+    free(context->texts);
+    list_blurg_style_span_t_free(&context->spans);
+    free(context);
+    ALLOCATOR_LEAVE();
+}
+
+blurg_t *context_worker_acquire(blurg_t *blurg)
+{
+    blurg_t *worker = NULL;
+    mutex_lock(blurg->lock);
+    if(blurg->workers.count) {
+        worker = blurg->workers.data[--blurg->workers.count];
+    }
+    mutex_unlock(blurg->lock);
+    return worker ? worker : context_blurg_create(blurg);
+}
+
+void context_worker_release(blurg_t *blurg, blurg_t *worker)
+{
+    mutex_lock(blurg->lock);
+    list_p_blurg_t_add(&blurg->workers, worker);
+    mutex_unlock(blurg->lock);
+}
+
+void context_workers_destroy(blurg_t *blurg)
+{
+    for(int i = 0; i < blurg->workers.count; i++) {
+        blurg_destroy(blurg->workers.data[i]);
+    }
+    list_p_blurg_t_free(&blurg->workers);
+}
+
+BLURGAPI void blurg_set_task_scheduler(blurg_t *blurg, blurg_parallel_for parallelFor, void *userdata)
+{
+    if(!blurg->lock) {
+        ALLOCATOR_ENTER(blurg);
+        blurg->lock = mutex_create();
+        ALLOCATOR_LEAVE();
+    }
+    blurg->parallelFor = parallelFor;
+    blurg->schedulerData = userdata;
+}
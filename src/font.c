@@ -1,4 +1,5 @@
 #include "blurgtext_internal.h"
+#include FT_SIZES_H
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
@@ -36,6 +37,11 @@ static uint32_t fnv1a_combined(uint32_t faceHash, uint32_t size)
 static void font_finalizer(void* object)
 {
     FT_Face face = (FT_Face)object;
+    blurg_font_t *fnt = (blurg_font_t*)face->generic.data;
+    simpleshape_free_font(fnt);
+    for(int i = 0; i < fnt->sizeCount; i++) {
+        glyphatlas_free_table(&fnt->sizes[i]);
+    }
     free(face->generic.data);
 }
 
@@ -51,6 +57,33 @@ void blurg_font_rehash(blurg_font_t *fnt)
         fnt->embolden
     );
     fnt->faceHash = fnv1a_str(hashbuffer);
+    fnt->sdfHash = fnv1a_combined(fnt->faceHash, FONT_SDF_GLYPHVAL);
+    for(int i = 0; i < fnt->sizeCount; i++) {
+        glyphatlas_reset_table(&fnt->sizes[i]);
+        fnt->sizes[i].hash = fnv1a_combined(fnt->faceHash, fnt->sizes[i].glyphVal);
+        if(fnt->sizes[i].setSize == fnt->setSize) {
+            fnt->hash = fnt->sizes[i].hash;
+        }
+    }
+}
+
+uint32_t font_size_hash(blurg_font_t *fnt, uint32_t glyphVal)
+{
+    return fnv1a_combined(fnt->faceHash, glyphVal);
+}
+
+uint64_t blurg_font_content_hash(blurg_font_t *fnt)
+{
+    if(!fnt->hasContentHash) {
+        if(fnt->backing.data) {
+            fnt->contentHash = hashmap_sip(fnt->backing.data, fnt->backing.dataLen, 0, 0);
+        } else {
+            // no file data, fall back to the face properties
+            fnt->contentHash = ((uint64_t)fnt->faceHash << 32) | (uint32_t)fnt->face->num_glyphs;
+        }
+        fnt->hasContentHash = 1;
+    }
+    return fnt->contentHash;
 }
 
 blurg_font_t *blurg_from_freetype(FT_Face face)
@@ -67,20 +100,40 @@ blurg_font_t *blurg_from_freetype(FT_Face face)
     return (blurg_font_t*)face->generic.data;
 }
 
-void font_use_size(blurg_font_t *fnt, float size)
+// Creates the size object for a size not in the cache,
+// reusing the least recently used one when the cache is full
+static font_size *font_new_size(blurg_font_t *fnt, float size, int sizeVal)
 {
-    int sizeVal = (int)(size * 64.0);
-    int glyphVal = sizeVal;
-    if(fnt->setSize == sizeVal)
-        return;
-
     FT_Face face = fnt->face;
+    font_size *entry;
+    FT_Size ftSize;
+    if(fnt->sizeCount == 0) {
+        // the face's default size object
+        entry = &fnt->sizes[fnt->sizeCount++];
+        entry->size = face->size;
+    }
+    else if(fnt->sizeCount < FONT_SIZE_CACHE && !FT_New_Size(face, &ftSize)) {
+        entry = &fnt->sizes[fnt->sizeCount++];
+        entry->size = ftSize;
+    }
+    else {
+        entry = &fnt->sizes[0];
+        for(int i = 1; i < fnt->sizeCount; i++) {
+            if(fnt->sizes[i].lastUse < entry->lastUse)
+                entry = &fnt->sizes[i];
+        }
+        simpleshape_reset_advances(entry);
+        glyphatlas_reset_table(entry);
+    }
+    FT_Activate_Size(entry->size);
+
+    int glyphVal = sizeVal;
     if(FT_HAS_FIXED_SIZES(face)) 
     {
         if(face->num_fixed_sizes == 0) 
         {
             FT_Set_Char_Size(face, 0, sizeVal, DPI, DPI);
-            fnt->scale = 1.;
+            entry->scale = 1.;
         } 
         else 
         {
@@ -98,23 +151,51 @@ void font_use_size(blurg_font_t *fnt, float size)
                 }
             }
             FT_Select_Size(face, best_match);
-            fnt->scale = size / (glyphVal / 64.0);
+            entry->scale = size / (glyphVal / 64.0);
         }
     } 
     else 
     {
         FT_Set_Char_Size(face, 0, sizeVal, DPI, DPI);
-        fnt->scale = 1.;
+        entry->scale = 1.;
     }
     // metrics
-    fnt->ascender = face->size->metrics.ascender / 64.0 * fnt->scale;
-    float descent = face->size->metrics.descender / 64.0 * fnt->scale;
-    float height = (face->size->metrics.height / 64.0) * fnt->scale;
-    float linegap = height - fnt->ascender + descent;
-    fnt->lineHeight = fnt->ascender - descent + linegap;
+    entry->ascender = face->size->metrics.ascender / 64.0 * entry->scale;
+    float descent = face->size->metrics.descender / 64.0 * entry->scale;
+    float height = (face->size->metrics.height / 64.0) * entry->scale;
+    float linegap = height - entry->ascender + descent;
+    entry->lineHeight = entry->ascender - descent + linegap;
     // hash
+    entry->setSize = sizeVal;
+    entry->glyphVal = (uint32_t)glyphVal;
+    entry->hash = fnv1a_combined(fnt->faceHash, (uint32_t)glyphVal);
+    return entry;
+}
+
+void font_use_size(blurg_font_t *fnt, float size)
+{
+    int sizeVal = (int)(size * 64.0);
+    if(fnt->activeSize && fnt->setSize == sizeVal)
+        return;
+
+    font_size *entry = NULL;
+    for(int i = 0; i < fnt->sizeCount; i++) {
+        if(fnt->sizes[i].setSize == sizeVal) {
+            entry = &fnt->sizes[i];
+            FT_Activate_Size(entry->size);
+            break;
+        }
+    }
+    if(!entry) {
+        entry = font_new_size(fnt, size, sizeVal);
+    }
+    entry->lastUse = ++fnt->sizeClock;
+    fnt->activeSize = entry;
     fnt->setSize = sizeVal;
-    fnt->hash = fnv1a_combined(fnt->faceHash, (uint32_t)glyphVal);
+    fnt->hash = entry->hash;
+    fnt->ascender = entry->ascender;
+    fnt->lineHeight = entry->lineHeight;
+    fnt->scale = entry->scale;
 }
 
 static void SetCharmap(FT_Face face)
@@ -235,6 +316,13 @@ BLURGAPI float blurg_font_get_line_height(blurg_font_t *font, float size)
 BLURGAPI void blurg_font_set_fallback(blurg_font_t *font, blurg_font_t *fallback)
 {
     font->fallback = fallback;
+    // cached shaping results may contain the old fallback
+    if(font->blurg) {
+        ALLOCATOR_ENTER(font->blurg);
+        font_manager_clear_fallbacks(font->blurg);
+        shapecache_invalidate(font->blurg);
+        ALLOCATOR_LEAVE();
+    }
 }
 
 blurg_font_t *blurg_font_create_internal(blurg_t *blurg, allocated_font *data)
@@ -248,6 +336,29 @@ blurg_font_t *blurg_font_create_internal(blurg_t *blurg, allocated_font *data)
     }
     SetCharmap(face);
     blurg_font_t *font = blurg_from_freetype(face);
+    font->blurg = blurg;
+    font->backing = *data;
     get_face_information(face, &font->weight, &font->italic);
     return font;
 }
+
+blurg_font_t *font_clone(blurg_t *blurg, blurg_font_t *font)
+{
+    FT_Face face;
+    if(!font->backing.data ||
+       FT_New_Memory_Face(blurg->library, (const FT_Byte*)font->backing.data, font->backing.dataLen, font->face->face_index, &face)) {
+        return NULL;
+    }
+    SetCharmap(face);
+    blurg_font_t *clone = blurg_from_freetype(face);
+    clone->blurg = blurg;
+    clone->source = font;
+    // the data stays owned by the parent's font
+    clone->backing = font->backing;
+    clone->weight = font->weight;
+    clone->italic = font->italic;
+    clone->embolden = font->embolden;
+    // same hashes as the source, so glyphs are shared in the atlas
+    blurg_font_rehash(clone);
+    return clone;
+}
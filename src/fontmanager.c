@@ -14,10 +14,34 @@ IMPLEMENT_LIST(font_lookup_node)
 struct _font_manager {
     struct hashmap *fontTable;
     struct hashmap *fileTable;
+    // resolved fallbacks by (font, character)
+    struct hashmap *fallbackCache;
     const char *defaultFont;
     list_font_lookup_node nodes;
 };
 
+// Result of a fallback lookup, fallback is NULL when no font covers the character
+typedef struct _fallback_entry {
+    blurg_font_t *font;
+    uint32_t character;
+    blurg_font_t *fallback;
+} fallback_entry;
+
+static int fallback_entry_compare(const void *a, const void *b, void *udata)
+{
+    const fallback_entry *fa = a;
+    const fallback_entry *fb = b;
+    return !(fa->font == fb->font && fa->character == fb->character);
+}
+
+static uint64_t fallback_entry_hash(const void *item, uint64_t seed0, uint64_t seed1)
+{
+    const fallback_entry *e = item;
+    // hash fields only, the struct has padding
+    struct { blurg_font_t *font; uint64_t character; } key = { e->font, e->character };
+    return hashmap_sip(&key, sizeof(key), seed0, seed1);
+}
+
 typedef struct _font_data_entry {
     char *filename;
     allocated_font *font;
@@ -91,8 +115,16 @@ void font_manager_init(blurg_t *blurg)
     blurg->fontManager = malloc(sizeof(font_manager_t));
     blurg->fontManager->defaultFont = NULL;
     list_font_lookup_node_init(&blurg->fontManager->nodes, 8);
-    blurg->fontManager->fontTable = hashmap_new(sizeof(font_entry), 0, 0, 0, font_entry_hash, font_entry_compare, NULL, NULL);
-    blurg->fontManager->fileTable = hashmap_new(sizeof(font_data_entry), 0, 0, 0, font_data_entry_hash, font_data_entry_compare, NULL, NULL);
+    blurg->fontManager->fontTable = hashmap_new_with_allocator(util_malloc, util_realloc, util_free, sizeof(font_entry), 0, 0, 0, font_entry_hash, font_entry_compare, NULL, NULL);
+    blurg->fontManager->fileTable = hashmap_new_with_allocator(util_malloc, util_realloc, util_free, sizeof(font_data_entry), 0, 0, 0, font_data_entry_hash, font_data_entry_compare, NULL, NULL);
+    blurg->fontManager->fallbackCache = hashmap_new_with_allocator(util_malloc, util_realloc, util_free, sizeof(fallback_entry), 0, 0, 0, fallback_entry_hash, fallback_entry_compare, NULL, NULL);
+}
+
+void font_manager_clear_fallbacks(blurg_t *blurg)
+{
+    if(hashmap_count(blurg->fontManager->fallbackCache)) {
+        hashmap_clear(blurg->fontManager->fallbackCache, 0);
+    }
 }
 
 static bool free_files(const void* file, void* udata)
@@ -112,6 +144,7 @@ void font_manager_destroy(blurg_t *blurg)
     hashmap_free(blurg->fontManager->fontTable);
     hashmap_scan(blurg->fontManager->fileTable, free_files, NULL);
     hashmap_free(blurg->fontManager->fileTable);
+    hashmap_free(blurg->fontManager->fallbackCache);
     free(blurg->fontManager);
 }
 
@@ -225,7 +258,7 @@ allocated_font *load_file_data(blurg_t *blurg, const char *filename)
     fd->dataLen = len;
     fd->data = data;
     fd->external = 0;
-    hashmap_set(fm->fileTable, &(font_data_entry){ .filename = strdup(filename), .font = fd });
+    hashmap_set(fm->fileTable, &(font_data_entry){ .filename = util_strdup(filename), .font = fd });
     return fd;
 }
 
@@ -243,9 +276,12 @@ void add_font(blurg_t *blurg, blurg_font_t *font)
     uint32_t key = (font->italic ? (1U << 31) : 0) | (uint32_t)font->weight;
     font_entry_set_style(fm, &e, 0, key, font);
     hashmap_set(fm->fontTable, &e);
+    // the new font may cover characters that previously had no fallback
+    font_manager_clear_fallbacks(blurg);
+    shapecache_invalidate(blurg);
 }
 
-BLURGAPI blurg_font_t *blurg_font_add_file(blurg_t *blurg, const char *filename)
+static blurg_font_t *font_add_file(blurg_t *blurg, const char *filename)
 {
     font_manager_t *fm = blurg->fontManager;
     allocated_font *data = load_file_data(blurg, filename);
@@ -258,7 +294,7 @@ BLURGAPI blurg_font_t *blurg_font_add_file(blurg_t *blurg, const char *filename)
     return font;
 }
 
-BLURGAPI blurg_font_t *blurg_font_add_memory(blurg_t *blurg, char *data, int len, int copy)
+static blurg_font_t *font_add_memory(blurg_t *blurg, char *data, int len, int copy)
 {
     font_manager_t *fm = blurg->fontManager;
     allocated_font *fontData = malloc(sizeof(allocated_font));
@@ -268,6 +304,7 @@ BLURGAPI blurg_font_t *blurg_font_add_memory(blurg_t *blurg, char *data, int len
         memcpy(fontData->data, data, len);
         fontData->external = 0;
     } else {
+        fontData->data = data;
         fontData->external = 1;
     }
 
@@ -284,12 +321,28 @@ BLURGAPI blurg_font_t *blurg_font_add_memory(blurg_t *blurg, char *data, int len
     // use invalid filename + map count to create unique identifier
     char identifier[256];
     snprintf(identifier, 256, "COM1:/dev/null/%zu\n", hashmap_count(blurg->fontManager->fileTable));
-    hashmap_set(blurg->fontManager->fileTable, &(font_data_entry){ .filename = strdup(identifier), .font = fontData });
+    hashmap_set(blurg->fontManager->fileTable, &(font_data_entry){ .filename = util_strdup(identifier), .font = fontData });
     add_font(blurg, font);
     return font;
 }
 
-blurg_font_t *blurg_font_fallback(blurg_t *blurg, blurg_font_t *font, uint32_t character)
+BLURGAPI blurg_font_t *blurg_font_add_file(blurg_t *blurg, const char *filename)
+{
+    ALLOCATOR_ENTER(blurg);
+    blurg_font_t *font = font_add_file(blurg, filename);
+    ALLOCATOR_LEAVE();
+    return font;
+}
+
+BLURGAPI blurg_font_t *blurg_font_add_memory(blurg_t *blurg, char *data, int len, int copy)
+{
+    ALLOCATOR_ENTER(blurg);
+    blurg_font_t *font = font_add_memory(blurg, data, len, copy);
+    ALLOCATOR_LEAVE();
+    return font;
+}
+
+static blurg_font_t *font_fallback_uncached(blurg_t *blurg, blurg_font_t *font, uint32_t character)
 {
     while(font->fallback) {
         font = font->fallback;
@@ -311,7 +364,38 @@ blurg_font_t *blurg_font_fallback(blurg_t *blurg, blurg_font_t *font, uint32_t c
     return NULL;
 }
 
-BLURGAPI blurg_font_t *blurg_font_query(blurg_t *blurg, const char *familyName, int weight, int italic)
+// Memoized so characters no font covers don't query the system fonts on every build
+static blurg_font_t *font_fallback_cached(blurg_t *blurg, blurg_font_t *font, uint32_t character)
+{
+    struct hashmap *cache = blurg->fontManager->fallbackCache;
+    const fallback_entry *cached = hashmap_get(cache, &(fallback_entry){ .font = font, .character = character });
+    if(cached) {
+        return cached->fallback;
+    }
+    blurg_font_t *fallback = font_fallback_uncached(blurg, font, character);
+    // set after the lookup, adding a system font clears the cache
+    hashmap_set(cache, &(fallback_entry){ .font = font, .character = character, .fallback = fallback });
+    return fallback;
+}
+
+blurg_font_t *blurg_font_fallback(blurg_t *blurg, blurg_font_t *font, uint32_t character)
+{
+    if(blurg->parent) {
+        // layout contexts look up the parent's fonts, which may load system fonts
+        blurg_font_t *fallback = blurg_font_fallback(blurg->parent, font->source ? font->source : font, character);
+        return fallback ? context_font(blurg, fallback) : NULL;
+    }
+    if(blurg->lock) {
+        mutex_lock(blurg->lock);
+    }
+    blurg_font_t *fallback = font_fallback_cached(blurg, font, character);
+    if(blurg->lock) {
+        mutex_unlock(blurg->lock);
+    }
+    return fallback;
+}
+
+static blurg_font_t *font_query(blurg_t *blurg, const char *familyName, int weight, int italic)
 {
     font_manager_t *fm = blurg->fontManager;
     const font_entry *result = hashmap_get(fm->fontTable, &(font_entry){ .familyName = familyName });
@@ -347,6 +431,14 @@ BLURGAPI blurg_font_t *blurg_font_query(blurg_t *blurg, const char *familyName,
     return fnt;
 }
 
+BLURGAPI blurg_font_t *blurg_font_query(blurg_t *blurg, const char *familyName, int weight, int italic)
+{
+    ALLOCATOR_ENTER(blurg);
+    blurg_font_t *font = font_query(blurg, familyName, weight, italic);
+    ALLOCATOR_LEAVE();
+    return font;
+}
+
 #ifndef SYSFONTS
 BLURGAPI int blurg_enable_system_fonts(blurg_t *blurg)
 {
@@ -1,6 +1,12 @@
 #include "blurgtext_internal.h"
 #include FT_OUTLINE_H
 #include FT_SYNTHESIS_H
+#include FT_MODULE_H
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include "util.h"
 static const uint8_t blurg_gamma[0x100] = {
     0x00, 0x0B, 0x11, 0x15, 0x19, 0x1C, 0x1F, 0x22, 0x25, 0x27, 0x2A, 0x2C, 0x2E, 0x30, 0x32, 0x34,
     0x36, 0x38, 0x3A, 0x3C, 0x3D, 0x3F, 0x41, 0x43, 0x44, 0x46, 0x47, 0x49, 0x4A, 0x4C, 0x4D, 0x4F,
@@ -22,9 +28,18 @@ static const uint8_t blurg_gamma[0x100] = {
 
 typedef struct _glyph_entry {
     uint64_t key;
+    // frame the glyph was last emitted in
+    uint32_t lastUse;
+    // font and size the glyph was rasterized at, for blurg_atlas_save
+    blurg_font_t *font;
+    uint32_t glyphVal;
     blurg_glyph glyph;
 } glyph_entry;
 
+IMPLEMENT_LIST(skyline_node)
+DEFINE_LIST(uint64_t)
+IMPLEMENT_LIST(uint64_t)
+
 int glyph_compare(const void *a, const void* b, void *udata)
 {
     const glyph_entry *ga = a;
@@ -38,46 +53,528 @@ uint64_t glyph_hash(const void *item, uint64_t seed0, uint64_t seed1)
     return hashmap_sip(&entry->key, sizeof(uint64_t), seed0, seed1);
 }
 
-static void new_texture(blurg_t *blurg)
+// Empties the skyline of a page, keeping the white pixel in the top left corner
+static void page_reset(atlas_page *page)
+{
+    page->skyline.count = 0;
+    list_skyline_node_add(&page->skyline, (skyline_node){ .x = 0, .y = 2, .width = 2 });
+    list_skyline_node_add(&page->skyline, (skyline_node){ .x = 2, .y = 0, .width = BLURG_TEXTURE_SIZE - 2 });
+    page->lastUse = 0;
+}
+
+static int format_bpp(blurg_texture_format_t format)
+{
+    return format == blurg_texture_format_rgba ? 4 : 1;
+}
+
+// Adds a changed area to the page, merging it into an existing region
+// when that wastes less than the area itself or there is no free region
+static void page_mark_dirty(atlas_page *page, int x, int y, int w, int h)
+{
+    int best = -1;
+    long bestWaste = 0;
+    for(int i = 0; i < page->dirtyCount; i++) {
+        blurg_region_t *r = &page->dirty[i];
+        int x0 = r->x < x ? r->x : x;
+        int y0 = r->y < y ? r->y : y;
+        int x1 = r->x + r->width > x + w ? r->x + r->width : x + w;
+        int y1 = r->y + r->height > y + h ? r->y + r->height : y + h;
+        long waste = (long)(x1 - x0) * (y1 - y0) - (long)r->width * r->height - (long)w * h;
+        if(best < 0 || waste < bestWaste) {
+            best = i;
+            bestWaste = waste;
+        }
+    }
+    if(best >= 0 && (bestWaste <= (long)w * h || page->dirtyCount == ATLAS_DIRTY_MAX)) {
+        blurg_region_t *r = &page->dirty[best];
+        int x0 = r->x < x ? r->x : x;
+        int y0 = r->y < y ? r->y : y;
+        int x1 = r->x + r->width > x + w ? r->x + r->width : x + w;
+        int y1 = r->y + r->height > y + h ? r->y + r->height : y + h;
+        *r = (blurg_region_t){ .x = x0, .y = y0, .width = x1 - x0, .height = y1 - y0 };
+    } else {
+        page->dirty[page->dirtyCount++] = (blurg_region_t){ .x = x, .y = y, .width = w, .height = h };
+    }
+}
+
+static void new_texture(blurg_t *blurg, blurg_texture_format_t format)
 {
     blurg_texture_t *tex = malloc(sizeof(blurg_texture_t));
-    blurg->textureAllocate(tex, BLURG_TEXTURE_SIZE, BLURG_TEXTURE_SIZE);
+    tex->userdata = NULL;
+    tex->format = format;
+    atlas_page *page = &blurg->packed.pages[blurg->packed.pageCount++];
+    page->texture = tex;
+    page->dirtyCount = 0;
+    page->pixels = NULL;
+    page->allocated = !blurg->packed.updateRegions;
+    if(page->allocated) {
+        blurg->textureAllocate(tex, BLURG_TEXTURE_SIZE, BLURG_TEXTURE_SIZE);
+    }
+    list_skyline_node_init(&page->skyline, 16);
+    page_reset(page);
     //Set white pixel in top left corner
     uint32_t white = 0xFFFFFFFF;
-    blurg->textureUpdate(tex, &white, 0, 0, 1, 1);
-    blurg->packed.currentX = 2;
-    blurg->packed.currentY = 0;
-    blurg->packed.lineMax = 2;
-    blurg->packed.pages[blurg->packed.curTex++] = tex;
+    if(blurg->packed.updateRegions || blurg->packed.mirror) {
+        page->pixels = calloc(BLURG_TEXTURE_SIZE * BLURG_TEXTURE_SIZE, format_bpp(format));
+        memcpy(page->pixels, &white, format_bpp(format));
+    }
+    if(blurg->packed.updateRegions) {
+        page_mark_dirty(page, 0, 0, 1, 1);
+    } else {
+        blurg->textureUpdate(tex, &white, 0, 0, 1, 1);
+    }
+}
+
+// Converts a rendered bitmap to the pixel format of a page, rows of dst are stride bytes apart
+static void convert_bitmap(const FT_Bitmap *rendered, blurg_texture_format_t format, uint8_t *dst, int stride)
+{
+    for(int y = 0; y < rendered->rows; y++) {
+        const uint8_t *src = rendered->buffer + y * rendered->pitch;
+        uint8_t *row = dst + y * stride;
+        if(rendered->pixel_mode == FT_PIXEL_MODE_BGRA) {
+            memcpy(row, src, rendered->width * 4);
+        } else if(format == blurg_texture_format_sdf) {
+            // distances, no gamma
+            memcpy(row, src, rendered->width);
+        } else if(format == blurg_texture_format_r8) {
+            for(int x = 0; x < rendered->width; x++) {
+                row[x] = blurg_gamma[src[x]];
+            }
+        } else {
+            for(int x = 0; x < rendered->width; x++) {
+                ((uint32_t*)row)[x] = 0x00FFFFFF | ((uint32_t)blurg_gamma[src[x]] << 24);
+            }
+        }
+    }
+}
+
+// Copies a rendered glyph into the staging pixels of the page when uploads are deferred,
+// otherwise uploads it directly and updates the mirror if there is one
+static void upload_glyph(blurg_t *blurg, atlas_page *page, int x, int y, const FT_Bitmap *rendered)
+{
+    blurg_texture_format_t format = page->texture->format;
+    int bpp = format_bpp(format);
+    int stride = BLURG_TEXTURE_SIZE * bpp;
+    if(blurg->packed.updateRegions) {
+        convert_bitmap(rendered, format, page->pixels + y * stride + x * bpp, stride);
+        page_mark_dirty(page, x, y, rendered->width, rendered->rows);
+        return;
+    }
+    if(page->pixels) {
+        convert_bitmap(rendered, format, page->pixels + y * stride + x * bpp, stride);
+    }
+    if(rendered->pixel_mode == FT_PIXEL_MODE_BGRA && rendered->pitch == rendered->width * 4) {
+        blurg->textureUpdate(page->texture, rendered->buffer, x, y, rendered->width, rendered->rows);
+        return;
+    }
+    // only reached without deferred uploads, so never from a layout context
+    arena_mark mark = arena_save(&blurg->arena);
+    uint8_t *buf = arena_alloc(&blurg->arena, rendered->width * rendered->rows * bpp);
+    convert_bitmap(rendered, format, buf, rendered->width * bpp);
+    blurg->textureUpdate(page->texture, buf, x, y, rendered->width, rendered->rows);
+    arena_restore(&blurg->arena, mark);
+}
+
+// Returns the y a w*h rect starting at skyline node index would be placed at, -1 if it doesn't fit
+static int skyline_fit(const list_skyline_node *sky, int index, int w, int h)
+{
+    if(sky->data[index].x + w > BLURG_TEXTURE_SIZE)
+        return -1;
+    int y = 0;
+    int remaining = w;
+    // the nodes cover the whole width, so this stays in bounds
+    for(int i = index; remaining > 0; i++) {
+        if(sky->data[i].y > y)
+            y = sky->data[i].y;
+        if(y + h > BLURG_TEXTURE_SIZE)
+            return -1;
+        remaining -= sky->data[i].width;
+    }
+    return y;
+}
+
+// Finds the bottom-left position for a w*h rect, returns the skyline node index or -1
+static int skyline_find(const list_skyline_node *sky, int w, int h, int *x, int *y)
+{
+    int best = -1;
+    int bestBottom = INT_MAX;
+    int bestWidth = INT_MAX;
+    for(int i = 0; i < sky->count; i++) {
+        int fy = skyline_fit(sky, i, w, h);
+        if(fy < 0)
+            continue;
+        if(fy + h < bestBottom || (fy + h == bestBottom && sky->data[i].width < bestWidth)) {
+            best = i;
+            bestBottom = fy + h;
+            bestWidth = sky->data[i].width;
+            *x = sky->data[i].x;
+            *y = fy;
+        }
+    }
+    return best;
+}
+
+// Raises the skyline over a rect placed at node index
+static void skyline_add(list_skyline_node *sky, int index, int x, int y, int w, int h)
+{
+    list_skyline_node_insert(sky, index, (skyline_node){ .x = x, .y = y + h, .width = w });
+    // shrink or remove the nodes now covered by the new one
+    int i = index + 1;
+    while(i < sky->count) {
+        skyline_node *node = &sky->data[i];
+        int overlap = x + w - node->x;
+        if(overlap <= 0)
+            break;
+        if(overlap < node->width) {
+            node->x += overlap;
+            node->width -= overlap;
+            break;
+        }
+        memmove(node, node + 1, (sky->count - i - 1) * sizeof(skyline_node));
+        sky->count--;
+    }
+    // merge neighbours at the same height
+    for(i = 0; i < sky->count - 1; i++) {
+        if(sky->data[i].y == sky->data[i + 1].y) {
+            sky->data[i].width += sky->data[i + 1].width;
+            memmove(&sky->data[i + 1], &sky->data[i + 2], (sky->count - i - 2) * sizeof(skyline_node));
+            sky->count--;
+            i--;
+        }
+    }
+}
+
+typedef struct {
+    int texture;
+    list_uint64_t keys;
+} evict_scan;
+
+static bool collect_page_glyphs(const void *item, void *udata)
+{
+    const glyph_entry *entry = item;
+    evict_scan *scan = udata;
+    if(entry->glyph.texture == scan->texture) {
+        list_uint64_t_add(&scan->keys, entry->key);
+    }
+    return true;
+}
+
+static void evict_from_map(struct hashmap *map, int texture)
+{
+    evict_scan scan = { .texture = texture };
+    list_uint64_t_init(&scan.keys, 64);
+    hashmap_scan(map, collect_page_glyphs, &scan);
+    for(int i = 0; i < scan.keys.count; i++) {
+        hashmap_delete(map, &(glyph_entry){ .key = scan.keys.data[i] });
+    }
+    list_uint64_t_free(&scan.keys);
+}
+
+// Removes every glyph on a page so it can be packed again
+static void page_evict(blurg_t *blurg, int texture)
+{
+    evict_from_map(blurg->glyphMap, texture);
+    if(blurg->loadedGlyphs) {
+        evict_from_map(blurg->loadedGlyphs, texture);
+    }
+    page_reset(&blurg->packed.pages[texture]);
+    blurg->packed.generation++;
+    blurg->packed.tableEpoch++;
+    blurg->packed.evictions++;
+}
+
+// Finds space for a w*h rect on a page of format. Pages are tried in order, then a new page is created.
+// When all pages are in use the least recently used page is evicted, pages with
+// glyphs used in the current frame are never evicted. Returns -1 if there is no space
+static int atlas_pack(blurg_t *blurg, blurg_texture_format_t format, int w, int h, int *x, int *y)
+{
+    struct texturePacking *packed = &blurg->packed;
+    int formatCount = 0;
+    for(int i = 0; i < packed->pageCount; i++) {
+        if(packed->pages[i].texture->format != format)
+            continue;
+        formatCount++;
+        int node = skyline_find(&packed->pages[i].skyline, w, h, x, y);
+        if(node >= 0) {
+            skyline_add(&packed->pages[i].skyline, node, *x, *y, w, h);
+            return i;
+        }
+    }
+    int page = -1;
+    if(formatCount < MAX_TEXTURES) {
+        new_texture(blurg, format);
+        page = packed->pageCount - 1;
+    } else {
+        for(int i = 0; i < packed->pageCount; i++) {
+            if(packed->pages[i].texture->format == format &&
+               packed->pages[i].lastUse < packed->frame &&
+               (page < 0 || packed->pages[i].lastUse < packed->pages[page].lastUse)) {
+                page = i;
+            }
+        }
+        if(page < 0) {
+            return -1;
+        }
+        page_evict(blurg, page);
+    }
+    int node = skyline_find(&packed->pages[page].skyline, w, h, x, y);
+    if(node < 0) {
+        // larger than a page
+        return -1;
+    }
+    skyline_add(&packed->pages[page].skyline, node, *x, *y, w, h);
+    return page;
+}
+
+// Held by layout contexts and the parent while they use the atlas
+static void atlas_lock(blurg_t *blurg)
+{
+    if(blurg->lock) {
+        mutex_lock(blurg->lock);
+    }
+}
+
+static void atlas_unlock(blurg_t *blurg)
+{
+    if(blurg->lock) {
+        mutex_unlock(blurg->lock);
+    }
 }
 
 void glyphatlas_init(blurg_t *blurg)
 {
-    blurg->glyphMap = hashmap_new(sizeof(glyph_entry), 0, 0, 0, glyph_hash, glyph_compare, NULL, NULL);
-    new_texture(blurg);
+    blurg->packed.tableEpoch = 1;
+    blurg->glyphMap = hashmap_new_with_allocator(util_malloc, util_realloc, util_free, sizeof(glyph_entry), 0, 0, 0, glyph_hash, glyph_compare, NULL, NULL);
+}
+
+// Pages are created on first use, so the atlas mode can be set after blurg_create
+blurg_texture_t *glyphatlas_white_texture(blurg_t *blurg)
+{
+    if(blurg->parent) {
+        blurg = blurg->parent;
+    }
+    atlas_lock(blurg);
+    if(!blurg->packed.pageCount) {
+        new_texture(blurg, blurg->packed.mode == blurg_atlas_split ? blurg_texture_format_r8 : blurg_texture_format_rgba);
+    }
+    blurg_texture_t *texture = blurg->packed.pages[0].texture;
+    atlas_unlock(blurg);
+    return texture;
 }
 
 void glyphatlas_destroy(blurg_t *blurg)
 {
     hashmap_free(blurg->glyphMap);
+    if(blurg->loadedGlyphs) {
+        hashmap_free(blurg->loadedGlyphs);
+    }
+    for(int i = 0; i < blurg->packed.pageCount; i++) {
+        list_skyline_node_free(&blurg->packed.pages[i].skyline);
+        free(blurg->packed.pages[i].pixels);
+    }
+}
+
+// Identifies a glyph across runs: font file contents, face, synthetic bold, size and glyph index
+static uint64_t persistent_key(blurg_font_t *font, uint32_t glyphVal, uint32_t index)
+{
+    uint64_t k[4] = {
+        blurg_font_content_hash(font),
+        (uint64_t)font->face->face_index,
+        ((uint64_t)font->embolden << 32) | glyphVal,
+        index
+    };
+    return hashmap_sip(k, sizeof(k), 0, 0);
+}
+
+static void glyph_touch(blurg_t *blurg, glyph_entry *entry)
+{
+    uint32_t frame = blurg->packed.frame;
+    entry->lastUse = frame;
+    atlas_page *page = &blurg->packed.pages[entry->glyph.texture];
+    if(page->lastUse < frame)
+        page->lastUse = frame;
+}
+
+// FreeType 2.11 added the SDF renderers
+#if FREETYPE_MAJOR > 2 || (FREETYPE_MAJOR == 2 && FREETYPE_MINOR >= 11)
+#define HAS_SDF 1
+#else
+#define HAS_SDF 0
+#endif
+
+static int use_sdf(blurg_t *blurg, FT_Face face)
+{
+    return blurg->packed.sdfSize > 0 && FT_IS_SCALABLE(face) && !FT_HAS_FIXED_SIZES(face) && !FT_HAS_COLOR(face);
+}
+
+// 26.6 size to rasterize the glyphs of a scalable font at
+static uint32_t raster_size(blurg_t *blurg, uint32_t setSize)
+{
+    struct texturePacking *packed = &blurg->packed;
+    if(packed->sizePolicy == blurg_size_exact || packed->sizeStep <= 0) {
+        return setSize;
+    }
+    float size = setSize / 64.0f;
+    float q;
+    if(packed->sizePolicy == blurg_size_geometric) {
+        if(packed->sizeStep <= 1) {
+            return setSize;
+        }
+        q = powf(packed->sizeStep, roundf(logf(size) / logf(packed->sizeStep)));
+    } else {
+        q = roundf(size / packed->sizeStep) * packed->sizeStep;
+    }
+    uint32_t val = (uint32_t)(q * 64.0f + 0.5f);
+    return val ? val : setSize;
+}
+
+void glyphatlas_reset_table(font_size *entry)
+{
+    for(int i = 0; i < entry->glyphTablePages; i++) {
+        if(entry->glyphTable[i]) {
+            memset(entry->glyphTable[i], 0, GLYPH_TABLE_PAGE * sizeof(glyph_table_slot));
+        }
+    }
+}
+
+void glyphatlas_free_table(font_size *entry)
+{
+    for(int i = 0; i < entry->glyphTablePages; i++) {
+        free(entry->glyphTable[i]);
+    }
+    free(entry->glyphTable);
+    entry->glyphTable = NULL;
+    entry->glyphTablePages = 0;
+}
+
+#if !BT_DISABLE_GLYPH_TABLES
+static void table_store(blurg_t *blurg, blurg_font_t *font, font_size *entry, uint32_t index, const blurg_glyph *glyph)
+{
+    int page = (int)(index >> GLYPH_TABLE_SHIFT);
+    if(!entry->glyphTable) {
+        entry->glyphTablePages = (int)((font->face->num_glyphs + GLYPH_TABLE_PAGE - 1) >> GLYPH_TABLE_SHIFT);
+        entry->glyphTable = calloc(entry->glyphTablePages, sizeof(glyph_table_slot*));
+    }
+    if(page >= entry->glyphTablePages) {
+        return;
+    }
+    if(!entry->glyphTable[page]) {
+        entry->glyphTable[page] = calloc(GLYPH_TABLE_PAGE, sizeof(glyph_table_slot));
+    }
+    glyph_table_slot *slot = &entry->glyphTable[page][index & (GLYPH_TABLE_PAGE - 1)];
+    slot->epoch = blurg->packed.tableEpoch;
+    slot->glyph = *glyph;
+}
+
+// Looks up a glyph in the table of the font's active size.
+// A slot is valid until glyphs are evicted or the size policy changes
+static int table_get(blurg_t *blurg, font_size *entry, uint32_t index, blurg_glyph *glyph)
+{
+    int page = (int)(index >> GLYPH_TABLE_SHIFT);
+    if(page >= entry->glyphTablePages || !entry->glyphTable[page]) {
+        return 0;
+    }
+    glyph_table_slot *slot = &entry->glyphTable[page][index & (GLYPH_TABLE_PAGE - 1)];
+    if(slot->epoch != blurg->packed.tableEpoch) {
+        return 0;
+    }
+    atlas_page *atlasPage = &blurg->packed.pages[slot->glyph.texture];
+    if(atlasPage->lastUse < blurg->packed.frame)
+        atlasPage->lastUse = blurg->packed.frame;
+    *glyph = slot->glyph;
+    return 1;
 }
+#endif
+
+static int glyphatlas_get_slow(blurg_t *blurg, blurg_font_t *font, uint32_t index, blurg_glyph *glyph);
 
 void glyphatlas_get(blurg_t *blurg, blurg_font_t *font, uint32_t index, blurg_glyph *glyph)
 {
-    uint64_t key = ((uint64_t)font->hash);
+    // layout contexts rasterize with their own copy of the font into the parent's atlas
+    if(blurg->parent) {
+        blurg = blurg->parent;
+    }
+    atlas_lock(blurg);
+#if BT_DISABLE_GLYPH_TABLES
+    glyphatlas_get_slow(blurg, font, index, glyph);
+#else
+    font_size *entry = font->activeSize;
+    if(table_get(blurg, entry, index, glyph)) {
+        blurg->packed.hits++;
+    } else if(glyphatlas_get_slow(blurg, font, index, glyph)) {
+        table_store(blurg, font, entry, index, glyph);
+    }
+#endif
+    // glyphs that didn't fit are looked up again next time
+    atlas_unlock(blurg);
+}
+
+blurg_texture_t *glyphatlas_texture(blurg_t *blurg, int texture)
+{
+    // set once when the page is created, before any glyph on it is returned
+    return blurg->parent
+        ? blurg->parent->packed.pages[texture].texture
+        : blurg->packed.pages[texture].texture;
+}
+
+// Looks up the glyph map, rasterizing on a miss
+static int glyphatlas_get_slow(blurg_t *blurg, blurg_font_t *font, uint32_t index, blurg_glyph *glyph)
+{
+    int sdf = use_sdf(blurg, font->face);
+    uint32_t setSize = font->setSize;
+    // entries outlive the copies of fonts in layout contexts
+    blurg_font_t *owner = font->source ? font->source : font;
+    uint32_t glyphVal = font->activeSize->glyphVal;
+    uint64_t key = font->hash;
+    if(sdf) {
+        glyphVal = FONT_SDF_GLYPHVAL;
+        key = font->sdfHash;
+    } else if(!FT_HAS_FIXED_SIZES(font->face)) {
+        glyphVal = raster_size(blurg, setSize);
+        if(glyphVal != setSize) {
+            key = font_size_hash(font, glyphVal);
+        }
+    }
     key = (key << 32) | index;
 
-    const glyph_entry *result = hashmap_get(blurg->glyphMap, &(glyph_entry){ .key = key });
+    glyph_entry *result = (glyph_entry*)hashmap_get(blurg->glyphMap, &(glyph_entry){ .key = key });
     if(result) {
+        if(result->lastUse != blurg->packed.frame) {
+            // only lastUse changes, the key stays the same
+            glyph_touch(blurg, result);
+        }
         *glyph = result->glyph;
-        return;
+        blurg->packed.hits++;
+        return 1;
+    }
+    if(blurg->loadedGlyphs) {
+        // glyphs from blurg_atlas_load are moved over on first use
+        const glyph_entry *loaded = hashmap_delete(blurg->loadedGlyphs,
+            &(glyph_entry){ .key = persistent_key(font, glyphVal, index) });
+        if(loaded) {
+            glyph_entry entry = { .key = key, .font = owner, .glyphVal = glyphVal, .glyph = loaded->glyph };
+            glyph_touch(blurg, &entry);
+            *glyph = entry.glyph;
+            hashmap_set(blurg->glyphMap, &entry);
+            blurg->packed.hits++;
+            return 1;
+        }
     }
+    blurg->packed.misses++;
 
     FT_Face face = font->face;
+    uint32_t rasterSize = sdf ? (uint32_t)(blurg->packed.sdfSize * 64.0f) : glyphVal;
     int loadFlags = FT_LOAD_TARGET_LIGHT;
     if(FT_HAS_COLOR(face)) {
         loadFlags |= FT_LOAD_COLOR;
     }
+    if(sdf) {
+        // unhinted, the outline is scaled to every size
+        loadFlags = FT_LOAD_NO_HINTING;
+    }
+    if(rasterSize != setSize && !FT_HAS_FIXED_SIZES(face)) {
+        font_use_size(font, rasterSize / 64.0f);
+    }
     FT_Load_Glyph(face, index, loadFlags);
     if(font->embolden) {
         if(face->glyph->format == FT_GLYPH_FORMAT_OUTLINE) {
@@ -87,60 +584,418 @@ void glyphatlas_get(blurg_t *blurg, blurg_font_t *font, uint32_t index, blurg_gl
             FT_GlyphSlot_Embolden(face->glyph);
         }
     }
+#if HAS_SDF
+    FT_Error err = FT_Render_Glyph(face->glyph, sdf ? FT_RENDER_MODE_SDF : FT_RENDER_MODE_NORMAL);
+#else
     FT_Error err = FT_Render_Glyph(face->glyph, FT_RENDER_MODE_NORMAL);
+#endif
     if(err != FT_Err_Ok) {
         printf("render error: %s\n", FT_Error_String(err));
     }
+    if(font->setSize != setSize) {
+        font_use_size(font, setSize / 64.0f);
+    }
     FT_Bitmap rendered = face->glyph->bitmap;
+    int isColor = rendered.pixel_mode == FT_PIXEL_MODE_BGRA;
+    blurg_texture_format_t format = blurg_texture_format_rgba;
+    if(sdf) {
+        format = blurg_texture_format_sdf;
+    } else if(!isColor && blurg->packed.mode == blurg_atlas_split) {
+        format = blurg_texture_format_r8;
+    }
     // find place to pack rendered glyph
-    int packW = rendered.width + 1; // padding
-    int packH = rendered.rows + 1;
-
-    if(blurg->packed.currentX + packW > BLURG_TEXTURE_SIZE) {
-        blurg->packed.currentX = 0;
-        blurg->packed.currentY += blurg->packed.lineMax;
-        blurg->packed.lineMax = 0;
-    }
-    if(blurg->packed.currentY + packH > BLURG_TEXTURE_SIZE) {
-        new_texture(blurg);
-    }
-    if(packH > blurg->packed.lineMax)
-        blurg->packed.lineMax = packH;
-    // create and upload glyph data
-    uint32_t* buf;
-    if(rendered.pixel_mode == FT_PIXEL_MODE_BGRA) 
-    {
-        buf = (uint32_t*)rendered.buffer;
-    }
-    else 
-    {
-        buf = malloc(rendered.width * rendered.rows * sizeof(uint32_t));
-        for(int i = 0; i < rendered.width * rendered.rows; i++) {
-            buf[i] = 0x00FFFFFF | (blurg_gamma[rendered.buffer[i]] << 24);
-        }
-    }
-    blurg->textureUpdate(
-        blurg->packed.pages[blurg->packed.curTex - 1],
-        (void*)buf,
-        blurg->packed.currentX,
-        blurg->packed.currentY,
-        rendered.width,
-        rendered.rows
-    );
-    if(rendered.pixel_mode != FT_PIXEL_MODE_BGRA) {
-        free(buf);
-    }
-    *glyph = (blurg_glyph){
-        .texture = blurg->packed.curTex - 1,
-        .srcX = blurg->packed.currentX,
-        .srcY = blurg->packed.currentY,
-        .srcW = rendered.width,
-        .srcH = rendered.rows,
-        .offsetLeft = face->glyph->bitmap_left,
-        .offsetTop = face->glyph->bitmap_top,
-        .color = rendered.pixel_mode == FT_PIXEL_MODE_BGRA,
+    int packX, packY;
+    int texture = atlas_pack(blurg, format, rendered.width + 1, rendered.rows + 1, &packX, &packY); // padding
+    if(texture < 0) {
+        // atlas full of glyphs used this frame, draw nothing
+        blurg->packed.dropped++;
+        *glyph = (blurg_glyph){ 0 };
+        return 0;
+    }
+    upload_glyph(blurg, &blurg->packed.pages[texture], packX, packY, &rendered);
+    glyph_entry entry = {
+        .key = key,
+        .font = owner,
+        .glyphVal = glyphVal,
+        .glyph = (blurg_glyph){
+            .texture = texture,
+            .srcX = packX,
+            .srcY = packY,
+            .srcW = rendered.width,
+            .srcH = rendered.rows,
+            .offsetLeft = face->glyph->bitmap_left,
+            .offsetTop = face->glyph->bitmap_top,
+            .color = isColor,
+            .rasterSize = FT_HAS_FIXED_SIZES(face) ? 0 : (int)rasterSize,
+        },
+    };
+    glyph_touch(blurg, &entry);
+    *glyph = entry.glyph;
+    hashmap_set(blurg->glyphMap, &entry);
+    return 1;
+}
+
+BLURGAPI int blurg_set_sdf(blurg_t *blurg, float referenceSize)
+{
+    if(blurg->packed.pageCount || !HAS_SDF) {
+        return 0;
+    }
+    if(referenceSize > 0) {
+        FT_Int spread = SDF_SPREAD;
+        FT_Property_Set(blurg->library, "sdf", "spread", &spread);
+        FT_Property_Set(blurg->library, "bsdf", "spread", &spread);
+    }
+    blurg->packed.sdfSize = referenceSize > 0 ? referenceSize : 0;
+    return 1;
+}
+
+BLURGAPI void blurg_set_size_policy(blurg_t *blurg, blurg_size_policy_t policy, float step)
+{
+    blurg->packed.sizePolicy = policy;
+    blurg->packed.sizeStep = step;
+    // cached glyphs may be for other raster sizes now
+    blurg->packed.tableEpoch++;
+}
+
+BLURGAPI void blurg_begin_frame(blurg_t *blurg)
+{
+    atlas_lock(blurg);
+    blurg->packed.explicitFrames = 1;
+    blurg->packed.frame++;
+    atlas_unlock(blurg);
+}
+
+void glyphatlas_end_build(blurg_t *blurg)
+{
+    // rects of earlier builds may be evicted by the next one
+    if(!blurg->parent && !blurg->packed.explicitFrames) {
+        blurg->packed.frame++;
+    }
+    if(blurg->packed.flushOnBuild) {
+        blurg_flush_uploads(blurg);
+    }
+}
+
+BLURGAPI void blurg_flush_uploads(blurg_t *blurg)
+{
+    if(!blurg->packed.updateRegions) {
+        return;
+    }
+    atlas_lock(blurg);
+    for(int i = 0; i < blurg->packed.pageCount; i++) {
+        atlas_page *page = &blurg->packed.pages[i];
+        if(!page->allocated) {
+            blurg->textureAllocate(page->texture, BLURG_TEXTURE_SIZE, BLURG_TEXTURE_SIZE);
+            page->allocated = 1;
+        }
+        if(page->dirtyCount) {
+            blurg->packed.updateRegions(page->texture, page->pixels, BLURG_TEXTURE_SIZE, page->dirty, page->dirtyCount);
+            page->dirtyCount = 0;
+        }
+    }
+    atlas_unlock(blurg);
+}
+
+BLURGAPI int blurg_set_deferred_uploads(blurg_t *blurg, blurg_texture_update_regions updateRegions, int flushOnBuild)
+{
+    if(blurg->packed.pageCount) {
+        return 0;
+    }
+    blurg->packed.updateRegions = updateRegions;
+    blurg->packed.flushOnBuild = flushOnBuild;
+    return 1;
+}
+
+BLURGAPI int blurg_set_atlas_mirror(blurg_t *blurg, int enabled)
+{
+    if(blurg->packed.pageCount) {
+        return 0;
+    }
+    blurg->packed.mirror = enabled;
+    return 1;
+}
+
+BLURGAPI int blurg_atlas_reupload(blurg_t *blurg)
+{
+    if(!blurg->packed.updateRegions && !blurg->packed.mirror) {
+        return 0;
+    }
+    for(int i = 0; i < blurg->packed.pageCount; i++) {
+        atlas_page *page = &blurg->packed.pages[i];
+        // the texture pointer stays the same, so built rects remain valid
+        blurg->textureAllocate(page->texture, BLURG_TEXTURE_SIZE, BLURG_TEXTURE_SIZE);
+        page->allocated = 1;
+        if(blurg->packed.updateRegions) {
+            blurg_region_t whole = { .x = 0, .y = 0, .width = BLURG_TEXTURE_SIZE, .height = BLURG_TEXTURE_SIZE };
+            blurg->packed.updateRegions(page->texture, page->pixels, BLURG_TEXTURE_SIZE, &whole, 1);
+            page->dirtyCount = 0;
+        } else {
+            blurg->textureUpdate(page->texture, page->pixels, 0, 0, BLURG_TEXTURE_SIZE, BLURG_TEXTURE_SIZE);
+        }
+    }
+    return 1;
+}
+
+BLURGAPI int blurg_set_atlas_mode(blurg_t *blurg, blurg_atlas_mode_t mode)
+{
+    if(blurg->packed.pageCount) {
+        return 0;
+    }
+    blurg->packed.mode = mode;
+    return 1;
+}
+
+BLURGAPI uint32_t blurg_atlas_generation(blurg_t *blurg)
+{
+    return blurg->packed.generation;
+}
+
+int glyphatlas_page_textures(blurg_t *blurg, blurg_texture_t **textures)
+{
+    blurg_t *root = blurg->parent ? blurg->parent : blurg;
+    atlas_lock(root);
+    int count = root->packed.pageCount;
+    for(int i = 0; i < count; i++) {
+        textures[i] = root->packed.pages[i].texture;
+    }
+    atlas_unlock(root);
+    return count;
+}
+
+BLURGAPI blurg_texture_t *blurg_atlas_page_texture(blurg_t *blurg, int page)
+{
+    blurg_texture_t *textures[MAX_TEXTURES * 3];
+    int count = glyphatlas_page_textures(blurg, textures);
+    return page >= 0 && page < count ? textures[page] : NULL;
+}
+
+// Saved atlas layout, all values in native byte order:
+// header, then each page (format, skyline nodes, pixels), then each glyph (persistent key, glyph)
+#define ATLAS_FILE_MAGIC 0x54414C42 // "BLAT"
+#define ATLAS_FILE_VERSION 3
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t textureSize;
+    uint32_t pageCount;
+    uint32_t glyphCount;
+} atlas_file_header;
+
+typedef struct {
+    uint32_t format;
+    uint32_t nodeCount;
+} atlas_file_page;
+
+typedef struct {
+    uint64_t key;
+    blurg_glyph glyph;
+} atlas_file_glyph;
+
+typedef struct {
+    FILE *file;
+    int failed;
+} atlas_save_state;
+
+static bool save_glyph(const void *item, void *udata)
+{
+    const glyph_entry *entry = item;
+    atlas_save_state *state = udata;
+    atlas_file_glyph g = {
+        // entries not used since loading already have a persistent key
+        .key = entry->font ? persistent_key(entry->font, entry->glyphVal, (uint32_t)entry->key) : entry->key,
+        .glyph = entry->glyph,
+    };
+    if(fwrite(&g, sizeof(g), 1, state->file) != 1) {
+        state->failed = 1;
+        return false;
+    }
+    return true;
+}
+
+BLURGAPI int blurg_atlas_save(blurg_t *blurg, const char *filename)
+{
+    struct texturePacking *packed = &blurg->packed;
+    if(packed->pageCount && !packed->pages[0].pixels) {
+        // needs the CPU copy of the pages
+        return 0;
+    }
+    FILE *file = fopen(filename, "wb");
+    if(!file) {
+        return 0;
+    }
+    atlas_file_header header = {
+        .magic = ATLAS_FILE_MAGIC,
+        .version = ATLAS_FILE_VERSION,
+        .textureSize = BLURG_TEXTURE_SIZE,
+        .pageCount = packed->pageCount,
+        .glyphCount = (uint32_t)(hashmap_count(blurg->glyphMap) +
+            (blurg->loadedGlyphs ? hashmap_count(blurg->loadedGlyphs) : 0)),
     };
-    // update packing, set hashmap
-    blurg->packed.currentX += packW;
-    hashmap_set(blurg->glyphMap, &(glyph_entry){ .key = key, .glyph = *glyph });
-}
\ No newline at end of file
+    atlas_save_state state = { .file = file, .failed = fwrite(&header, sizeof(header), 1, file) != 1 };
+    for(int i = 0; i < packed->pageCount && !state.failed; i++) {
+        atlas_page *page = &packed->pages[i];
+        atlas_file_page fp = { .format = page->texture->format, .nodeCount = page->skyline.count };
+        size_t pixelBytes = (size_t)BLURG_TEXTURE_SIZE * BLURG_TEXTURE_SIZE * format_bpp(page->texture->format);
+        if(fwrite(&fp, sizeof(fp), 1, file) != 1 ||
+           fwrite(page->skyline.data, sizeof(skyline_node), page->skyline.count, file) != (size_t)page->skyline.count ||
+           fwrite(page->pixels, 1, pixelBytes, file) != pixelBytes) {
+            state.failed = 1;
+        }
+    }
+    if(!state.failed) {
+        hashmap_scan(blurg->glyphMap, save_glyph, &state);
+    }
+    if(!state.failed && blurg->loadedGlyphs) {
+        hashmap_scan(blurg->loadedGlyphs, save_glyph, &state);
+    }
+    if(fclose(file) || state.failed) {
+        return 0;
+    }
+    return 1;
+}
+
+// Skyline nodes must cover [0, BLURG_TEXTURE_SIZE) left to right without gaps,
+// with heights inside the page
+static int atlas_file_skyline_valid(const unsigned char *data, uint32_t count)
+{
+    int x = 0;
+    for(uint32_t i = 0; i < count; i++) {
+        skyline_node node;
+        memcpy(&node, data + i * sizeof(skyline_node), sizeof(node));
+        if(node.x != x || node.width <= 0 || node.width > BLURG_TEXTURE_SIZE - x ||
+           node.y < 0 || node.y > BLURG_TEXTURE_SIZE) {
+            return 0;
+        }
+        x += node.width;
+    }
+    return x == BLURG_TEXTURE_SIZE;
+}
+
+static int atlas_file_glyph_valid(const blurg_glyph *glyph, uint32_t pageCount)
+{
+    return glyph->texture >= 0 && (uint32_t)glyph->texture < pageCount &&
+        glyph->srcX >= 0 && glyph->srcY >= 0 && glyph->srcW >= 0 && glyph->srcH >= 0 &&
+        glyph->srcW <= BLURG_TEXTURE_SIZE - glyph->srcX &&
+        glyph->srcH <= BLURG_TEXTURE_SIZE - glyph->srcY;
+}
+
+// Checks the whole file before anything is changed
+static int atlas_file_valid(const unsigned char *data, size_t len)
+{
+    if(len < sizeof(atlas_file_header)) {
+        return 0;
+    }
+    atlas_file_header header;
+    memcpy(&header, data, sizeof(header));
+    if(header.magic != ATLAS_FILE_MAGIC ||
+       header.version != ATLAS_FILE_VERSION ||
+       header.textureSize != BLURG_TEXTURE_SIZE ||
+       header.pageCount > MAX_TEXTURES * 3) {
+        return 0;
+    }
+    size_t pos = sizeof(header);
+    for(uint32_t i = 0; i < header.pageCount; i++) {
+        atlas_file_page fp;
+        if(len - pos < sizeof(fp)) {
+            return 0;
+        }
+        memcpy(&fp, data + pos, sizeof(fp));
+        pos += sizeof(fp);
+        if(fp.format > blurg_texture_format_sdf || !fp.nodeCount || fp.nodeCount > BLURG_TEXTURE_SIZE) {
+            return 0;
+        }
+        size_t pageBytes = fp.nodeCount * sizeof(skyline_node) +
+            (size_t)BLURG_TEXTURE_SIZE * BLURG_TEXTURE_SIZE * format_bpp(fp.format);
+        if(len - pos < pageBytes || !atlas_file_skyline_valid(data + pos, fp.nodeCount)) {
+            return 0;
+        }
+        pos += pageBytes;
+    }
+    if((len - pos) / sizeof(atlas_file_glyph) < header.glyphCount) {
+        return 0;
+    }
+    for(uint32_t i = 0; i < header.glyphCount; i++) {
+        atlas_file_glyph g;
+        memcpy(&g, data + pos + i * sizeof(g), sizeof(g));
+        if(!atlas_file_glyph_valid(&g.glyph, header.pageCount)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int atlas_load(blurg_t *blurg, const char *filename)
+{
+    struct texturePacking *packed = &blurg->packed;
+    if(packed->pageCount) {
+        return 0;
+    }
+    size_t len;
+    unsigned char *data = read_all_bytes(filename, &len);
+    if(!data) {
+        return 0;
+    }
+    if(!atlas_file_valid(data, len)) {
+        free(data);
+        return 0;
+    }
+    atlas_file_header header;
+    memcpy(&header, data, sizeof(header));
+    size_t pos = sizeof(header);
+    for(uint32_t i = 0; i < header.pageCount; i++) {
+        atlas_file_page fp;
+        memcpy(&fp, data + pos, sizeof(fp));
+        pos += sizeof(fp);
+        blurg_texture_format_t format = (blurg_texture_format_t)fp.format;
+        blurg_texture_t *tex = malloc(sizeof(blurg_texture_t));
+        tex->userdata = NULL;
+        tex->format = format;
+        atlas_page *page = &packed->pages[packed->pageCount++];
+        memset(page, 0, sizeof(atlas_page));
+        page->texture = tex;
+        page->allocated = !packed->updateRegions;
+        if(page->allocated) {
+            blurg->textureAllocate(tex, BLURG_TEXTURE_SIZE, BLURG_TEXTURE_SIZE);
+        }
+        list_skyline_node_init(&page->skyline, fp.nodeCount);
+        memcpy(page->skyline.data, data + pos, fp.nodeCount * sizeof(skyline_node));
+        page->skyline.count = fp.nodeCount;
+        pos += fp.nodeCount * sizeof(skyline_node);
+        // one upload per page
+        size_t pixelBytes = (size_t)BLURG_TEXTURE_SIZE * BLURG_TEXTURE_SIZE * format_bpp(format);
+        uint8_t *pixels = data + pos;
+        if(packed->updateRegions || packed->mirror) {
+            page->pixels = malloc(pixelBytes);
+            memcpy(page->pixels, pixels, pixelBytes);
+            pixels = page->pixels;
+        }
+        if(packed->updateRegions) {
+            page_mark_dirty(page, 0, 0, BLURG_TEXTURE_SIZE, BLURG_TEXTURE_SIZE);
+        } else {
+            blurg->textureUpdate(tex, pixels, 0, 0, BLURG_TEXTURE_SIZE, BLURG_TEXTURE_SIZE);
+        }
+        pos += pixelBytes;
+    }
+    // glyphs are matched to fonts on first use, entries of fonts that
+    // changed or aren't loaded are never matched
+    if(!blurg->loadedGlyphs) {
+        blurg->loadedGlyphs = hashmap_new_with_allocator(util_malloc, util_realloc, util_free, sizeof(glyph_entry), header.glyphCount, 0, 0, glyph_hash, glyph_compare, NULL, NULL);
+    }
+    for(uint32_t i = 0; i < header.glyphCount; i++) {
+        atlas_file_glyph g;
+        memcpy(&g, data + pos, sizeof(g));
+        pos += sizeof(g);
+        hashmap_set(blurg->loadedGlyphs, &(glyph_entry){ .key = g.key, .glyph = g.glyph });
+    }
+    free(data);
+    return 1;
+}
+
+BLURGAPI int blurg_atlas_load(blurg_t *blurg, const char *filename)
+{
+    ALLOCATOR_ENTER(blurg);
+    int loaded = atlas_load(blurg, filename);
+    ALLOCATOR_LEAVE();
+    return loaded;
+}
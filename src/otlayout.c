@@ -0,0 +1,830 @@
+#include "blurgtext_internal.h"
+#include FT_TRUETYPE_TABLES_H
+#include FT_TRUETYPE_TAGS_H
+#include <string.h>
+
+// OpenType layout for the simple text fast path.
+// Applies the GSUB and GPOS lookups HarfBuzz enables by default to a run of one font.
+// Each script of a font is checked once: every lookup that can match simple text
+// must be a single or ligature substitution, or a pair adjustment of the first advance,
+// otherwise that script of the font goes through the full path. The legacy kern table
+// is applied as HarfBuzz does when GPOS has no kern feature.
+// Only the default language system of a script is used, as raqm selects it when the
+// process locale has no language of its own (the "C" locale)
+
+#define LOOKUP_IGNORE_BASE (0x2)
+#define LOOKUP_IGNORE_LIGATURES (0x4)
+#define VALUE_X_ADVANCE (0x4)
+#define GDEF_CLASS_MARK (3)
+#define KERN_HORIZONTAL (0x1)
+#define KERN_CROSS_STREAM (0x4)
+// pair adjustments cached per script of a font, direct mapped
+#define PAIR_CACHE_BITS 10
+#define PAIR_CACHE_EMPTY (0xFFFFFFFF)
+// advances of substituted glyphs, which have no code point in the font_size cache
+#define ADVANCE_CACHE_SIZE (64)
+
+typedef struct {
+    FT_Byte *data;
+    FT_ULong length;
+} ot_table;
+
+// Adjustment of a glyph pair at one scale, the second glyph also moves by second
+typedef struct {
+    uint32_t pair;
+    int32_t mult;
+    int32_t first;
+    int32_t second;
+} pair_cache_entry;
+
+typedef struct {
+    // 0 unchecked, 1 usable by the fast path, -1 needs the full path
+    int state;
+    // lookup indices in the order they are applied
+    uint16_t *gsubLookups;
+    int gsubCount;
+    // bit per glyph covered by any of the GSUB lookups, other glyphs are skipped
+    uint8_t *gsubCovered;
+    uint16_t *gposLookups;
+    int gposCount;
+    int applyKern;
+    // allocated on first use if the plan positions glyphs
+    pair_cache_entry *pairCache;
+} ot_plan;
+
+typedef struct {
+    uint32_t glyph;
+    FT_Fixed xScale;
+    int advance;
+} advance_cache_entry;
+
+struct _ot_layout {
+    ot_table gsub;
+    ot_table gpos;
+    ot_table gdef;
+    ot_table kern;
+    int numGlyphs;
+    ot_plan plans[OT_SCRIPT_COUNT];
+    advance_cache_entry advances[ADVANCE_CACHE_SIZE];
+};
+
+// glyphs the fast path can produce for a script, built when its plan is checked
+typedef struct {
+    ot_layout *layout;
+    uint8_t *bits;
+    uint16_t *glyphs;
+    int count;
+    int numGlyphs;
+} glyph_set;
+
+// Default features of HarfBuzz for left-to-right horizontal text.
+// They are looked up in both GSUB and GPOS
+static const FT_ULong default_features[] = {
+    FT_MAKE_TAG('a','b','v','m'), FT_MAKE_TAG('b','l','w','m'), FT_MAKE_TAG('c','a','l','t'),
+    FT_MAKE_TAG('c','c','m','p'), FT_MAKE_TAG('c','l','i','g'), FT_MAKE_TAG('c','u','r','s'),
+    FT_MAKE_TAG('d','i','s','t'), FT_MAKE_TAG('k','e','r','n'), FT_MAKE_TAG('l','i','g','a'),
+    FT_MAKE_TAG('l','o','c','l'), FT_MAKE_TAG('l','t','r','a'), FT_MAKE_TAG('l','t','r','m'),
+    FT_MAKE_TAG('m','a','r','k'), FT_MAKE_TAG('m','k','m','k'), FT_MAKE_TAG('r','a','n','d'),
+    FT_MAKE_TAG('r','c','l','t'), FT_MAKE_TAG('r','l','i','g'), FT_MAKE_TAG('t','r','a','k'),
+};
+
+static const FT_ULong script_tags[OT_SCRIPT_COUNT] = {
+    FT_MAKE_TAG('D','F','L','T'),
+    FT_MAKE_TAG('l','a','t','n'),
+    FT_MAKE_TAG('g','r','e','k'),
+    FT_MAKE_TAG('c','y','r','l'),
+};
+
+// Reads are bounds checked, anything outside the table reads as 0
+static uint32_t rd16(const ot_table *t, uint32_t offset)
+{
+    if(offset >= t->length || t->length - offset < 2)
+        return 0;
+    return ((uint32_t)t->data[offset] << 8) | t->data[offset + 1];
+}
+
+static uint32_t rd32(const ot_table *t, uint32_t offset)
+{
+    return (rd16(t, offset) << 16) | rd16(t, offset + 2);
+}
+
+static void load_table(FT_Face face, FT_ULong tag, ot_table *t)
+{
+    FT_ULong length = 0;
+    t->data = NULL;
+    t->length = 0;
+    if(FT_Load_Sfnt_Table(face, tag, 0, NULL, &length) || !length)
+        return;
+    t->data = malloc(length);
+    if(FT_Load_Sfnt_Table(face, tag, 0, t->data, &length)) {
+        free(t->data);
+        t->data = NULL;
+        return;
+    }
+    t->length = length;
+}
+
+static ot_layout *layout_get(blurg_font_t *font)
+{
+    if(!font->otLayout) {
+        ot_layout *layout = malloc(sizeof(ot_layout));
+        memset(layout, 0, sizeof(ot_layout));
+        load_table(font->face, TTAG_GSUB, &layout->gsub);
+        load_table(font->face, TTAG_GPOS, &layout->gpos);
+        load_table(font->face, TTAG_GDEF, &layout->gdef);
+        load_table(font->face, TTAG_kern, &layout->kern);
+        layout->numGlyphs = (int)font->face->num_glyphs;
+        for(int i = 0; i < ADVANCE_CACHE_SIZE; i++) {
+            layout->advances[i].glyph = PAIR_CACHE_EMPTY;
+        }
+        font->otLayout = layout;
+    }
+    return font->otLayout;
+}
+
+// Index of glyph in the coverage table at offset, -1 if not covered
+static int coverage_index(const ot_table *t, uint32_t offset, uint32_t glyph)
+{
+    uint32_t format = rd16(t, offset);
+    int lo = 0;
+    int hi = (int)rd16(t, offset + 2) - 1;
+    while(lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if(format == 1) {
+            uint32_t g = rd16(t, offset + 4 + 2 * mid);
+            if(glyph < g) hi = mid - 1;
+            else if(glyph > g) lo = mid + 1;
+            else return mid;
+        } else if(format == 2) {
+            uint32_t range = offset + 4 + 6 * mid;
+            if(glyph < rd16(t, range)) hi = mid - 1;
+            else if(glyph > rd16(t, range + 2)) lo = mid + 1;
+            else return (int)(rd16(t, range + 4) + glyph - rd16(t, range));
+        } else {
+            break;
+        }
+    }
+    return -1;
+}
+
+static uint32_t class_of(const ot_table *t, uint32_t offset, uint32_t glyph)
+{
+    uint32_t format = rd16(t, offset);
+    if(format == 1) {
+        uint32_t start = rd16(t, offset + 2);
+        if(glyph >= start && glyph - start < rd16(t, offset + 4))
+            return rd16(t, offset + 6 + 2 * (glyph - start));
+    } else if(format == 2) {
+        int lo = 0;
+        int hi = (int)rd16(t, offset + 2) - 1;
+        while(lo <= hi) {
+            int mid = (lo + hi) / 2;
+            uint32_t range = offset + 4 + 6 * mid;
+            if(glyph < rd16(t, range)) hi = mid - 1;
+            else if(glyph > rd16(t, range + 2)) lo = mid + 1;
+            else return rd16(t, range + 4);
+        }
+    }
+    return 0;
+}
+
+static int glyph_is_mark(ot_layout *layout, uint32_t glyph)
+{
+    // version 1.x, glyph class definitions at 4
+    uint32_t classDef = rd16(&layout->gdef, 4);
+    return classDef && class_of(&layout->gdef, classDef, glyph) == GDEF_CLASS_MARK;
+}
+
+int otlayout_is_mark(blurg_font_t *font, FT_UInt glyph)
+{
+    return glyph_is_mark(layout_get(font), glyph);
+}
+
+static int set_has(const glyph_set *set, uint32_t glyph)
+{
+    return glyph < (uint32_t)set->numGlyphs && (set->bits[glyph >> 3] & (1 << (glyph & 7)));
+}
+
+// Returns 1 if the glyph was not in the set before
+static int set_add(glyph_set *set, uint32_t glyph)
+{
+    if(glyph >= (uint32_t)set->numGlyphs || set_has(set, glyph))
+        return 0;
+    set->bits[glyph >> 3] |= 1 << (glyph & 7);
+    set->glyphs[set->count++] = (uint16_t)glyph;
+    return 1;
+}
+
+// Adds a glyph produced by a substitution, returns -1 if it is a mark.
+// Lookups that skip marks would see different neighbours than the fast path
+static int closure_add(glyph_set *set, uint32_t glyph, int *changed)
+{
+    if(glyph_is_mark(set->layout, glyph))
+        return -1;
+    *changed |= set_add(set, glyph);
+    return 0;
+}
+
+static int coverage_intersects(const ot_table *t, uint32_t offset, const glyph_set *set)
+{
+    for(int i = 0; i < set->count; i++) {
+        if(coverage_index(t, offset, set->glyphs[i]) >= 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Offset of lookup index in the lookup list, 0 if it does not exist
+static uint32_t lookup_offset(const ot_table *t, uint32_t index)
+{
+    uint32_t list = rd16(t, 8);
+    if(!list || index >= rd16(t, list))
+        return 0;
+    return list + rd16(t, list + 2 + 2 * index);
+}
+
+// Follows an extension subtable to the subtable it wraps, returns the lookup type of *offset
+static uint32_t subtable_resolve(const ot_table *t, uint32_t type, uint32_t extensionType, uint32_t *offset)
+{
+    if(type == extensionType && rd16(t, *offset) == 1) {
+        type = rd16(t, *offset + 2);
+        *offset += rd32(t, *offset + 4);
+    }
+    return type;
+}
+
+// Checks a (chain) context subtable. These are not applied by the fast path,
+// returns 1 if the subtable can match glyphs of set
+static int context_can_match(const ot_table *t, uint32_t sub, int chained, const glyph_set *set)
+{
+    uint32_t format = rd16(t, sub);
+    if(format == 1 || format == 2) {
+        // conservative, the first glyph could start a rule
+        return coverage_intersects(t, sub + rd16(t, sub + 2), set);
+    }
+    if(format != 3) {
+        return 1;
+    }
+    // a rule of coverages matches only if every position can hold a glyph of set
+    uint32_t offset = sub + 2;
+    int sequences = chained ? 3 : 1;
+    for(int s = 0; s < sequences; s++) {
+        uint32_t count = rd16(t, offset);
+        // format 3 context tables have the lookup count between the glyph count and coverages
+        uint32_t coverages = chained ? offset + 2 : offset + 4;
+        for(uint32_t i = 0; i < count; i++) {
+            if(!coverage_intersects(t, sub + rd16(t, coverages + 2 * i), set))
+                return 0;
+        }
+        offset = coverages + 2 * count;
+    }
+    return 1;
+}
+
+// Adds the glyphs a GSUB lookup can produce from set to it.
+// Returns 1 if the lookup can match, 0 if not, -1 if the fast path can't apply it
+static int gsub_closure(const ot_table *t, uint32_t lookup, glyph_set *set, int *changed)
+{
+    uint32_t type = rd16(t, lookup);
+    uint32_t flags = rd16(t, lookup + 2);
+    uint32_t subCount = rd16(t, lookup + 4);
+    int matches = 0;
+    for(uint32_t k = 0; k < subCount; k++) {
+        uint32_t sub = lookup + rd16(t, lookup + 6 + 2 * k);
+        uint32_t subType = subtable_resolve(t, type, 7, &sub);
+        uint32_t format = rd16(t, sub);
+        uint32_t coverage = sub + rd16(t, sub + 2);
+        if(subType == 1 && (format == 1 || format == 2)) {
+            for(int i = 0; i < set->count; i++) {
+                int index = coverage_index(t, coverage, set->glyphs[i]);
+                if(index < 0)
+                    continue;
+                uint32_t glyph;
+                if(format == 1)
+                    glyph = (set->glyphs[i] + rd16(t, sub + 4)) & 0xFFFF;
+                else if((uint32_t)index < rd16(t, sub + 4))
+                    glyph = rd16(t, sub + 6 + 2 * index);
+                else
+                    continue;
+                matches = 1;
+                if(closure_add(set, glyph, changed) < 0)
+                    return -1;
+            }
+        } else if(subType == 4 && format == 1) {
+            for(int i = 0; i < set->count; i++) {
+                int index = coverage_index(t, coverage, set->glyphs[i]);
+                if(index < 0 || (uint32_t)index >= rd16(t, sub + 4))
+                    continue;
+                uint32_t ligSet = sub + rd16(t, sub + 6 + 2 * index);
+                uint32_t ligCount = rd16(t, ligSet);
+                for(uint32_t l = 0; l < ligCount; l++) {
+                    uint32_t lig = ligSet + rd16(t, ligSet + 2 + 2 * l);
+                    uint32_t components = rd16(t, lig + 2);
+                    int all = components > 0;
+                    for(uint32_t c = 1; c < components && all; c++) {
+                        all = set_has(set, rd16(t, lig + 2 + 2 * c));
+                    }
+                    if(all) {
+                        matches = 1;
+                        if(closure_add(set, rd16(t, lig), changed) < 0)
+                            return -1;
+                    }
+                }
+            }
+        } else if(subType == 5 || subType == 6) {
+            if(context_can_match(t, sub, subType == 6, set))
+                return -1;
+        } else if((subType == 2 || subType == 3 || subType == 8) && format == 1) {
+            if(coverage_intersects(t, coverage, set))
+                return -1;
+        } else {
+            return -1;
+        }
+    }
+    // skipping bases or ligatures changes which glyphs are adjacent
+    if(matches && (flags & (LOOKUP_IGNORE_BASE | LOOKUP_IGNORE_LIGATURES)))
+        return -1;
+    return matches;
+}
+
+// Returns 1 if a GPOS lookup can match glyphs of set, 0 if not, -1 if the fast path can't apply it
+static int gpos_check(const ot_table *t, uint32_t lookup, const glyph_set *set)
+{
+    uint32_t type = rd16(t, lookup);
+    uint32_t flags = rd16(t, lookup + 2);
+    uint32_t subCount = rd16(t, lookup + 4);
+    int matches = 0;
+    for(uint32_t k = 0; k < subCount; k++) {
+        uint32_t sub = lookup + rd16(t, lookup + 6 + 2 * k);
+        uint32_t subType = subtable_resolve(t, type, 9, &sub);
+        uint32_t format = rd16(t, sub);
+        uint32_t coverage = sub + rd16(t, sub + 2);
+        if(subType == 2 && (format == 1 || format == 2) &&
+           !(rd16(t, sub + 4) & ~VALUE_X_ADVANCE) && !rd16(t, sub + 6)) {
+            matches |= coverage_intersects(t, coverage, set);
+        } else if(subType == 7 || subType == 8) {
+            if(context_can_match(t, sub, subType == 8, set))
+                return -1;
+        } else if(subType >= 1 && subType <= 6 && (format == 1 || (format == 2 && subType <= 2))) {
+            // single, pair with other values, cursive and mark attachment. Mark attachment
+            // starts from the mark coverage, which is at the same place
+            if(coverage_intersects(t, coverage, set))
+                return -1;
+        } else {
+            return -1;
+        }
+    }
+    if(matches && (flags & (LOOKUP_IGNORE_BASE | LOOKUP_IGNORE_LIGATURES)))
+        return -1;
+    return matches;
+}
+
+static int compare_u16(const void *a, const void *b)
+{
+    return (int)*(const uint16_t*)a - (int)*(const uint16_t*)b;
+}
+
+// Collects the lookups of the default features in the default language system of script,
+// sorted and without duplicates like HarfBuzz applies them.
+// Returns the lookup count, -1 if the table needs the full path
+static int collect_lookups(const ot_table *t, ot_script script, uint16_t **lookups, int *hasKern)
+{
+    *lookups = NULL;
+    *hasKern = 0;
+    if(!t->length)
+        return 0;
+    if(rd16(t, 0) != 1)
+        return -1;
+    // feature variations may replace features even without variation axes
+    if(rd16(t, 2) >= 1 && rd32(t, 10))
+        return -1;
+    uint32_t scriptList = rd16(t, 4);
+    uint32_t featureList = rd16(t, 6);
+    uint32_t featureCount = rd16(t, featureList);
+    // script of the text, then the fallbacks HarfBuzz tries
+    const FT_ULong tags[] = { script_tags[script], FT_MAKE_TAG('D','F','L','T'), FT_MAKE_TAG('d','f','l','t'), FT_MAKE_TAG('l','a','t','n') };
+    uint32_t scriptTable = 0;
+    uint32_t scriptCount = rd16(t, scriptList);
+    for(int i = 0; i < 4 && !scriptTable; i++) {
+        for(uint32_t s = 0; s < scriptCount; s++) {
+            if(rd32(t, scriptList + 2 + 6 * s) == tags[i]) {
+                scriptTable = scriptList + rd16(t, scriptList + 6 + 6 * s);
+                break;
+            }
+        }
+    }
+    if(!scriptTable || !rd16(t, scriptTable))
+        return 0;
+    uint32_t langSys = scriptTable + rd16(t, scriptTable);
+    uint32_t indexCount = rd16(t, langSys + 4);
+    // lookup indices of the enabled features, counted first then copied
+    int total = 0;
+    for(int pass = 0; pass < 2; pass++) {
+        total = 0;
+        for(uint32_t i = 0; i <= indexCount; i++) {
+            // the required feature first, 0xFFFF if none
+            uint32_t feature = i == 0 ? rd16(t, langSys + 2) : rd16(t, langSys + 4 + 2 * i);
+            if(feature >= featureCount)
+                continue;
+            FT_ULong tag = rd32(t, featureList + 2 + 6 * feature);
+            if(tag == FT_MAKE_TAG('r','v','r','n')) {
+                free(*lookups);
+                *lookups = NULL;
+                return -1;
+            }
+            int enabled = i == 0;
+            for(size_t f = 0; f < sizeof(default_features) / sizeof(default_features[0]) && !enabled; f++) {
+                enabled = tag == default_features[f];
+            }
+            if(!enabled)
+                continue;
+            if(tag == FT_MAKE_TAG('k','e','r','n'))
+                *hasKern = 1;
+            uint32_t table = featureList + rd16(t, featureList + 6 + 6 * feature);
+            uint32_t lookupCount = rd16(t, table + 2);
+            for(uint32_t l = 0; l < lookupCount; l++) {
+                if(pass)
+                    (*lookups)[total] = (uint16_t)rd16(t, table + 4 + 2 * l);
+                total++;
+            }
+        }
+        if(!total)
+            return 0;
+        if(!pass)
+            *lookups = malloc(total * sizeof(uint16_t));
+    }
+    qsort(*lookups, total, sizeof(uint16_t), compare_u16);
+    int count = 0;
+    for(int i = 0; i < total; i++) {
+        if(!count || (*lookups)[count - 1] != (*lookups)[i])
+            (*lookups)[count++] = (*lookups)[i];
+    }
+    return count;
+}
+
+// kern table version 0 with horizontal format 0 subtables, as HarfBuzz applies it
+static int kern_supported(const ot_table *t)
+{
+    if(rd16(t, 0) != 0)
+        return 0;
+    uint32_t count = rd16(t, 2);
+    uint32_t offset = 4;
+    for(uint32_t i = 0; i < count; i++) {
+        uint32_t coverage = rd16(t, offset + 4);
+        if((coverage & KERN_HORIZONTAL) && ((coverage >> 8) != 0 || (coverage & KERN_CROSS_STREAM)))
+            return 0;
+        offset += rd16(t, offset + 2);
+    }
+    return 1;
+}
+
+static int plan_build(blurg_font_t *font, ot_layout *layout, ot_script script, ot_plan *plan)
+{
+    glyph_set set;
+    set.layout = layout;
+    set.numGlyphs = layout->numGlyphs;
+    set.bits = calloc((set.numGlyphs + 7) / 8 + 1, 1);
+    set.glyphs = malloc((set.numGlyphs + 1) * sizeof(uint16_t));
+    set.count = 0;
+    // glyphs of the script and of common characters, marks always take the full path
+    for(uint32_t c = 0; c < SIMPLE_MAX_CODEPOINT; c++) {
+        int s = simpleshape_script(c);
+        if(s == (int)script || s == ot_script_common) {
+            FT_UInt glyph = FT_Get_Char_Index(font->face, c);
+            if(glyph && !glyph_is_mark(layout, glyph))
+                set_add(&set, glyph);
+        }
+    }
+    int result = 1;
+    int hasKern = 0;
+    uint16_t *lookups;
+    int count = collect_lookups(&layout->gsub, script, &lookups, &hasKern);
+    if(count < 0)
+        result = -1;
+    // substitutions add glyphs that later lookups can match, repeat until no new glyphs
+    int changed = 1;
+    while(changed && result > 0) {
+        changed = 0;
+        for(int i = 0; i < count && result > 0; i++) {
+            uint32_t lookup = lookup_offset(&layout->gsub, lookups[i]);
+            if(lookup && gsub_closure(&layout->gsub, lookup, &set, &changed) < 0)
+                result = -1;
+        }
+    }
+    // keep only lookups that can match
+    plan->gsubLookups = lookups;
+    plan->gsubCount = 0;
+    plan->gsubCovered = NULL;
+    for(int i = 0; i < count && result > 0; i++) {
+        uint32_t lookup = lookup_offset(&layout->gsub, lookups[i]);
+        if(lookup && gsub_closure(&layout->gsub, lookup, &set, &changed) > 0)
+            plan->gsubLookups[plan->gsubCount++] = lookups[i];
+    }
+    if(plan->gsubCount) {
+        plan->gsubCovered = calloc((set.numGlyphs + 7) / 8, 1);
+        for(int i = 0; i < plan->gsubCount; i++) {
+            const ot_table *t = &layout->gsub;
+            uint32_t lookup = lookup_offset(t, plan->gsubLookups[i]);
+            uint32_t subCount = rd16(t, lookup + 4);
+            for(uint32_t k = 0; k < subCount; k++) {
+                uint32_t sub = lookup + rd16(t, lookup + 6 + 2 * k);
+                subtable_resolve(t, rd16(t, lookup), 7, &sub);
+                for(int g = 0; g < set.count; g++) {
+                    if(coverage_index(t, sub + rd16(t, sub + 2), set.glyphs[g]) >= 0)
+                        plan->gsubCovered[set.glyphs[g] >> 3] |= 1 << (set.glyphs[g] & 7);
+                }
+            }
+        }
+    }
+
+    plan->gposLookups = NULL;
+    plan->gposCount = 0;
+    if(result > 0) {
+        count = collect_lookups(&layout->gpos, script, &lookups, &hasKern);
+        plan->gposLookups = lookups;
+        if(count < 0)
+            result = -1;
+        for(int i = 0; i < count && result > 0; i++) {
+            uint32_t lookup = lookup_offset(&layout->gpos, lookups[i]);
+            int check = lookup ? gpos_check(&layout->gpos, lookup, &set) : 0;
+            if(check < 0)
+                result = -1;
+            else if(check)
+                plan->gposLookups[plan->gposCount++] = lookups[i];
+        }
+    }
+    plan->applyKern = 0;
+    if(result > 0 && layout->kern.length && !hasKern) {
+        if(kern_supported(&layout->kern))
+            plan->applyKern = 1;
+        else
+            result = -1;
+    }
+    free(set.bits);
+    free(set.glyphs);
+    return result;
+}
+
+int otlayout_usable(blurg_font_t *font, ot_script script)
+{
+    ot_layout *layout = layout_get(font);
+    ot_plan *plan = &layout->plans[script];
+    if(!plan->state) {
+        plan->state = plan_build(font, layout, script, plan);
+    }
+    return plan->state > 0;
+}
+
+static int substitute_advance(blurg_font_t *font, uint32_t glyph)
+{
+    advance_cache_entry *entry = &font->otLayout->advances[glyph % ADVANCE_CACHE_SIZE];
+    FT_Fixed xScale = font->face->size->metrics.x_scale;
+    if(entry->glyph != glyph || entry->xScale != xScale) {
+        entry->glyph = glyph;
+        entry->xScale = xScale;
+        entry->advance = simpleshape_glyph_advance(font, glyph);
+    }
+    return entry->advance;
+}
+
+// Finds the first ligature of the ligature set matching the glyphs at i.
+// Returns the number of glyphs it replaces, 0 if none matched
+static int ligature_match(const ot_table *t, uint32_t ligSet, const raqm_glyph_t *glyphs, int count, int i, uint32_t *ligature)
+{
+    uint32_t ligCount = rd16(t, ligSet);
+    for(uint32_t l = 0; l < ligCount; l++) {
+        uint32_t lig = ligSet + rd16(t, ligSet + 2 + 2 * l);
+        int components = (int)rd16(t, lig + 2);
+        if(!components || i + components > count)
+            continue;
+        int match = 1;
+        for(int c = 1; c < components && match; c++) {
+            match = glyphs[i + c].index == rd16(t, lig + 2 + 2 * c);
+        }
+        if(match) {
+            *ligature = rd16(t, lig);
+            return components;
+        }
+    }
+    return 0;
+}
+
+// Applies a lookup over the glyphs, writing behind the read position as ligatures shrink the run
+static void gsub_apply(blurg_font_t *font, const ot_plan *plan, const ot_table *t, uint32_t lookup, raqm_glyph_t *glyphs, int *count)
+{
+    uint32_t type = rd16(t, lookup);
+    uint32_t subCount = rd16(t, lookup + 4);
+    int numGlyphs = font->otLayout->numGlyphs;
+    int out = 0;
+    for(int i = 0; i < *count;) {
+        int consumed = 1;
+        uint32_t g = glyphs[i].index;
+        if(g >= (uint32_t)numGlyphs || !(plan->gsubCovered[g >> 3] & (1 << (g & 7)))) {
+            if(out != i)
+                glyphs[out] = glyphs[i];
+            out++;
+            i++;
+            continue;
+        }
+        raqm_glyph_t glyph = glyphs[i];
+        for(uint32_t k = 0; k < subCount; k++) {
+            uint32_t sub = lookup + rd16(t, lookup + 6 + 2 * k);
+            uint32_t subType = subtable_resolve(t, type, 7, &sub);
+            uint32_t format = rd16(t, sub);
+            int index = coverage_index(t, sub + rd16(t, sub + 2), g);
+            if(index < 0)
+                continue;
+            uint32_t substitute = 0;
+            int applied = 0;
+            if(subType == 1 && format == 1) {
+                substitute = (g + rd16(t, sub + 4)) & 0xFFFF;
+                applied = 1;
+            } else if(subType == 1 && format == 2 && (uint32_t)index < rd16(t, sub + 4)) {
+                substitute = rd16(t, sub + 6 + 2 * index);
+                applied = 1;
+            } else if(subType == 4 && format == 1 && (uint32_t)index < rd16(t, sub + 4)) {
+                // the ligature takes the cluster of its first component
+                consumed = ligature_match(t, sub + rd16(t, sub + 6 + 2 * index), glyphs, *count, i, &substitute);
+                applied = consumed > 0;
+                if(!applied)
+                    consumed = 1;
+            }
+            if(applied) {
+                glyph.index = substitute;
+                glyph.x_advance = substitute_advance(font, substitute);
+                break;
+            }
+        }
+        glyphs[out++] = glyph;
+        i += consumed;
+    }
+    *count = out;
+}
+
+// Same rounding as HarfBuzz scaling font units by the size of an FT_Face
+static int scale_units(int64_t value, int64_t mult)
+{
+    return (int)((value * mult + 32768) >> 16);
+}
+
+// Pair adjustment value of the first glyph, returns 1 if a subtable applied
+static int pair_apply(const ot_table *t, uint32_t sub, uint32_t first, uint32_t second, int64_t mult, int *advance)
+{
+    uint32_t format = rd16(t, sub);
+    int index = coverage_index(t, sub + rd16(t, sub + 2), first);
+    if(index < 0)
+        return 0;
+    // only the x advance of the first glyph or nothing, see gpos_check
+    uint32_t valueFormat = rd16(t, sub + 4);
+    int valueSize = valueFormat ? 1 : 0;
+    uint32_t value = 0;
+    if(format == 1) {
+        if((uint32_t)index >= rd16(t, sub + 8))
+            return 0;
+        uint32_t pairSet = sub + rd16(t, sub + 10 + 2 * index);
+        uint32_t recordSize = 2 + 2 * valueSize;
+        int lo = 0;
+        int hi = (int)rd16(t, pairSet) - 1;
+        while(lo <= hi) {
+            int mid = (lo + hi) / 2;
+            uint32_t record = pairSet + 2 + recordSize * mid;
+            uint32_t g = rd16(t, record);
+            if(second < g) hi = mid - 1;
+            else if(second > g) lo = mid + 1;
+            else {
+                value = record + 2;
+                break;
+            }
+        }
+        if(!value)
+            return 0;
+    } else if(format == 2) {
+        uint32_t class1 = class_of(t, sub + rd16(t, sub + 8), first);
+        uint32_t class2 = class_of(t, sub + rd16(t, sub + 10), second);
+        uint32_t class2Count = rd16(t, sub + 14);
+        if(class1 >= rd16(t, sub + 12) || class2 >= class2Count)
+            return 0;
+        value = sub + 16 + 2 * valueSize * (class1 * class2Count + class2);
+    } else {
+        return 0;
+    }
+    if(valueSize) {
+        *advance += scale_units((int16_t)rd16(t, value), mult);
+    }
+    return 1;
+}
+
+// Value of the pair in a format 0 kern subtable, 0 if not kerned
+static int kern_value(const ot_table *t, uint32_t subtable, uint32_t first, uint32_t second)
+{
+    uint32_t key = (first << 16) | second;
+    int lo = 0;
+    int hi = (int)rd16(t, subtable + 6) - 1;
+    while(lo <= hi) {
+        int mid = (lo + hi) / 2;
+        uint32_t pair = subtable + 14 + 6 * mid;
+        uint32_t k = rd32(t, pair);
+        if(key < k) hi = mid - 1;
+        else if(key > k) lo = mid + 1;
+        else return (int16_t)rd16(t, pair + 4);
+    }
+    return 0;
+}
+
+// Adjustments of adjacent glyphs first, second from every GPOS lookup then the kern table.
+// Pairs don't affect each other, positioning only changes advances
+static void pair_adjust(ot_layout *layout, const ot_plan *plan, uint32_t first, uint32_t second, int64_t mult, int *adjustFirst, int *adjustSecond)
+{
+    const ot_table *t = &layout->gpos;
+    *adjustFirst = 0;
+    *adjustSecond = 0;
+    for(int i = 0; i < plan->gposCount; i++) {
+        uint32_t lookup = lookup_offset(t, plan->gposLookups[i]);
+        uint32_t type = rd16(t, lookup);
+        uint32_t subCount = rd16(t, lookup + 4);
+        // the first subtable that applies ends the lookup
+        for(uint32_t k = 0; k < subCount; k++) {
+            uint32_t sub = lookup + rd16(t, lookup + 6 + 2 * k);
+            if(subtable_resolve(t, type, 9, &sub) != 2)
+                continue;
+            if(pair_apply(t, sub, first, second, mult, adjustFirst))
+                break;
+        }
+    }
+    if(plan->applyKern) {
+        t = &layout->kern;
+        uint32_t tables = rd16(t, 2);
+        uint32_t offset = 4;
+        for(uint32_t n = 0; n < tables; n++) {
+            if(rd16(t, offset + 4) & KERN_HORIZONTAL) {
+                int value = kern_value(t, offset, first, second);
+                if(value) {
+                    // split between the pair like HarfBuzz, applied to the second advance and offset
+                    int kern = scale_units(value, mult);
+                    *adjustFirst += kern >> 1;
+                    *adjustSecond += kern - (kern >> 1);
+                }
+            }
+            offset += rd16(t, offset + 2);
+        }
+    }
+}
+
+void otlayout_apply(blurg_font_t *font, ot_script script, raqm_glyph_t *glyphs, int *count)
+{
+    ot_layout *layout = font->otLayout;
+    ot_plan *plan = &layout->plans[script];
+    for(int i = 0; i < plan->gsubCount; i++) {
+        gsub_apply(font, plan, &layout->gsub, lookup_offset(&layout->gsub, plan->gsubLookups[i]), glyphs, count);
+    }
+    if(!plan->gposCount && !plan->applyKern)
+        return;
+    FT_Face face = font->face;
+    int64_t upem = face->units_per_EM ? face->units_per_EM : 1;
+    int64_t xScale = (int64_t)(((uint64_t)face->size->metrics.x_scale * (uint64_t)upem + (1u << 15)) >> 16);
+    int64_t mult = (xScale << 16) / upem;
+    if(!plan->pairCache) {
+        plan->pairCache = malloc(sizeof(pair_cache_entry) << PAIR_CACHE_BITS);
+        for(int i = 0; i < (1 << PAIR_CACHE_BITS); i++) {
+            plan->pairCache[i].pair = PAIR_CACHE_EMPTY;
+        }
+    }
+    for(int i = 0; i + 1 < *count; i++) {
+        uint32_t pair = (glyphs[i].index << 16) | glyphs[i + 1].index;
+        uint32_t hash = (pair * 0x9E3779B1u) ^ ((uint32_t)mult * 0x85EBCA6Bu);
+        pair_cache_entry *entry = &plan->pairCache[hash >> (32 - PAIR_CACHE_BITS)];
+        if(entry->pair != pair || entry->mult != mult) {
+            int adjustFirst, adjustSecond;
+            pair_adjust(layout, plan, glyphs[i].index, glyphs[i + 1].index, mult, &adjustFirst, &adjustSecond);
+            if(mult > INT32_MAX) {
+                glyphs[i].x_advance += adjustFirst;
+                glyphs[i + 1].x_advance += adjustSecond;
+                glyphs[i + 1].x_offset += adjustSecond;
+                continue;
+            }
+            *entry = (pair_cache_entry){ .pair = pair, .mult = (int32_t)mult, .first = adjustFirst, .second = adjustSecond };
+        }
+        glyphs[i].x_advance += entry->first;
+        glyphs[i + 1].x_advance += entry->second;
+        glyphs[i + 1].x_offset += entry->second;
+    }
+}
+
+void otlayout_free(blurg_font_t *font)
+{
+    ot_layout *layout = font->otLayout;
+    if(!layout)
+        return;
+    free(layout->gsub.data);
+    free(layout->gpos.data);
+    free(layout->gdef.data);
+    free(layout->kern.data);
+    for(int i = 0; i < OT_SCRIPT_COUNT; i++) {
+        free(layout->plans[i].gsubLookups);
+        free(layout->plans[i].gsubCovered);
+        free(layout->plans[i].gposLookups);
+        free(layout->plans[i].pairCache);
+    }
+    free(layout);
+    font->otLayout = NULL;
+}
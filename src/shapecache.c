@@ -0,0 +1,212 @@
+#include "blurgtext_internal.h"
+#include <string.h>
+
+// The cache stores pointers to entries, the entries themselves
+// are linked in LRU order (most recently used at head)
+typedef struct _shape_cache_item {
+    shape_entry *entry;
+} shape_cache_item;
+
+static int shape_entry_matches(const shape_entry *a, const shape_entry *b)
+{
+    if(a->encoding != b->encoding ||
+        a->size != b->size ||
+        a->textBytes != b->textBytes ||
+        a->runCount != b->runCount) {
+        return 0;
+    }
+    // compare fields, runs may contain uninitialised padding
+    for(int i = 0; i < a->runCount; i++) {
+        if(a->runs[i].font != b->runs[i].font ||
+           a->runs[i].count != b->runs[i].count) {
+            return 0;
+        }
+    }
+    return !memcmp(a->text, b->text, a->textBytes);
+}
+
+static int shape_item_compare(const void *a, const void *b, void *udata)
+{
+    const shape_cache_item *ia = a;
+    const shape_cache_item *ib = b;
+    return shape_entry_matches(ia->entry, ib->entry) ? 0 : 1;
+}
+
+static uint64_t shape_item_hash(const void *item, uint64_t seed0, uint64_t seed1)
+{
+    const shape_cache_item *i = item;
+    return i->entry->hash;
+}
+
+static uint64_t shape_key_hash(const shape_entry *key)
+{
+    uint32_t size;
+    memcpy(&size, &key->size, sizeof(uint32_t));
+    uint64_t h = hashmap_sip(key->text, key->textBytes, size, key->encoding);
+    for(int i = 0; i < key->runCount; i++) {
+        h ^= (uint64_t)(uintptr_t)key->runs[i].font + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+        h ^= (uint64_t)key->runs[i].count + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    }
+    return h;
+}
+
+static void lru_unlink(struct shape_cache *cache, shape_entry *e)
+{
+    if(e->prev) e->prev->next = e->next;
+    else cache->head = e->next;
+    if(e->next) e->next->prev = e->prev;
+    else cache->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push_front(struct shape_cache *cache, shape_entry *e)
+{
+    e->prev = NULL;
+    e->next = cache->head;
+    if(cache->head) cache->head->prev = e;
+    cache->head = e;
+    if(!cache->tail) cache->tail = e;
+}
+
+static void entry_free(struct shape_cache *cache, shape_entry *e)
+{
+    lru_unlink(cache, e);
+    hashmap_delete_with_hash(cache->map, &(shape_cache_item){ .entry = e }, e->hash);
+    cache->bytes -= e->bytes;
+    if(e->cursors) {
+        free(e->cursors);
+    }
+    free(e);
+}
+
+// Evicts least recently used entries until the cache fits in budget.
+// keep is never evicted (the entry currently being used)
+static void shapecache_trim(struct shape_cache *cache, shape_entry *keep)
+{
+    while(cache->bytes > cache->budget && cache->tail && cache->tail != keep) {
+        entry_free(cache, cache->tail);
+        cache->evictions++;
+    }
+}
+
+void shapecache_init(blurg_t *blurg)
+{
+    struct shape_cache *cache = &blurg->shapeCache;
+    memset(cache, 0, sizeof(struct shape_cache));
+    cache->budget = BLURG_SHAPE_CACHE_DEFAULT;
+    cache->map = hashmap_new_with_allocator(util_malloc, util_realloc, util_free, sizeof(shape_cache_item), 0, 0, 0, shape_item_hash, shape_item_compare, NULL, NULL);
+}
+
+void shapecache_clear(blurg_t *blurg)
+{
+    struct shape_cache *cache = &blurg->shapeCache;
+    while(cache->head) {
+        entry_free(cache, cache->head);
+    }
+}
+
+// Clearing is deferred to the next shapecache_sync: fonts are added while a chunk
+// is being shaped (system fallbacks) and from the threads of layout contexts,
+// when entries may still be in use.
+void shapecache_invalidate(blurg_t *blurg)
+{
+    blurg_t *owner = blurg->parent ? blurg->parent : blurg;
+    owner->fontEpoch++;
+}
+
+void shapecache_sync(blurg_t *blurg)
+{
+    blurg_t *owner = blurg->parent ? blurg->parent : blurg;
+    // fallbacks loaded by context threads bump the epoch under the lock
+    if(owner->lock) {
+        mutex_lock(owner->lock);
+    }
+    uint32_t epoch = owner->fontEpoch;
+    if(owner->lock) {
+        mutex_unlock(owner->lock);
+    }
+    if(blurg->shapeCache.epoch != epoch) {
+        shapecache_clear(blurg);
+        blurg->shapeCache.epoch = epoch;
+    }
+}
+
+void shapecache_destroy(blurg_t *blurg)
+{
+    shapecache_clear(blurg);
+    hashmap_free(blurg->shapeCache.map);
+}
+
+shape_entry *shapecache_get(blurg_t *blurg, shape_entry *key)
+{
+    struct shape_cache *cache = &blurg->shapeCache;
+    if(!cache->budget) {
+        return NULL;
+    }
+    key->hash = shape_key_hash(key);
+    const shape_cache_item *result = hashmap_get_with_hash(cache->map, &(shape_cache_item){ .entry = key }, key->hash);
+    if(!result) {
+        cache->misses++;
+        return NULL;
+    }
+    cache->hits++;
+    lru_unlink(cache, result->entry);
+    lru_push_front(cache, result->entry);
+    return result->entry;
+}
+
+shape_entry *shapecache_add(blurg_t *blurg, const shape_entry *key, const raqm_glyph_t *glyphs, size_t glyphCount)
+{
+    struct shape_cache *cache = &blurg->shapeCache;
+    size_t textOffset = sizeof(shape_entry);
+    size_t runsOffset = textOffset + ((key->textBytes + 7) & ~7);
+    size_t glyphsOffset = runsOffset + key->runCount * sizeof(shape_face_run);
+    size_t total = glyphsOffset + glyphCount * sizeof(raqm_glyph_t);
+    if(!cache->budget || total > cache->budget) {
+        return NULL;
+    }
+    // single allocation per entry
+    char *block = malloc(total);
+    shape_entry *e = (shape_entry*)block;
+    *e = *key;
+    e->prev = e->next = NULL;
+    e->bytes = total;
+    e->text = block + textOffset;
+    e->runs = (shape_face_run*)(block + runsOffset);
+    e->glyphs = (raqm_glyph_t*)(block + glyphsOffset);
+    e->glyphCount = (int)glyphCount;
+    e->cursors = NULL;
+    memcpy(e->text, key->text, key->textBytes);
+    memcpy(e->runs, key->runs, key->runCount * sizeof(shape_face_run));
+    memcpy(e->glyphs, glyphs, glyphCount * sizeof(raqm_glyph_t));
+
+    hashmap_set_with_hash(cache->map, &(shape_cache_item){ .entry = e }, e->hash);
+    lru_push_front(cache, e);
+    cache->bytes += total;
+    shapecache_trim(cache, e);
+    return e;
+}
+
+int *shapecache_alloc_cursors(blurg_t *blurg, shape_entry *entry, int count)
+{
+    struct shape_cache *cache = &blurg->shapeCache;
+    size_t sz = count * 2 * sizeof(int);
+    entry->cursors = malloc(sz);
+    entry->bytes += sz;
+    cache->bytes += sz;
+    shapecache_trim(cache, entry);
+    return entry->cursors;
+}
+
+BLURGAPI void blurg_set_shape_cache_size(blurg_t *blurg, size_t bytes)
+{
+    ALLOCATOR_ENTER(blurg);
+    struct shape_cache *cache = &blurg->shapeCache;
+    cache->budget = bytes;
+    if(!bytes) {
+        shapecache_clear(blurg);
+    } else {
+        shapecache_trim(cache, NULL);
+    }
+    ALLOCATOR_LEAVE();
+}
@@ -0,0 +1,233 @@
+#include "blurgtext_internal.h"
+#include FT_ADVANCES_H
+#include FT_TRUETYPE_TABLES_H
+#include FT_TRUETYPE_TAGS_H
+#include <string.h>
+
+// Fast path for text that needs no complex shaping.
+// Glyphs come straight from the cmap and advances of the font, skipping BiDi
+// and HarfBuzz. This only applies where the full path would produce exactly
+// the same glyphs: left-to-right Latin, Greek and Cyrillic without combining marks,
+// in fonts without variations or AAT tables. Ligatures and kerning of the font
+// are applied by otlayout.c, for scripts of a font where it can match HarfBuzz.
+
+#define SIMPLE_GLYPH_UNKNOWN (0xFFFF)
+#define SIMPLE_ADVANCE_UNKNOWN (INT32_MIN)
+
+#ifndef TTAG_kerx
+#define TTAG_kerx FT_MAKE_TAG('k', 'e', 'r', 'x')
+#endif
+
+// Unicode script of the code points the fast path lays out.
+// Common characters take the script of the letters around them, as in raqm
+int simpleshape_script(uint32_t c)
+{
+    // printable ASCII
+    if(c >= 0x20 && c <= 0x7E) {
+        return ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') ? ot_script_latin : ot_script_common;
+    }
+    // Latin-1 Supplement, Latin Extended-A/B. Soft hyphen is a default ignorable
+    if(c >= 0xA0 && c <= 0x24F) {
+        if(c == 0xAD)
+            return -1;
+        if(c == 0xAA || c == 0xBA || (c >= 0xC0 && c != 0xD7 && c != 0xF7))
+            return ot_script_latin;
+        return ot_script_common;
+    }
+    // Greek letters, skipping unassigned code points. The ano teleia is common
+    if(c >= 0x386 && c <= 0x3CE) {
+        if(c == 0x38B || c == 0x38D || c == 0x3A2)
+            return -1;
+        return c == 0x387 ? ot_script_common : ot_script_greek;
+    }
+    // Cyrillic, skipping the combining marks
+    if(c >= 0x400 && c < SIMPLE_MAX_CODEPOINT) {
+        return (c < 0x483 || c > 0x489) ? ot_script_cyrillic : -1;
+    }
+    return -1;
+}
+
+static int has_table(FT_Face face, FT_ULong tag)
+{
+    FT_ULong length = 0;
+    return !FT_Load_Sfnt_Table(face, tag, 0, NULL, &length) && length;
+}
+
+// Checked once per font, a font with any of these tables goes through HarfBuzz.
+// GSUB, GPOS and kern are checked per script by otlayout_usable
+static int font_is_simple(blurg_font_t *font)
+{
+    if(!font->simple) {
+        FT_Face face = font->face;
+        int complex = !FT_IS_SFNT(face) ||
+            !FT_IS_SCALABLE(face) ||
+            FT_HAS_MULTIPLE_MASTERS(face) ||
+            has_table(face, TTAG_morx) ||
+            has_table(face, TTAG_mort) ||
+            has_table(face, TTAG_kerx) ||
+            has_table(face, TTAG_trak);
+        font->simple = complex ? -1 : 1;
+    }
+    return font->simple > 0;
+}
+
+static FT_UInt simple_glyph(blurg_font_t *font, uint32_t c)
+{
+    if(!font->simpleGlyphs) {
+        font->simpleGlyphs = malloc(SIMPLE_MAX_CODEPOINT * sizeof(uint16_t));
+        memset(font->simpleGlyphs, 0xFF, SIMPLE_MAX_CODEPOINT * sizeof(uint16_t));
+    }
+    if(font->simpleGlyphs[c] == SIMPLE_GLYPH_UNKNOWN) {
+        FT_UInt index = FT_Get_Char_Index(font->face, c);
+        if(index >= SIMPLE_GLYPH_UNKNOWN)
+            return index;
+        // HarfBuzz zeroes mark advances and lookups may skip them, leave them to the full path
+        if(index && otlayout_is_mark(font, index))
+            index = 0;
+        font->simpleGlyphs[c] = (uint16_t)index;
+    }
+    return font->simpleGlyphs[c];
+}
+
+// Advance in 26.6 for the active size of font
+static int simple_advance(blurg_font_t *font, uint32_t c, FT_UInt index)
+{
+    font_size *entry = font->activeSize;
+    if(!entry->simpleAdvances) {
+        entry->simpleAdvances = malloc(SIMPLE_MAX_CODEPOINT * sizeof(int32_t));
+        simpleshape_reset_advances(entry);
+    }
+    if(entry->simpleAdvances[c] == SIMPLE_ADVANCE_UNKNOWN) {
+        entry->simpleAdvances[c] = simpleshape_glyph_advance(font, index);
+    }
+    return entry->simpleAdvances[c];
+}
+
+int simpleshape_glyph_advance(blurg_font_t *font, FT_UInt index)
+{
+    FT_Fixed v = 0;
+    // same load flags and rounding as HarfBuzz's FreeType font functions
+    FT_Get_Advance(font->face, index, FT_LOAD_DEFAULT | FT_LOAD_NO_HINTING, &v);
+    return (int)((v + (1 << 9)) >> 10);
+}
+
+void simpleshape_reset_advances(font_size *entry)
+{
+    if(entry->simpleAdvances) {
+        for(int i = 0; i < SIMPLE_MAX_CODEPOINT; i++) {
+            entry->simpleAdvances[i] = SIMPLE_ADVANCE_UNKNOWN;
+        }
+    }
+}
+
+void simpleshape_free_font(blurg_font_t *font)
+{
+    otlayout_free(font);
+    free(font->simpleGlyphs);
+    for(int i = 0; i < font->sizeCount; i++) {
+        free(font->sizes[i].simpleAdvances);
+    }
+}
+
+// Decodes one code point at index, returns 0 for anything outside
+// the simple ranges (including all 3 and 4 byte UTF-8 sequences and surrogates)
+static uint32_t simple_codepoint(const void *str, int index, int len, blurg_encoding_t encoding, int *count)
+{
+    if(encoding == blurg_encoding_utf16) {
+        *count = 1;
+        return ((const uint16_t*)str)[index];
+    }
+    const unsigned char *s = (const unsigned char*)str;
+    if(s[index] < 0x80) {
+        *count = 1;
+        return s[index];
+    }
+    if((s[index] & 0xE0) == 0xC0 && index + 1 < len && (s[index + 1] & 0xC0) == 0x80) {
+        *count = 2;
+        return ((uint32_t)(s[index] & 0x1F) << 6) | (s[index + 1] & 0x3F);
+    }
+    // malformed or longer sequences, not simple
+    *count = 1;
+    return 0;
+}
+
+int simpleshape_chunk(blurg_t *blurg, const void *str, int len, blurg_encoding_t encoding,
+    const shape_face_run *runs, int runCount, float size, list_raqm_glyph_t *glyphs)
+{
+    if(!blurg->fastPathEnabled || !runCount || !len)
+        return 0;
+    for(int i = 0; i < runCount; i++) {
+        if(!font_is_simple(runs[i].font))
+            return 0;
+    }
+    list_raqm_glyph_t_ensure_size(glyphs, len);
+    glyphs->count = 0;
+    int run = 0;
+    int runEnd = runs[0].count;
+    // raqm shapes the chunk as one script, text mixing scripts takes the full path
+    int script = ot_script_common;
+    font_use_size(runs[0].font, size);
+    for(int i = 0; i < len;) {
+        while(i >= runEnd) {
+            run++;
+            runEnd += runs[run].count;
+            font_use_size(runs[run].font, size);
+        }
+        blurg_font_t *font = runs[run].font;
+        int count;
+        uint32_t c = simple_codepoint(str, i, len, encoding, &count);
+        int s = simpleshape_script(c);
+        if(s < 0 || i + count > runEnd)
+            return 0;
+        if(s != ot_script_common) {
+            if(script != ot_script_common && script != s)
+                return 0;
+            script = s;
+        }
+        // missing glyphs need fallback fonts
+        FT_UInt index = simple_glyph(font, c);
+        if(!index)
+            return 0;
+        glyphs->data[glyphs->count++] = (raqm_glyph_t){
+            .index = index,
+            .x_advance = simple_advance(font, c, index),
+            .y_advance = 0,
+            .x_offset = 0,
+            .y_offset = 0,
+            .cluster = (uint32_t)i,
+            .ftface = font->face,
+        };
+        i += count;
+    }
+    // each font run is shaped on its own, compacting glyphs removed by ligatures
+    int dst = 0;
+    int src = 0;
+    runEnd = 0;
+    for(int r = 0; r < runCount; r++) {
+        runEnd += runs[r].count;
+        int end = src;
+        while(end < glyphs->count && glyphs->data[end].cluster < (uint32_t)runEnd) {
+            end++;
+        }
+        if(end == src)
+            continue;
+        if(!otlayout_usable(runs[r].font, (ot_script)script))
+            return 0;
+        int count = end - src;
+        if(dst != src) {
+            memmove(&glyphs->data[dst], &glyphs->data[src], count * sizeof(raqm_glyph_t));
+        }
+        font_use_size(runs[r].font, size);
+        otlayout_apply(runs[r].font, (ot_script)script, &glyphs->data[dst], &count);
+        dst += count;
+        src = end;
+    }
+    glyphs->count = dst;
+    blurg->fastPathChunks++;
+    return 1;
+}
+
+BLURGAPI void blurg_set_fast_path(blurg_t *blurg, int enabled)
+{
+    blurg->fastPathEnabled = enabled;
+}
@@ -311,6 +311,9 @@ BLURGAPI int blurg_enable_system_fonts(blurg_t* blurg)
     }
     DWriteFontLookup* lookup = new DWriteFontLookup(dwriteFactory, systemFonts);
     blurg->sysFontData = lookup;
+    // characters without a fallback may now be found
+    font_manager_clear_fallbacks(blurg);
+    shapecache_invalidate(blurg);
     return 1;
 }
 blurg_font_t* blurg_sysfonts_query(blurg_t* blurg, const char* familyName, int weight, int italic, uint32_t character)
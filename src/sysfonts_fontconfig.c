@@ -14,9 +14,14 @@ BLURGAPI int blurg_enable_system_fonts(blurg_t *blurg)
     if(!FcInit()) {
         return 0;
     }
+    ALLOCATOR_ENTER(blurg);
     sysfc *ctx = malloc(sizeof(sysfc));
     blurg->sysFontData = ctx;
     ctx->fc = FcInitLoadConfigAndFonts();
+    // characters without a fallback may now be found
+    font_manager_clear_fallbacks(blurg);
+    shapecache_invalidate(blurg);
+    ALLOCATOR_LEAVE();
     return 1;
 }
 
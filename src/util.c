@@ -1,3 +1,5 @@
+// util.c implements the allocation functions
+#define UTIL_NO_REDIRECT
 #include "util.h"
 #include <stdio.h>
 #include <ctype.h>
@@ -14,7 +16,7 @@ size_t utf16_strlen(uint16_t *text)
 
 char *strlower(const char *name, int *length)
 {
-    char *lw = strdup(name);
+    char *lw = util_strdup(name);
     int l = 0;
     char *p = lw;
     while(*p) {
@@ -54,9 +56,356 @@ unsigned char *read_all_bytes(const char *filename, size_t *length)
     size_t len = ftell(f);
     rewind(f);
 
-    unsigned char *buffer = malloc(len);
+    unsigned char *buffer = util_malloc(len);
     fread(buffer, len, 1, f);
     fclose(f);
     *length = len;
     return buffer;
-}
\ No newline at end of file
+}
+#ifdef _WIN32
+struct _util_mutex {
+    CRITICAL_SECTION cs;
+};
+
+util_mutex *mutex_create(void)
+{
+    util_mutex *mutex = util_malloc(sizeof(util_mutex));
+    InitializeCriticalSection(&mutex->cs);
+    return mutex;
+}
+
+void mutex_lock(util_mutex *mutex)
+{
+    EnterCriticalSection(&mutex->cs);
+}
+
+void mutex_unlock(util_mutex *mutex)
+{
+    LeaveCriticalSection(&mutex->cs);
+}
+
+void mutex_destroy(util_mutex *mutex)
+{
+    DeleteCriticalSection(&mutex->cs);
+    util_free(mutex);
+}
+
+static SRWLOCK globalLock = SRWLOCK_INIT;
+
+static void global_lock(void)
+{
+    AcquireSRWLockExclusive(&globalLock);
+}
+
+static void global_unlock(void)
+{
+    ReleaseSRWLockExclusive(&globalLock);
+}
+#else
+#include <pthread.h>
+struct _util_mutex {
+    pthread_mutex_t m;
+};
+
+util_mutex *mutex_create(void)
+{
+    util_mutex *mutex = util_malloc(sizeof(util_mutex));
+    pthread_mutex_init(&mutex->m, NULL);
+    return mutex;
+}
+
+void mutex_lock(util_mutex *mutex)
+{
+    pthread_mutex_lock(&mutex->m);
+}
+
+void mutex_unlock(util_mutex *mutex)
+{
+    pthread_mutex_unlock(&mutex->m);
+}
+
+void mutex_destroy(util_mutex *mutex)
+{
+    pthread_mutex_destroy(&mutex->m);
+    util_free(mutex);
+}
+
+static pthread_mutex_t globalLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void global_lock(void)
+{
+    pthread_mutex_lock(&globalLock);
+}
+
+static void global_unlock(void)
+{
+    pthread_mutex_unlock(&globalLock);
+}
+#endif
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+static THREAD_LOCAL uint64_t allocations;
+static THREAD_LOCAL const blurg_allocator_t *currentAllocator;
+
+uint64_t util_allocations(void)
+{
+    return allocations;
+}
+
+// Interned allocators, shared by every blurg_t created with the same callbacks
+typedef struct _interned_allocator {
+    blurg_allocator_t allocator;
+    int references;
+    struct _interned_allocator *next;
+} interned_allocator;
+
+static interned_allocator *interned;
+
+const blurg_allocator_t *util_allocator_intern(const blurg_allocator_t *allocator)
+{
+    if(!allocator) {
+        return NULL;
+    }
+    global_lock();
+    interned_allocator *entry = interned;
+    while(entry && memcmp(&entry->allocator, allocator, sizeof(blurg_allocator_t))) {
+        entry = entry->next;
+    }
+    if(entry) {
+        entry->references++;
+    } else {
+        entry = malloc(sizeof(interned_allocator));
+        entry->allocator = *allocator;
+        entry->references = 1;
+        entry->next = interned;
+        interned = entry;
+    }
+    global_unlock();
+    return &entry->allocator;
+}
+
+void util_allocator_release(const blurg_allocator_t *allocator)
+{
+    if(!allocator) {
+        return;
+    }
+    global_lock();
+    interned_allocator **link = &interned;
+    while(*link && &(*link)->allocator != allocator) {
+        link = &(*link)->next;
+    }
+    interned_allocator *entry = *link;
+    if(entry && !--entry->references) {
+        *link = entry->next;
+        free(entry);
+    }
+    global_unlock();
+}
+
+const blurg_allocator_t *util_allocator_enter(const blurg_allocator_t *allocator)
+{
+    const blurg_allocator_t *previous = currentAllocator;
+    currentAllocator = allocator;
+    return previous;
+}
+
+void util_allocator_leave(const blurg_allocator_t *previous)
+{
+    currentAllocator = previous;
+}
+
+// Without an allocator on the thread this is plain malloc, a block has to be resized
+// and freed with the allocator it was allocated with
+void *util_malloc(size_t size)
+{
+#if BT_COUNT_ALLOCATIONS
+    allocations++;
+#endif
+    if(!currentAllocator) {
+        return malloc(size);
+    }
+    return currentAllocator->allocate(currentAllocator->userdata, size);
+}
+
+void *util_calloc(size_t count, size_t size)
+{
+    if(!currentAllocator) {
+#if BT_COUNT_ALLOCATIONS
+        allocations++;
+#endif
+        return calloc(count, size);
+    }
+    void *ptr = util_malloc(count * size);
+    if(ptr) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+void *util_realloc(void *ptr, size_t size)
+{
+    if(!ptr) {
+        return util_malloc(size);
+    }
+#if BT_COUNT_ALLOCATIONS
+    allocations++;
+#endif
+    if(!currentAllocator) {
+        return realloc(ptr, size);
+    }
+    return currentAllocator->reallocate(currentAllocator->userdata, ptr, size);
+}
+
+void util_free(void *ptr)
+{
+    if(!ptr) {
+        return;
+    }
+    if(!currentAllocator) {
+        free(ptr);
+        return;
+    }
+    currentAllocator->release(currentAllocator->userdata, ptr);
+}
+
+// Exported blocks start with a copy of the allocator they came from (zero for malloc),
+// padded to keep the alignment of malloc
+#define EXPORT_HEADER ((sizeof(blurg_allocator_t) + 15) & ~(size_t)15)
+
+void *util_export_malloc(size_t size)
+{
+    char *block = util_malloc(size + EXPORT_HEADER);
+    if(!block) {
+        return NULL;
+    }
+    if(currentAllocator) {
+        memcpy(block, currentAllocator, sizeof(blurg_allocator_t));
+    } else {
+        memset(block, 0, sizeof(blurg_allocator_t));
+    }
+    return block + EXPORT_HEADER;
+}
+
+void *util_export_calloc(size_t count, size_t size)
+{
+    void *ptr = util_export_malloc(count * size);
+    if(ptr) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+void *util_export_realloc(void *ptr, size_t size)
+{
+    if(!ptr) {
+        return util_export_malloc(size);
+    }
+#if BT_COUNT_ALLOCATIONS
+    allocations++;
+#endif
+    char *block = (char*)ptr - EXPORT_HEADER;
+    blurg_allocator_t allocator;
+    memcpy(&allocator, block, sizeof(blurg_allocator_t));
+    block = allocator.reallocate
+        ? allocator.reallocate(allocator.userdata, block, size + EXPORT_HEADER)
+        : realloc(block, size + EXPORT_HEADER);
+    return block ? block + EXPORT_HEADER : NULL;
+}
+
+void util_export_free(void *ptr)
+{
+    if(!ptr) {
+        return;
+    }
+    char *block = (char*)ptr - EXPORT_HEADER;
+    blurg_allocator_t allocator;
+    memcpy(&allocator, block, sizeof(blurg_allocator_t));
+    if(allocator.release) {
+        allocator.release(allocator.userdata, block);
+    } else {
+        free(block);
+    }
+}
+
+char *util_strdup(const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = util_malloc(len);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+#define ARENA_ALIGN 16
+#define ARENA_MIN_BLOCK (16 * 1024)
+
+struct _arena_overflow {
+    arena_overflow *next;
+};
+
+void arena_init(util_arena *arena)
+{
+    memset(arena, 0, sizeof(util_arena));
+}
+
+void *arena_alloc(util_arena *arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    void *ptr;
+    if(arena->block && arena->used + size <= arena->capacity) {
+        ptr = arena->block + arena->used;
+        arena->used += size;
+    } else {
+        // header padded so the allocation stays aligned
+        arena_overflow *o = util_malloc(ARENA_ALIGN + size);
+        o->next = arena->overflow;
+        arena->overflow = o;
+        arena->overflowBytes += size;
+        ptr = (char*)o + ARENA_ALIGN;
+    }
+    if(arena->used + arena->overflowBytes > arena->highWater) {
+        arena->highWater = arena->used + arena->overflowBytes;
+    }
+    return ptr;
+}
+
+arena_mark arena_save(util_arena *arena)
+{
+    return (arena_mark){ .used = arena->used, .overflow = arena->overflow, .overflowBytes = arena->overflowBytes };
+}
+
+void arena_restore(util_arena *arena, arena_mark mark)
+{
+    while(arena->overflow != mark.overflow) {
+        arena_overflow *next = arena->overflow->next;
+        util_free(arena->overflow);
+        arena->overflow = next;
+    }
+    arena->used = mark.used;
+    arena->overflowBytes = mark.overflowBytes;
+}
+
+void arena_reset(util_arena *arena)
+{
+    arena_restore(arena, (arena_mark){ 0 });
+    if(arena->highWater > arena->capacity) {
+        size_t capacity = arena->capacity ? arena->capacity : ARENA_MIN_BLOCK;
+        while(capacity < arena->highWater) {
+            capacity *= 2;
+        }
+        util_free(arena->block);
+        arena->block = util_malloc(capacity);
+        arena->capacity = capacity;
+    }
+}
+
+void arena_free(util_arena *arena)
+{
+    arena_restore(arena, (arena_mark){ 0 });
+    util_free(arena->block);
+    memset(arena, 0, sizeof(util_arena));
+}
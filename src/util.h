@@ -18,10 +18,70 @@
 #define stackalloc alloca
 #endif
 #include <stdint.h>
+#include <stdlib.h>
+#include <blurgtext.h>
 /* Creates a lowercase copy of the string, and puts the length of the string in length*/
 char *strlower(const char *name, int *length);
 /* Reads all bytes of filename into a memory buffer*/
 unsigned char *read_all_bytes(const char *filename, size_t *length);
 /* Returns the length of a null terminated utf-16 string*/
 size_t utf16_strlen(uint16_t *text);
+/* Non-recursive mutex, a CRITICAL_SECTION on Windows and a pthread mutex elsewhere*/
+typedef struct _util_mutex util_mutex;
+util_mutex *mutex_create(void);
+void mutex_lock(util_mutex *mutex);
+void mutex_unlock(util_mutex *mutex);
+void mutex_destroy(util_mutex *mutex);
+/* Bump allocator for temporary memory of a build. Allocations are released in reverse order by
+   restoring an arena_mark. Memory that doesn't fit the block comes from the heap until arena_reset*/
+typedef struct _arena_overflow arena_overflow;
+typedef struct {
+    char *block;
+    size_t capacity;
+    size_t used;
+    // heap allocations made while the block was full
+    arena_overflow *overflow;
+    size_t overflowBytes;
+    // most bytes in use at once
+    size_t highWater;
+} util_arena;
+typedef struct {
+    size_t used;
+    arena_overflow *overflow;
+    size_t overflowBytes;
+} arena_mark;
+void arena_init(util_arena *arena);
+void *arena_alloc(util_arena *arena, size_t size);
+arena_mark arena_save(util_arena *arena);
+void arena_restore(util_arena *arena, arena_mark mark);
+/* Called when nothing is allocated from the arena, grows the block to the high water mark*/
+void arena_reset(util_arena *arena);
+void arena_free(util_arena *arena);
+/* Library memory comes from the allocator of the blurg_t in use on the calling thread (see blurg_create_ex),
+   or from malloc when there is none. A block has to be resized and freed under the same allocator*/
+void *util_malloc(size_t size);
+void *util_calloc(size_t count, size_t size);
+void *util_realloc(void *ptr, size_t size);
+void util_free(void *ptr);
+char *util_strdup(const char *str);
+/* Memory handed to the caller, e.g. the arrays of a blurg_result_t. Each block remembers its allocator,
+   so it can be resized and freed on any thread, also after the blurg_t is destroyed*/
+void *util_export_malloc(size_t size);
+void *util_export_calloc(size_t count, size_t size);
+void *util_export_realloc(void *ptr, size_t size);
+void util_export_free(void *ptr);
+/* Returns a shared copy of allocator, NULL for the default allocator. Release it with util_allocator_release*/
+const blurg_allocator_t *util_allocator_intern(const blurg_allocator_t *allocator);
+void util_allocator_release(const blurg_allocator_t *allocator);
+/* Makes allocations on this thread use allocator until util_allocator_leave, returns the previous one*/
+const blurg_allocator_t *util_allocator_enter(const blurg_allocator_t *allocator);
+void util_allocator_leave(const blurg_allocator_t *previous);
+/* Heap allocations made on the calling thread, only counted when built with BT_COUNT_ALLOCATIONS*/
+uint64_t util_allocations(void);
+#if !defined(__cplusplus) && !defined(UTIL_NO_REDIRECT)
+#define malloc(size) util_malloc(size)
+#define calloc(count, size) util_calloc(count, size)
+#define realloc(ptr, size) util_realloc(ptr, size)
+#define free(ptr) util_free(ptr)
+#endif
 #endif
\ No newline at end of file